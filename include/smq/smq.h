@@ -3,6 +3,10 @@
 
 #include <mqueue.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
 
 #ifndef SMQ_MAX_MSG_SIZE
 #define SMQ_MAX_MSG_SIZE 8192// Get this from /proc/sys/fs/mqueue/msgsize_default
@@ -12,6 +16,10 @@
 #define SMQ_MAX_MSG_COUNT 10// Get this from /proc/sys/fs/mqueue/msg_default
 #endif// SMQ_MAX_MSG_COUNT
 
+#ifndef SMQ_MAX_ROUTE_ID
+#define SMQ_MAX_ROUTE_ID 1023// Highest router route id, bounds the dense dispatch table to SMQ_MAX_ROUTE_ID + 1 pointers
+#endif// SMQ_MAX_ROUTE_ID
+
 #if __STDC_VERSION__ > 201112L || __STDC_NO_ATOMICS__ == 0
 #define SMQ_HAS_ATOMICS
 #endif
@@ -20,6 +28,34 @@
 #include <stdatomic.h>
 #endif// SMQ_HAS_ATOMICS
 
+// The shared-memory backend needs futex(2) through syscall(2), so it is Linux only and wants _GNU_SOURCE or _DEFAULT_SOURCE.
+#if defined(SMQ_HAS_ATOMICS) && defined(__linux__) && (defined(_GNU_SOURCE) || defined(_DEFAULT_SOURCE))
+#define SMQ_HAS_SHM
+#endif
+
+// On Linux a mqd_t is a file descriptor, so many listener queues can be multiplexed with epoll.
+#if defined(SMQ_HAS_ATOMICS) && defined(__linux__)
+#define SMQ_HAS_REACTOR
+#endif
+
+// Pinning threads needs cpu_set_t and pthread_setaffinity_np, which glibc only declares with _GNU_SOURCE.
+#if defined(__linux__) && defined(_GNU_SOURCE)
+#define SMQ_HAS_AFFINITY
+#endif
+
+// Per-listener counters cost a few relaxed atomic adds and two clock reads per request, define SMQ_NO_METRICS to compile them out.
+#if defined(SMQ_HAS_ATOMICS) && !defined(SMQ_NO_METRICS)
+#define SMQ_HAS_METRICS
+#endif
+
+// Request tracing records into a ring per thread behind a _Thread_local pointer, define SMQ_NO_TRACING to compile it out.
+#if defined(SMQ_HAS_ATOMICS) && !defined(SMQ_NO_TRACING)
+#define SMQ_HAS_TRACING
+#endif
+
+#define SMQ_CHANNEL_BACKEND_MQ 0// POSIX mq, portable default
+#define SMQ_CHANNEL_BACKEND_SHM 1// shm_open + mmap ring of fixed slots, requires SMQ_HAS_SHM
+
 typedef struct
 {
     long maxmsgsize;
@@ -28,6 +64,9 @@ typedef struct
     mode_t mode;
     int oflag;
     char path[255];
+    int backend;
+    void *ring;// SMQ_CHANNEL_BACKEND_SHM mapping
+    size_t mapsize;
 } smq_channel;
 
 typedef struct
@@ -36,18 +75,56 @@ typedef struct
     unsigned int priority;
 } smq_channel_transmission_options;
 
+// Spin-then-block receive state, owned by the one thread that receives with it.
+typedef struct
+{
+    unsigned long max_us;// longest spin before the kernel wait, 0 never spins
+    unsigned long wait_us;// moving average of how long a receive waited for its message
+    unsigned long budget_us;// spin of the next receive, twice wait_us while that fits in max_us, 0 otherwise
+} smq_busy_poll;
+
+typedef struct
+{
+    char *data;
+    size_t size;// capacity, used by listen
+    size_t length;// bytes to send, or bytes received
+} smq_channel_buffer;
+
 #define SMQ_STATUS_REQUEST 0x0F
 #define SMQ_STATUS_RESPONSE 0xF0
 
+// header.status of a response
+#define SMQ_STATUS_OK 0x00
+#define SMQ_STATUS_TOO_LARGE 0x01// handler reported more payload than the route carries, the response is sent empty
+#define SMQ_STATUS_OVERLOADED 0x02// the listener shed the request without running the handler
+#define SMQ_STATUS_STALE 0x03// the request's slab slot was reclaimed before the listener could read it
+#define SMQ_STATUS_UNDECODABLE 0x04// the request was compressed but the listener has no codec or could not decode it
+#define SMQ_STATUS_NO_ROUTE 0x05// a router listener has no route for the request's header.route
+#define SMQ_STATUS_EXPIRED 0x06// set by the client on an asynchronous request whose .ttl_ms passed without a response
+#define SMQ_STATUS_USER 0x10// first status a span handler may return (negated), up to 0xFF
+
+#define SMQ_FLAG_PRIVATE_REPLY 0x01// response goes to the client's own reply queue "<path>-reply-<clientid>"
+#define SMQ_FLAG_OFFLOADED 0x02// payload is an smq_slab_descriptor, the data itself lives in a shared-memory slab
+#define SMQ_FLAG_COMPRESSED 0x04// payload went through the route's codec
+#define SMQ_FLAG_ACCEPTS_CODEC 0x08// the client decodes responses, so the listener may compress them
+#define SMQ_FLAG_TRACED 0x10// sampled by the client, every stage the request and its response pass records a trace event
+
 typedef struct
 {
     uint16_t clientid;
     uint8_t status;
     uint8_t isresponse;
+    uint8_t flags;
+    uint16_t schema;// SMQ_SCHEMA id of the payload, 0 for untyped payloads, fills padding so the header keeps its size
+    uint32_t length;// payload bytes actually used, only header plus this much goes over the wire
+    uint32_t seq;// correlation id, echoed back in the response
+    uint16_t route;// handler of a router listener (smq_server_add_route), ids start at 1
+    uint32_t reply_tag;// differs every time a client creates its reply queue, fills padding so the header keeps its size
+    uint64_t deadline_ms;// absolute CLOCK_MONOTONIC ms after which nobody waits for the response, 0 means none
 } smq_msg_header;
 
-#define SMQ_HEADER_SIZE sizeof(((smq_msg_header *)0)->clientid) + sizeof(((smq_msg_header *)0)->status) + sizeof(((smq_msg_header *)0)->isresponse)
-#define SMQ_PAYLOAD_SIZE (SMQ_MAX_MSG_SIZE) - (SMQ_HEADER_SIZE)
+#define SMQ_HEADER_SIZE (sizeof(smq_msg_header))
+#define SMQ_PAYLOAD_SIZE ((SMQ_MAX_MSG_SIZE) - (SMQ_HEADER_SIZE))
 
 typedef struct
 {
@@ -55,40 +132,374 @@ typedef struct
     char payload[SMQ_PAYLOAD_SIZE];
 } smq_message;
 
+// Encodes or decodes length bytes of src into dst, returns the bytes written or a negated errno, -ENOSPC when capacity is too small.
+typedef int (*smq_codec_fn)(const char *src, size_t length, char *dst, size_t capacity);
+
+// Payload transform both ends of a route agree on, a zeroed codec leaves payloads as they are.
+typedef struct
+{
+    smq_codec_fn encode;
+    smq_codec_fn decode;
+    size_t threshold;// shorter payloads are sent as they are
+    unsigned int min_saving_pct;// payloads that would not shrink by at least this much are sent as they are
+} smq_codec;
+
+#define SMQ_DEFAULT_CODEC_THRESHOLD 256
+#define SMQ_DEFAULT_CODEC_MIN_SAVING 10
+
+#ifdef SMQ_HAS_ATOMICS
+#define SMQ_CACHELINE_SIZE 64
+
+typedef struct
+{
+    atomic_size_t sequence;
+    void *data;
+} smq_mpmc_cell;
+
+// Bounded lock-free multi producer multi consumer queue of pointers, capacity is rounded up to a power of two.
+typedef struct
+{
+    smq_mpmc_cell *cells;
+    size_t mask;
+    char pad0[SMQ_CACHELINE_SIZE];
+    atomic_size_t enqueue_pos;
+    char pad1[SMQ_CACHELINE_SIZE - sizeof(atomic_size_t)];
+    atomic_size_t dequeue_pos;
+    char pad2[SMQ_CACHELINE_SIZE - sizeof(atomic_size_t)];
+} smq_mpmc_queue;
+
+// Fixed arena of messages handed out through a lock-free freelist, nothing is allocated after smq_message_pool_init.
+typedef struct
+{
+    smq_message *arena;
+    size_t capacity;
+    smq_mpmc_queue free;
+} smq_message_pool;
+
+#define SMQ_MESSAGE_CACHE_SIZE 16
+
+// Owned by a single thread, only touches the shared freelist once every SMQ_MESSAGE_CACHE_SIZE / 2 messages.
+typedef struct
+{
+    smq_message_pool *pool;
+    size_t count;
+    smq_message *messages[SMQ_MESSAGE_CACHE_SIZE];
+} smq_message_cache;
+#endif// SMQ_HAS_ATOMICS
+
 typedef struct smq_server_t smq_server;
 typedef struct smq_server_listener_t smq_server_listener;
+typedef struct smq_response_cache_t smq_response_cache;
+typedef struct smq_slab_t smq_slab;
+
+// Request payload as received, valid only during the handler call.
+typedef struct
+{
+    const char *data;
+    size_t length;
+} smq_request_view;
+
+// Where the response payload goes, straight into the buffer the server sends from.
+typedef struct
+{
+    char *data;
+    size_t capacity;
+} smq_response_span;
+
+// Returns the response payload length, or a negated status (e.g. -SMQ_STATUS_USER) sent back with an empty payload.
+typedef int (*smq_span_handler)(smq_request_view request, smq_response_span response);
+
+// Gets every request of one gathered batch at once, responses[i] answers requests[i] and starts out max_payload long.
+typedef void (*smq_batch_handler)(smq_message **requests, smq_message **responses, size_t count);
+
+// One handler of a router listener, picked by header.route.
+typedef struct
+{
+    uint16_t id;
+    void (*handler)(smq_message *request, smq_message *response);
+    smq_span_handler span_handler;// used instead of handler when set
+} smq_route;
+
+#define SMQ_MAX_LANES 8
+
+// Where a server thread runs, fields left 0 keep the pthread defaults.
+typedef struct
+{
+    uint64_t cpus;// bit i allows CPU i, needs SMQ_HAS_AFFINITY
+    int fifo_priority;// > 0 runs the thread SCHED_FIFO at this priority, needs CAP_SYS_NICE
+    size_t stack_size;// bytes, the thread smq_server_start is called on keeps its own stack
+} smq_thread_options;
+
+typedef struct
+{
+    size_t workers;// 0 runs the handler on the receiving thread, needs SMQ_HAS_ATOMICS otherwise
+    int backend;// SMQ_CHANNEL_BACKEND_*
+    size_t batch_size;// messages taken per wakeup, 0 uses SMQ_DEFAULT_LISTENER_BATCH
+    size_t max_payload;// payload bytes this route carries, 0 uses the server's, at most SMQ_PAYLOAD_SIZE
+    long queue_depth;// messages the route queue holds, 0 uses the server's
+    size_t lanes;// > 1 adds queues "<path>-lane<i>" served by deficit round robin, mq backend on Linux only
+    unsigned int lane_weights[SMQ_MAX_LANES];// messages a lane may take per round, 0 counts as 1
+    long shed_queue_depth;// > 0 answers SMQ_STATUS_OVERLOADED without running the handler while this many messages wait
+    unsigned long shed_handler_us;// > 0 does the same while the average handler run takes longer than this
+    size_t cache_entries;// > 0 caches responses by request payload, only for handlers whose answer depends on nothing else
+    long cache_ttl_ms;// 0 keeps cached responses until they are evicted
+    smq_slab *slab;// resolves SMQ_FLAG_OFFLOADED requests for span handlers and frees their slot once handled, needs SMQ_HAS_SHM
+    smq_thread_options thread;// receive thread, pinned listeners also get message buffers on their own NUMA node
+    smq_thread_options worker_thread;// every thread of .workers
+    unsigned long busy_poll_us;// > 0 spins up to this long for requests before sleeping, single lane listeners only
+    unsigned long batch_delay_us;// batch listeners wait up to this long after the first request for .batch_size of them
+    smq_codec codec;// decodes compressed requests, compresses responses for clients that accept it and lets them grow to SMQ_PAYLOAD_SIZE
+} smq_server_listener_options;
+
+#define SMQ_DEFAULT_LISTENER_BATCH 8
+
+#define SMQ_METRICS_HISTOGRAM_BUCKETS 32// bucket i counts handler runs of [2^i, 2^(i+1)) microseconds, bucket 0 also takes 0
+
+#ifdef SMQ_HAS_METRICS
+typedef struct
+{
+    atomic_ulong requests;
+    atomic_ulong bytes_in;
+    atomic_ulong bytes_out;
+    atomic_ulong timeouts;
+    atomic_ulong send_retries;
+    atomic_ulong expired;
+    atomic_ulong shed;
+    atomic_ulong cache_hits;
+    atomic_ulong cache_misses;
+    atomic_ulong reply_opens;
+    atomic_ulong handler_us[SMQ_METRICS_HISTOGRAM_BUCKETS];
+} smq_listener_metrics;
+#endif// SMQ_HAS_METRICS
+
+typedef struct
+{
+    const char *path;// points into the listener, valid until smq_server_destroy
+    unsigned long requests;
+    unsigned long bytes_in;// request payload bytes
+    unsigned long bytes_out;// response payload bytes
+    unsigned long timeouts;// responses dropped because a private reply queue stayed full
+    unsigned long send_retries;// shared queue sends repeated after a timeout
+    unsigned long expired;// requests or responses dropped because their deadline had passed
+    unsigned long shed;// requests answered with SMQ_STATUS_OVERLOADED
+    unsigned long cache_hits;// requests answered from the response cache without running the handler
+    unsigned long cache_misses;
+    unsigned long reply_opens;// private reply queues opened, one per client as long as sends to it succeed
+    unsigned long requeued;
+    long queue_depth;// messages waiting when sampled, -1 if unknown
+    unsigned long handler_us[SMQ_METRICS_HISTOGRAM_BUCKETS];
+} smq_listener_stats;
+
+#define SMQ_REPLY_TABLE_MIN 16// first size of a listener's reply table, it doubles whenever it is half full
+
+typedef struct
+{
+    pthread_mutex_t lock;// held across the send, only replies to this client wait on it
+    uint16_t clientid;
+    uint32_t reply_tag;
+    smq_channel channel;// desc is -1 while the queue is closed
+} smq_reply_slot;
+
+// Open reply queues by clientid, slots are never moved or freed before the listener so they can be used unlocked from the table.
+typedef struct
+{
+    pthread_mutex_t lock;// guards the index only, never held across a send
+    smq_reply_slot **slots;// open addressing, capacity is a power of two
+    size_t capacity;
+    size_t count;
+} smq_reply_table;
 
 struct smq_server_listener_t
 {
-    smq_channel channel;
+    smq_channel channel;// lane 0
+    smq_channel *lanes;// lanes 1 to options.lanes - 1
     void (*handler)(smq_message *request, smq_message *response);
+    smq_span_handler span_handler;// used instead of handler when set
+    smq_batch_handler batch_handler;// used instead of both when set
+    smq_message **gathered;// requests then responses handed to batch_handler, receive thread only
+    bool router;// dispatches by header.route instead of handler
+    smq_route *routes;// in the order they were added
+    size_t route_count;
+    const smq_route **route_table;// indexed by route id, built by smq_server_start
+    size_t route_table_size;
+    smq_server_listener_options options;
+    smq_busy_poll busy_poll;// receive thread only
     struct smq_server_listener *next;
     smq_server *parent_server;
+    smq_response_cache *cache;// set when options.cache_entries > 0
+    smq_reply_table replies;// shared by every thread that answers
     pthread_t thread;
 #ifdef SMQ_HAS_ATOMICS
     atomic_bool is_listening;
+    atomic_ulong requeued;
+    atomic_ulong handler_avg_us;// moving average, only kept when options.shed_handler_us is set
+    smq_message_pool pool;// buffers of a pinned listener, allocated by its own thread
 #else
     bool is_listening;
+    unsigned long requeued;
+    unsigned long handler_avg_us;
 #endif
+#ifdef SMQ_HAS_METRICS
+    smq_listener_metrics metrics;
+#endif// SMQ_HAS_METRICS
 };
 
+typedef struct
+{
+    size_t reactor_threads;// > 0 multiplexes all mq listeners over this many epoll threads, needs SMQ_HAS_REACTOR
+    size_t spare_messages;// pool messages on top of what the listeners need, for handlers through smq_server_message_pool
+    size_t max_payload;// default for listeners, 0 uses SMQ_PAYLOAD_SIZE
+    long queue_depth;// default for listeners, 0 uses SMQ_MAX_MSG_COUNT
+    smq_thread_options reactor_thread;// every reactor thread, including the one smq_server_start runs on
+} smq_server_options;
+
 struct smq_server_t
 {
     smq_server_listener *listeners;
     char name[255];
+    smq_server_options options;
 #ifdef SMQ_HAS_ATOMICS
     atomic_bool running;
+    smq_message_pool pool;// listener buffers, sized by smq_server_start
 #else
     bool running;
 #endif
+#ifdef SMQ_HAS_REACTOR
+    int reactor_epoll;
+    int reactor_event;// eventfd that wakes every reactor thread on stop
+    pthread_t *reactor_threads;
+    atomic_size_t reactors_running;
+#endif// SMQ_HAS_REACTOR
 };
 
+typedef uint32_t smq_request_id;
+
+#define SMQ_REQUEST_FREE 0
+#define SMQ_REQUEST_PENDING 1
+#define SMQ_REQUEST_DONE 2
+
+typedef struct
+{
+    uint32_t seq;
+    int state;
+    uint64_t deadline_ms;// header.deadline_ms of the request, 0 waits for the response as long as the caller does
+    smq_message *response;
+    void (*callback)(smq_message *response, void *userdata);
+    void *userdata;
+} smq_client_inflight;
+
 typedef struct
 {
     smq_channel channel;
+    smq_channel reply;// only open when created with .private_reply
     uint16_t id;
+    // Asynchronous requests, only set up when created with .max_inflight
+    uint32_t next_seq;
+    smq_client_inflight *inflight;
+    size_t inflight_capacity;
+    size_t pending;
+    smq_message *scratch;
+    smq_busy_poll *busy_poll;// only set up when created with .busy_poll_us
+    smq_codec codec;
+    smq_message *wire;// compressed copy of a request, only set up when created with .codec
+    uint16_t route;// 0 leaves header.route to the caller
+    uint32_t reply_tag;// new with every reply queue, so listeners notice a queue re-created under the same id
 } smq_client;
 
+typedef struct
+{
+    bool private_reply;
+    long reply_maxmsgcount;
+    int backend;// SMQ_CHANNEL_BACKEND_*, must match the listener's
+    size_t max_inflight;// > 0 enables smq_client_submit, implies .private_reply
+    size_t lane;// > 0 sends to that priority lane of the route, implies .private_reply
+    uint16_t route;// > 0 is stamped into every request, for clients of a router listener
+    bool unique_id;// ignores id and claims one no other client of the route holds, implies .private_reply
+    unsigned long busy_poll_us;// > 0 spins up to this long for a response before sleeping, implies .private_reply
+    smq_codec codec;// compresses requests and accepts compressed responses, the listener needs the same codec
+} smq_client_options;
+
+typedef struct
+{
+    long timeout_ms;
+    unsigned int priority;
+    void (*callback)(smq_message *response, void *userdata);// runs from smq_client_poll/smq_client_wait, the request is freed afterwards
+    void *userdata;
+    long ttl_ms;// > 0 lets the server drop the request once it has waited this long
+} smq_client_submit_options;
+
+#define SMQ_DEFAULT_REPLY_MSG_COUNT 2
+
+#ifdef SMQ_HAS_ATOMICS
+#define SMQ_DEFAULT_CLIENT_POOL_SIZE 8
+
+// Clients of one route kept open for any thread to borrow, every client is used by one thread at a time.
+typedef struct
+{
+    smq_client *clients;
+    size_t count;
+    smq_mpmc_queue idle;
+} smq_client_pool;
+
+typedef struct
+{
+    size_t clients;// 0 uses SMQ_DEFAULT_CLIENT_POOL_SIZE
+    int backend;// SMQ_CHANNEL_BACKEND_*, must match the listener's
+    long reply_maxmsgcount;
+    size_t lane;
+    smq_codec codec;
+    uint16_t route;
+} smq_client_pool_options;
+#endif// SMQ_HAS_ATOMICS
+
+#ifdef SMQ_HAS_SHM
+#define SMQ_DEFAULT_BROADCAST_SLOTS 64
+
+// Writes every message once into a shared-memory ring that any number of subscribers read, the publisher never waits for them.
+typedef struct
+{
+    smq_channel channel;// mapping of the broadcast ring, maxmsgsize/maxmsgcount hold its geometry
+} smq_publisher;
+
+typedef struct
+{
+    smq_channel channel;
+    size_t cursor;// sequence of the next message to read
+    unsigned long lost;// messages the publisher overwrote before this subscriber read them
+} smq_subscriber;
+
+typedef struct
+{
+    size_t slot_size;// largest message, 0 uses sizeof(smq_message)
+    size_t slot_count;// messages kept for slow subscribers, rounded up to a power of two, 0 uses SMQ_DEFAULT_BROADCAST_SLOTS
+} smq_publisher_options;
+
+#define SMQ_DEFAULT_SLAB_SLOT_SIZE (1024 * 1024)
+#define SMQ_DEFAULT_SLAB_SLOTS 16
+
+// Where an offloaded payload lives, travels in the message payload instead of the data.
+typedef struct
+{
+    uint64_t offset;// from the start of the slab data area, a multiple of the slot size
+    uint32_t length;
+    uint32_t generation;// bumped on every allocation and release of the slot, a mismatch means the descriptor is stale
+} smq_slab_descriptor;
+
+// Fixed-size slots in a shm segment that every process maps once, slots are claimed with a lock-free bitmap.
+struct smq_slab_t
+{
+    smq_channel channel;// mapping of the slab, maxmsgsize/maxmsgcount hold slot size and count
+    size_t threshold;// smq_message_write_slab keeps payloads up to this size inline
+};
+
+typedef struct
+{
+    size_t slot_size;// largest payload, 0 uses SMQ_DEFAULT_SLAB_SLOT_SIZE
+    size_t slot_count;// 0 uses SMQ_DEFAULT_SLAB_SLOTS
+    size_t threshold;// 0 uses SMQ_PAYLOAD_SIZE
+} smq_slab_options;
+#endif// SMQ_HAS_SHM
+
 static inline int smq_channel_create(smq_channel *channel);
 static inline void smq_channel_close(const smq_channel *channel);
 static inline void smq_channel_destroy(const smq_channel *channel);
@@ -103,23 +514,241 @@ static inline int smq_channel_timed_listen(const smq_channel *channel, char *dat
 static inline int __smq_channel_send(const smq_channel *channel, const char *data, const size_t size, const smq_channel_transmission_options options);
 static inline int smq_channel_blocking_send(const smq_channel *channel, const char *data, const size_t size, int priority);
 static inline int smq_channel_timed_send(const smq_channel *channel, const char *data, const size_t size, int priority, long timeout);
+#define smq_channel_send_batch(channel, buffers, count, ...) \
+    __smq_channel_send_batch(channel, buffers, count, (smq_channel_transmission_options){ __VA_ARGS__ })
+static inline int __smq_channel_send_batch(const smq_channel *channel, const smq_channel_buffer *buffers, const size_t count, smq_channel_transmission_options options);
+#define smq_channel_listen_batch(channel, buffers, count, ...) \
+    __smq_channel_listen_batch(channel, buffers, count, (smq_channel_transmission_options){ __VA_ARGS__ })
+static inline int __smq_channel_listen_batch(const smq_channel *channel, smq_channel_buffer *buffers, const size_t count, smq_channel_transmission_options options);
+static inline int __smq_channel_drain(const smq_channel *channel, smq_channel_buffer *buffers, const size_t count);
+static inline void smq_busy_poll_init(smq_busy_poll *state, unsigned long max_us);
+static inline int smq_channel_busy_listen(const smq_channel *channel, char *data, const size_t size, long timeout_ms, smq_busy_poll *state);
+
+static inline void smq_message_set_length(smq_message *message, size_t length);
+static inline size_t smq_message_length(const smq_message *message);
+static inline size_t smq_message_size(const smq_message *message);
+static inline int smq_message_write(smq_message *message, const void *data, size_t length);
+static inline void smq_message_clear(smq_message *message);
+static inline int smq_lz_compress(const char *src, size_t length, char *dst, size_t capacity);
+static inline int smq_lz_decompress(const char *src, size_t length, char *dst, size_t capacity);
+static inline smq_codec smq_codec_lz(void);
+
+// Typed payloads, LIST is an X-macro of FIELD(s, type, name) and ARRAY(s, type, name, count) entries that passes s through.
+// SMQ_SCHEMA(quote, 7, LIST) defines quote_layout, quote_schema_id, quote_size, quote_init, quote_check and per field
+// quote_get_<name> (unchecked), quote_read_<name> (schema and length checked) and quote_set_<name>, all working on the payload in place.
+// Array setters take the number of elements given, at most count, and zero the rest of the array.
+#define SMQ_SCHEMA(s, id, LIST) \
+    typedef struct \
+    { \
+        LIST(__SMQ_SCHEMA_MEMBER, __SMQ_SCHEMA_ARRAY_MEMBER, s) \
+    } s##_layout; \
+    _Static_assert(sizeof(s##_layout) <= SMQ_PAYLOAD_SIZE, #s " does not fit in SMQ_PAYLOAD_SIZE"); \
+    _Static_assert(_Alignof(s##_layout) <= _Alignof(smq_msg_header), #s " needs more alignment than a payload"); \
+    _Static_assert((id) > 0 && (id) <= UINT16_MAX, #s " needs a schema id from 1 to UINT16_MAX"); \
+    enum { s##_schema_id = (id), s##_size = sizeof(s##_layout) }; \
+    static inline void s##_init(smq_message *message) \
+    { \
+        memset(message->payload, 0x00, sizeof(s##_layout)); \
+        message->header.schema = s##_schema_id; \
+        message->header.length = sizeof(s##_layout); \
+    } \
+    static inline int s##_check(const smq_message *message) \
+    { \
+        return __smq_schema_check(message, s##_schema_id, sizeof(s##_layout)); \
+    } \
+    LIST(__SMQ_SCHEMA_FIELD, __SMQ_SCHEMA_ARRAY, s)
+
+#define __SMQ_SCHEMA_MEMBER(s, type, name) type name;
+#define __SMQ_SCHEMA_ARRAY_MEMBER(s, type, name, count) type name[count];
+
+#define __SMQ_SCHEMA_FIELD(s, type, name) \
+    static inline type s##_get_##name(const smq_message *message) \
+    { \
+        type value; \
+        memcpy(&value, &message->payload[offsetof(s##_layout, name)], sizeof(value)); \
+        return value; \
+    } \
+    static inline int s##_read_##name(const smq_message *message, type *value) \
+    { \
+        const int ret = __smq_schema_check(message, s##_schema_id, offsetof(s##_layout, name) + sizeof(type)); \
+        if (ret == 0) memcpy(value, &message->payload[offsetof(s##_layout, name)], sizeof(type)); \
+        return ret; \
+    } \
+    static inline void s##_set_##name(smq_message *message, type value) \
+    { \
+        memcpy(&message->payload[offsetof(s##_layout, name)], &value, sizeof(value)); \
+    }
+
+#define __SMQ_SCHEMA_ARRAY(s, type, name, count) \
+    static inline const type *s##_get_##name(const smq_message *message) \
+    { \
+        return (const type *)&message->payload[offsetof(s##_layout, name)]; \
+    } \
+    static inline int s##_read_##name(const smq_message *message, type *values) \
+    { \
+        const int ret = __smq_schema_check(message, s##_schema_id, offsetof(s##_layout, name) + sizeof(type) * (count)); \
+        if (ret == 0) memcpy(values, &message->payload[offsetof(s##_layout, name)], sizeof(type) * (count)); \
+        return ret; \
+    } \
+    static inline void s##_set_##name(smq_message *message, const type *values, size_t length) \
+    { \
+        const size_t used = length < (count) ? length : (count); \
+        memcpy(&message->payload[offsetof(s##_layout, name)], values, sizeof(type) * used); \
+        memset(&message->payload[offsetof(s##_layout, name) + sizeof(type) * used], 0x00, sizeof(type) * ((count) - used)); \
+    }
+
+// -EPROTO when the payload carries another schema, -EBADMSG when it is too short to hold what is read.
+static inline int __smq_schema_check(const smq_message *message, uint16_t schema, size_t needed)
+{
+    if (message->header.schema != schema) {
+        return -EPROTO;
+    }
+    return message->header.length < needed ? -EBADMSG : 0;
+}
 
 static inline int smq_client_create(smq_client *client, uint16_t id, const char *path);
+#define smq_client_create_with(client, id, path, ...) \
+    __smq_client_create(client, id, path, (smq_client_options){ __VA_ARGS__ })
+static inline int __smq_client_create(smq_client *client, uint16_t id, const char *path, smq_client_options options);
 #define smq_client_request(client, request, response, ...) \
     __smq_client_request(client, request, response, (smq_channel_transmission_options){ __VA_ARGS__ })
-static inline int __smq_client_request(const smq_client *client, smq_message *request, smq_message *response, smq_channel_transmission_options options);
-static inline int smq_client_blocking_request(const smq_client *client, smq_message *request, smq_message *response, const int priority);
-static inline int smq_client_timed_request(const smq_client *client, smq_message *request, smq_message *response, const int priority, const long timeout_ms);
+static inline int __smq_client_request(smq_client *client, smq_message *request, smq_message *response, smq_channel_transmission_options options);
+static inline int smq_client_blocking_request(smq_client *client, smq_message *request, smq_message *response, const int priority);
+static inline int smq_client_timed_request(smq_client *client, smq_message *request, smq_message *response, const int priority, const long timeout_ms);
 static inline void smq_client_destroy(const smq_client *client);
+#define smq_client_submit(client, request, response, id, ...) \
+    __smq_client_submit(client, request, response, id, (smq_client_submit_options){ __VA_ARGS__ })
+static inline int __smq_client_submit(smq_client *client, smq_message *request, smq_message *response, smq_request_id *id, smq_client_submit_options options);
+static inline int smq_client_poll(smq_client *client);
+static inline bool smq_client_is_done(const smq_client *client, smq_request_id id);
+static inline int smq_client_wait(smq_client *client, smq_request_id id, long timeout_ms);
+static inline int smq_client_cancel(smq_client *client, smq_request_id id);
+#ifdef SMQ_HAS_ATOMICS
+static inline int smq_client_pool_create(smq_client_pool *pool, const char *path);
+#define smq_client_pool_create_with(pool, path, ...) \
+    __smq_client_pool_create(pool, path, (smq_client_pool_options){ __VA_ARGS__ })
+static inline int __smq_client_pool_create(smq_client_pool *pool, const char *path, smq_client_pool_options options);
+static inline smq_client *smq_client_pool_checkout(smq_client_pool *pool);
+static inline void smq_client_pool_return(smq_client_pool *pool, smq_client *client);
+static inline void smq_client_pool_destroy(smq_client_pool *pool);
+#endif// SMQ_HAS_ATOMICS
 
 static inline void smq_server_create(smq_server *server, const char *name);
+#define smq_server_create_with(server, name, ...) \
+    __smq_server_create(server, name, (smq_server_options){ __VA_ARGS__ })
+static inline void __smq_server_create(smq_server *server, const char *name, smq_server_options options);
 static inline int smq_server_add_listener(smq_server *server, const char *path, void (*handler)(smq_message *request, smq_message *response));
+#define smq_server_add_listener_with(server, path, handler, ...) \
+    __smq_server_add_listener(server, path, handler, (smq_server_listener_options){ __VA_ARGS__ })
+static inline int __smq_server_add_listener(smq_server *server, const char *path, void (*handler)(smq_message *request, smq_message *response), smq_server_listener_options options);
+static inline int smq_server_add_span_listener(smq_server *server, const char *path, smq_span_handler handler);
+#define smq_server_add_span_listener_with(server, path, handler, ...) \
+    __smq_server_add_span_listener(server, path, handler, (smq_server_listener_options){ __VA_ARGS__ })
+static inline int __smq_server_add_span_listener(smq_server *server, const char *path, smq_span_handler handler, smq_server_listener_options options);
+static inline int smq_server_add_batch_listener(smq_server *server, const char *path, smq_batch_handler handler);
+#define smq_server_add_batch_listener_with(server, path, handler, ...) \
+    __smq_server_add_batch_listener(server, path, handler, (smq_server_listener_options){ __VA_ARGS__ })
+static inline int __smq_server_add_batch_listener(smq_server *server, const char *path, smq_batch_handler handler, smq_server_listener_options options);
+static inline int smq_server_add_router(smq_server *server, const char *path);
+#define smq_server_add_router_with(server, path, ...) \
+    __smq_server_add_router(server, path, (smq_server_listener_options){ __VA_ARGS__ })
+static inline int __smq_server_add_router(smq_server *server, const char *path, smq_server_listener_options options);
+static inline int smq_server_add_route(smq_server *server, const char *path, uint16_t id, void (*handler)(smq_message *request, smq_message *response));
+static inline int smq_server_add_span_route(smq_server *server, const char *path, uint16_t id, smq_span_handler handler);
 static inline bool smq_server_is_running(smq_server *server);
 static inline void smq_server_start(smq_server *server);
 static inline int smq_server_start_non_blocking(pthread_t *thread, smq_server *server);
 static inline bool smq_server_ready(smq_server *server, long timeout_ms);
 static inline void smq_server_stop(smq_server *server);
 static inline void smq_server_destroy(smq_server *server);
+static inline unsigned long smq_server_listener_requeued(smq_server_listener *listener);
+static inline size_t smq_server_stats_snapshot(smq_server *server, smq_listener_stats *stats, size_t capacity);
+static inline size_t smq_server_listener_max_payload(const smq_server_listener *listener);
+static inline unsigned long smq_listener_stats_handler_percentile_us(const smq_listener_stats *stats, double percentile);
+
+#ifdef SMQ_HAS_ATOMICS
+static inline int smq_mpmc_init(smq_mpmc_queue *queue, size_t capacity);
+static inline bool smq_mpmc_push(smq_mpmc_queue *queue, void *data);
+static inline void *smq_mpmc_pop(smq_mpmc_queue *queue);
+static inline void smq_mpmc_destroy(smq_mpmc_queue *queue);
+
+static inline int smq_message_pool_init(smq_message_pool *pool, size_t capacity);
+static inline void smq_message_pool_destroy(smq_message_pool *pool);
+static inline smq_message *smq_message_pool_acquire(smq_message_pool *pool);
+static inline void smq_message_pool_release(smq_message_pool *pool, smq_message *message);
+static inline void smq_message_cache_init(smq_message_cache *cache, smq_message_pool *pool);
+static inline smq_message *smq_message_cache_acquire(smq_message_cache *cache);
+static inline void smq_message_cache_release(smq_message_cache *cache, smq_message *message);
+static inline void smq_message_cache_flush(smq_message_cache *cache);
+static inline smq_message_pool *smq_server_message_pool(smq_server *server);
+#endif// SMQ_HAS_ATOMICS
+
+#ifdef SMQ_HAS_SHM
+static inline int smq_publisher_create(smq_publisher *publisher, const char *path);
+#define smq_publisher_create_with(publisher, path, ...) \
+    __smq_publisher_create(publisher, path, (smq_publisher_options){ __VA_ARGS__ })
+static inline int __smq_publisher_create(smq_publisher *publisher, const char *path, smq_publisher_options options);
+static inline int smq_publisher_publish(smq_publisher *publisher, const void *data, size_t size);
+static inline void smq_publisher_destroy(smq_publisher *publisher);
+static inline int smq_subscriber_open(smq_subscriber *subscriber, const char *path);
+static inline int smq_subscriber_receive(smq_subscriber *subscriber, void *data, size_t size, long timeout_ms);
+static inline void smq_subscriber_close(smq_subscriber *subscriber);
+
+static inline int smq_slab_create(smq_slab *slab, const char *path);
+#define smq_slab_create_with(slab, path, ...) \
+    __smq_slab_create(slab, path, (smq_slab_options){ __VA_ARGS__ })
+static inline int __smq_slab_create(smq_slab *slab, const char *path, smq_slab_options options);
+static inline void smq_slab_close(smq_slab *slab);
+static inline void smq_slab_destroy(smq_slab *slab);
+static inline int smq_slab_alloc(smq_slab *slab, size_t length, smq_slab_descriptor *descriptor);
+static inline void *smq_slab_data(smq_slab *slab, const smq_slab_descriptor *descriptor);
+static inline int smq_slab_release(smq_slab *slab, const smq_slab_descriptor *descriptor);
+static inline int smq_message_write_slab(smq_message *message, smq_slab *slab, const void *data, size_t length);
+static inline const void *smq_message_slab_data(const smq_message *message, smq_slab *slab, size_t *length);
+static inline int smq_message_release_slab(const smq_message *message, smq_slab *slab);
+#endif// SMQ_HAS_SHM
+
+// Points a traced request passes, in order.
+#define SMQ_TRACE_CLIENT_SEND 0
+#define SMQ_TRACE_SERVER_DEQUEUE 1
+#define SMQ_TRACE_HANDLER_START 2
+#define SMQ_TRACE_HANDLER_END 3
+#define SMQ_TRACE_RESPONSE_SEND 4// after the send returned, so it includes retries on a full queue
+#define SMQ_TRACE_CLIENT_RECEIVE 5
+
+#ifdef SMQ_HAS_TRACING
+typedef struct
+{
+    uint64_t time_us;// CLOCK_MONOTONIC, comparable between processes on one host
+    uint32_t seq;
+    uint16_t clientid;
+    uint8_t point;// SMQ_TRACE_*
+} smq_trace_event;
+
+typedef struct smq_trace_ring_t
+{
+    smq_trace_event *events;
+    size_t mask;
+    atomic_size_t head;// events ever recorded, only the last mask + 1 are kept
+    size_t thread;// numbered in the order threads first recorded, the tid in a dump
+    struct smq_trace_ring_t *next;
+} smq_trace_ring;
+
+typedef struct
+{
+    unsigned long sample_every;// clients trace one request in this many per thread, 0 and 1 trace every request
+    size_t ring_events;// events kept per thread, 0 uses SMQ_DEFAULT_TRACE_RING_EVENTS, rounded up to a power of two
+} smq_trace_options;
+
+#define SMQ_DEFAULT_TRACE_RING_EVENTS 4096
+
+static inline void smq_trace_start(void);
+#define smq_trace_start_with(...) \
+    __smq_trace_start((smq_trace_options){ __VA_ARGS__ })
+static inline void __smq_trace_start(smq_trace_options options);
+static inline void smq_trace_stop(void);
+static inline long smq_trace_dump(const char *path);
+#endif// SMQ_HAS_TRACING
 
 static inline long smq_timestamp_ms();
 static inline long smq_timespec_to_timestamp_ms(struct timespec *time);
@@ -138,27 +767,115 @@ static inline struct timespec smq_time_now();
 #include <time.h>
 #include <sched.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <limits.h>
+#include <sys/resource.h>
+#ifdef SMQ_HAS_SHM
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif// SMQ_HAS_SHM
+#ifdef SMQ_HAS_REACTOR
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif// SMQ_HAS_REACTOR
+
+#ifdef SMQ_HAS_SHM
+static inline int __smq_shm_channel_create(smq_channel *channel);
+static inline void __smq_shm_channel_close(const smq_channel *channel);
+static inline int __smq_shm_send(const smq_channel *channel, const char *data, const size_t size, long timeout_ms);
+static inline int __smq_shm_listen(const smq_channel *channel, char *data, const size_t size, long timeout_ms);
+static inline long __smq_shm_depth(const smq_channel *channel);
+#endif// SMQ_HAS_SHM
+static inline long __smq_monotonic_ms(void);
+static inline uint64_t __smq_monotonic_us(void);
+static inline int __smq_client_claim_id(smq_client *client, const char *path);
+static inline void __smq_listener_init_replies(smq_server_listener *listener);
+static inline void __smq_listener_close_replies(smq_server_listener *listener);
+static inline bool __smq_server_join_listeners(smq_server *server);
+static inline uint32_t __smq_client_new_reply_tag(void);
+static inline uint32_t __smq_client_next_seq(smq_client *client);
+static inline void __smq_client_settle(smq_client *client, smq_client_inflight *slot);
+static inline int __smq_thread_create(pthread_t *thread, const smq_thread_options *options, void *(*proc)(void *), void *arg);
+static inline void __smq_thread_place(const smq_thread_options *options);
+#ifdef SMQ_HAS_REACTOR
+static inline bool __smq_listener_is_pollable(const smq_server_listener *listener);
+#endif// SMQ_HAS_REACTOR
+#ifdef SMQ_HAS_ATOMICS
+static inline smq_response_cache *__smq_cache_create(size_t entries, size_t value_size, long ttl_ms);
+static inline void __smq_cache_destroy(smq_response_cache *cache);
+static inline bool __smq_cache_lookup(smq_response_cache *cache, const smq_message *request, smq_message *response);
+static inline void __smq_cache_store(smq_response_cache *cache, const smq_message *request, const smq_message *response);
+#endif// SMQ_HAS_ATOMICS
+
+// Losing an exclusive create is expected by callers probing for a free name, errno is kept for them.
+// So is a missing reply queue, only listeners open them write-only and it means the client went away.
+static inline void __smq_channel_report_error(const smq_channel *channel)
+{
+    const int error = errno;
+    const bool lost_create = error == EEXIST && (channel->oflag & O_EXCL);
+    const bool lost_client = error == ENOENT && (channel->oflag & O_ACCMODE) == O_WRONLY;
+    if (!lost_create && !lost_client) {
+        printf("Error in opening channel: %s\n", strerror(error));
+    }
+    errno = error;
+}
 
 static inline int smq_channel_create(smq_channel *channel)
 {
+    channel->ring = NULL;
+    if (channel->backend == SMQ_CHANNEL_BACKEND_SHM) {
+#ifdef SMQ_HAS_SHM
+        return __smq_shm_channel_create(channel);
+#else
+        puts("Error in opening channel: shm backend is not available in this build");
+        channel->desc = -1;
+        return -1;
+#endif// SMQ_HAS_SHM
+    }
     struct mq_attr att = { .mq_msgsize = channel->maxmsgsize, .mq_maxmsg = channel->maxmsgcount };
-    channel->desc = mq_open(channel->path, channel->oflag, channel->mode, att);
+    channel->desc = mq_open(channel->path, channel->oflag, channel->mode, &att);
     if (channel->desc == -1) {
-        printf("Error in opening channel: %s\n", strerror(errno));
+        __smq_channel_report_error(channel);
         return -1;
     }
+    // An existing queue keeps the geometry it was created with, report that one.
+    if (mq_getattr(channel->desc, &att) == 0) {
+        channel->maxmsgsize = att.mq_msgsize;
+        channel->maxmsgcount = att.mq_maxmsg;
+    }
     return 0;
 }
 
 static inline void smq_channel_close(const smq_channel *channel)
 {
+#ifdef SMQ_HAS_SHM
+    if (channel->backend == SMQ_CHANNEL_BACKEND_SHM) {
+        __smq_shm_channel_close(channel);
+        return;
+    }
+#endif// SMQ_HAS_SHM
     mq_close(channel->desc);
 }
 
+static inline void __smq_channel_unlink(const smq_channel *channel)
+{
+#ifdef SMQ_HAS_SHM
+    if (channel->backend == SMQ_CHANNEL_BACKEND_SHM) {
+        shm_unlink(channel->path);
+        return;
+    }
+#endif// SMQ_HAS_SHM
+    mq_unlink(channel->path);
+}
+
 static inline void smq_channel_destroy(const smq_channel *channel)
 {
     smq_channel_close(channel);
-    mq_unlink(channel->path);
+    __smq_channel_unlink(channel);
 }
 
 static inline int __smq_channel_send(const smq_channel *channel, const char *data, const size_t size, smq_channel_transmission_options options)
@@ -168,6 +885,9 @@ static inline int __smq_channel_send(const smq_channel *channel, const char *dat
 
 static inline int smq_channel_blocking_send(const smq_channel *channel, const char *data, const size_t size, int priority)
 {
+#ifdef SMQ_HAS_SHM
+    if (channel->backend == SMQ_CHANNEL_BACKEND_SHM) return __smq_shm_send(channel, data, size, -1);
+#endif// SMQ_HAS_SHM
     int ret = mq_send(channel->desc, (char *)data, size, priority);
     ret == -1 ? ret = -errno : ret;
     return ret;
@@ -175,6 +895,9 @@ static inline int smq_channel_blocking_send(const smq_channel *channel, const ch
 
 static inline int smq_channel_timed_send(const smq_channel *channel, const char *data, const size_t size, int priority, long timeout)
 {
+#ifdef SMQ_HAS_SHM
+    if (channel->backend == SMQ_CHANNEL_BACKEND_SHM) return __smq_shm_send(channel, data, size, timeout);
+#endif// SMQ_HAS_SHM
     int ret = -1;
     struct timespec abstimeout = smq_time_now();
     smq_abs_timeout(&abstimeout, timeout);
@@ -190,6 +913,9 @@ static inline int __smq_channel_listen(const smq_channel *channel, char *data, c
 
 static inline int smq_channel_blocking_listen(const smq_channel *channel, char *data, const size_t size)
 {
+#ifdef SMQ_HAS_SHM
+    if (channel->backend == SMQ_CHANNEL_BACKEND_SHM) return __smq_shm_listen(channel, data, size, -1);
+#endif// SMQ_HAS_SHM
     int ret = (int)mq_receive(channel->desc, (void *)data, size + 1, NULL);
     ret == -1 ? ret = -errno : ret;
     return ret;
@@ -197,6 +923,9 @@ static inline int smq_channel_blocking_listen(const smq_channel *channel, char *
 
 static inline int smq_channel_timed_listen(const smq_channel *channel, char *data, const size_t size, long timeout)
 {
+#ifdef SMQ_HAS_SHM
+    if (channel->backend == SMQ_CHANNEL_BACKEND_SHM) return __smq_shm_listen(channel, data, size, timeout);
+#endif// SMQ_HAS_SHM
     int ret = -1;
     struct timespec abstimeout = smq_time_now();
     smq_abs_timeout(&abstimeout, timeout);
@@ -205,321 +934,3763 @@ static inline int smq_channel_timed_listen(const smq_channel *channel, char *dat
     return ret;
 }
 
-static inline int __smq_client_request(const smq_client *client, smq_message *request, smq_message *response, smq_channel_transmission_options options)
+// Batches only wait for the first message, the rest are moved with an already expired timeout so they never block.
+static inline int __smq_channel_send_batch(const smq_channel *channel, const smq_channel_buffer *buffers, const size_t count, smq_channel_transmission_options options)
 {
-    return options.timeout_ms > 0 ? smq_client_timed_request(client, request, response, options.priority, options.timeout_ms) : smq_client_blocking_request(client, request, response, options.priority);
+    int ret = 0;
+    size_t sent = 0;
+    if (count == 0) {
+        return 0;
+    }
+    if ((ret = __smq_channel_send(channel, buffers[0].data, buffers[0].length, options)) != 0) {
+        return ret;
+    }
+    for (sent = 1; sent < count; sent++) {
+        if (smq_channel_timed_send(channel, buffers[sent].data, buffers[sent].length, options.priority, 0) != 0) {
+            break;
+        }
+    }
+    return (int)sent;
 }
 
-static inline int smq_client_blocking_request(const smq_client *client, smq_message *request, smq_message *response, const int priority)
+static inline int __smq_channel_listen_batch(const smq_channel *channel, smq_channel_buffer *buffers, const size_t count, smq_channel_transmission_options options)
 {
-    request->header.clientid = client->id;
-    request->header.isresponse = SMQ_STATUS_REQUEST;
-    if (smq_channel_blocking_send(&client->channel, (char *)request, sizeof(*request), priority) != 0) {
-        return -1;
+    int ret = 0;
+    if (count == 0) {
+        return 0;
     }
-    while (response->header.isresponse != SMQ_STATUS_RESPONSE) {
-        if (smq_channel_blocking_listen(&client->channel, (char *)response, sizeof(*response)) > 0) {
-            if (response->header.isresponse == SMQ_STATUS_RESPONSE && response->header.clientid == client->id) {
-                return 0;
-            }
-            if (smq_channel_blocking_send(&client->channel, (char *)response, sizeof(*response), priority) != 0) {
-                continue;
-            }
-        }
+    if ((ret = __smq_channel_listen(channel, buffers[0].data, buffers[0].size, options)) < 0) {
+        return ret;
     }
-    return -1;
+    buffers[0].length = (size_t)ret;
+    return 1 + __smq_channel_drain(channel, &buffers[1], count - 1);
 }
 
-static inline int smq_client_timed_request(const smq_client *client, smq_message *request, smq_message *response, const int priority, const long timeout_ms)
+static inline int __smq_channel_drain(const smq_channel *channel, smq_channel_buffer *buffers, const size_t count)
 {
-    request->header.clientid = client->id;
-    request->header.isresponse = SMQ_STATUS_REQUEST;
-    if (smq_channel_timed_send(&client->channel, (char *)request, sizeof(*request), priority, timeout_ms) != 0) {
-        return -1;
-    }
-    while (response->header.isresponse != SMQ_STATUS_RESPONSE) {
-        if (smq_channel_timed_listen(&client->channel, (char *)response, sizeof(*response), timeout_ms) > 0) {
-            if (response->header.isresponse == SMQ_STATUS_RESPONSE && response->header.clientid == client->id) {
-                return 0;
-            }
-            if (smq_channel_timed_send(&client->channel, (char *)response, sizeof(*response), priority, timeout_ms) != 0) {
-                continue;
-            }
+    int ret = 0;
+    size_t received = 0;
+    for (received = 0; received < count; received++) {
+        if ((ret = smq_channel_timed_listen(channel, buffers[received].data, buffers[received].size, 0)) < 0) {
+            break;
         }
+        buffers[received].length = (size_t)ret;
     }
-    return -1;
+    return (int)received;
 }
 
-static inline int smq_client_create(smq_client *client, uint16_t id, const char *path)
+// Batching delays are usually well below a millisecond, the shm backend still rounds up to one.
+static inline int __smq_channel_timed_listen_us(const smq_channel *channel, char *data, const size_t size, long timeout_us)
 {
-    client->id = id;
-    client->channel = (smq_channel){
-        .maxmsgsize = sizeof(smq_message),
-        .maxmsgcount = 10,
-        .desc = -1,
-        .mode = 0666,
-        .oflag = O_RDWR
-    };
+#ifdef SMQ_HAS_SHM
+    if (channel->backend == SMQ_CHANNEL_BACKEND_SHM) return __smq_shm_listen(channel, data, size, (timeout_us + 999) / 1000);
+#endif// SMQ_HAS_SHM
+    int ret = -1;
+    struct timespec abstimeout = smq_time_now();
+    abstimeout.tv_sec += timeout_us / 1000000;
+    abstimeout.tv_nsec += (timeout_us % 1000000) * 1000;
+    if (abstimeout.tv_nsec >= 1000000000) {
+        abstimeout.tv_sec += 1;
+        abstimeout.tv_nsec -= 1000000000;
+    }
+    ret = (int)mq_timedreceive(channel->desc, (void *)data, size + 1, NULL, &abstimeout);
+    ret == -1 ? ret = -errno : ret;
+    return ret;
+}
 
-    memcpy(&client->channel.path, path, strlen(path) + 1);
-    return smq_channel_create(&client->channel);
+static inline void __smq_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
 }
 
-static inline void smq_client_destroy(const smq_client *client)
+static inline void smq_busy_poll_init(smq_busy_poll *state, unsigned long max_us)
 {
-    smq_channel_close(&client->channel);
+    *state = (smq_busy_poll){ .max_us = max_us, .wait_us = max_us / 2, .budget_us = max_us };
 }
 
-static inline void smq_server_create(smq_server *server, const char *name)
+// Spinning only pays while messages arrive within max_us, sparser traffic goes straight to the kernel wait until it picks up again.
+static inline void __smq_busy_poll_arrived(smq_busy_poll *state, uint64_t waited_us)
 {
-    *server = (smq_server){
-        .listeners = NULL
-    };
-    memcpy(&server->name, name, strlen(name) + 1);
-#ifdef SMQ_HAS_ATOMICS
-    atomic_init(&server->running, false);
-#else
-    server->running = false;
-#endif
+    state->wait_us = state->wait_us - state->wait_us / 8 + (unsigned long)waited_us / 8;
+    state->budget_us = state->wait_us * 2 <= state->max_us ? state->wait_us * 2 : 0;
 }
 
-static inline smq_server_listener **smq_server_get_last_listener(smq_server_listener **listeners)
+// Like smq_channel_listen but first polls without sleeping for the adaptive budget, a negative timeout blocks and 0 never spins.
+static inline int smq_channel_busy_listen(const smq_channel *channel, char *data, const size_t size, long timeout_ms, smq_busy_poll *state)
 {
-    smq_server_listener **tmp = listeners;
-    while (*tmp != NULL) {
-        tmp = (smq_server_listener **)&((*tmp)->next);
+    const uint64_t started_us = __smq_monotonic_us();
+    int res = 0;
+    if (timeout_ms != 0 && state->budget_us > 0) {
+        do {
+            // An already expired timeout is a non-blocking receive, and on the shm backend it never enters the kernel.
+            if ((res = smq_channel_timed_listen(channel, data, size, 0)) != -ETIMEDOUT) {
+                if (res >= 0) __smq_busy_poll_arrived(state, __smq_monotonic_us() - started_us);
+                return res;
+            }
+            __smq_cpu_relax();
+        } while (__smq_monotonic_us() - started_us < state->budget_us);
     }
-    return tmp;
+    res = timeout_ms < 0 ? smq_channel_blocking_listen(channel, data, size) : smq_channel_timed_listen(channel, data, size, timeout_ms);
+    if (res >= 0) {
+        __smq_busy_poll_arrived(state, __smq_monotonic_us() - started_us);
+    }
+    return res;
 }
 
-static inline int smq_server_add_listener(smq_server *server, const char *path, void (*handler)(smq_message *request, smq_message *response))
+static inline int __smq_client_request(smq_client *client, smq_message *request, smq_message *response, smq_channel_transmission_options options)
 {
-    smq_server_listener **new_listener = smq_server_get_last_listener(&server->listeners);
-    *new_listener = malloc(sizeof(smq_server_listener));
-    **new_listener = (smq_server_listener){
-        .channel = (smq_channel){
-          .maxmsgsize = sizeof(smq_message),
-          .maxmsgcount = 10,
-          .desc = -1,
-          .mode = 0666,
-          .oflag = O_RDWR | O_CREAT },
-        .handler = handler,
-        .next = NULL,
-        .thread = 0,
-        .parent_server = server,
-        .is_listening = false
-    };
-    memcpy(&(*new_listener)->channel.path, server->name, strlen(server->name));
-    memcpy(&(*new_listener)->channel.path[strlen(server->name)], path, strlen(path) + 1);
-    return smq_channel_create(&(*new_listener)->channel);
+    return options.timeout_ms > 0 ? smq_client_timed_request(client, request, response, options.priority, options.timeout_ms) : smq_client_blocking_request(client, request, response, options.priority);
 }
 
+static inline void smq_message_set_length(smq_message *message, size_t length)
+{
+    message->header.length = (uint32_t)(length > SMQ_PAYLOAD_SIZE ? SMQ_PAYLOAD_SIZE : length);
+}
 
-static inline bool __smq_server_listener_is_ready(smq_server_listener *listener)
+static inline size_t smq_message_length(const smq_message *message)
 {
-    bool res = false;
-#ifdef SMQ_HAS_ATOMICS
-    res = atomic_load(&listener->is_listening);
+    return message->header.length;
+}
+
+static inline size_t smq_message_size(const smq_message *message)
+{
+    return SMQ_HEADER_SIZE + (message->header.length > SMQ_PAYLOAD_SIZE ? SMQ_PAYLOAD_SIZE : message->header.length);
+}
+
+static inline int smq_message_write(smq_message *message, const void *data, size_t length)
+{
+    if (length > SMQ_PAYLOAD_SIZE) {
+        return -EMSGSIZE;
+    }
+    memcpy(message->payload, data, length);
+    message->header.length = (uint32_t)length;
+    return 0;
+}
+
+// Zeroes the header and only the payload bytes the message says it used, the rest is already clean.
+static inline void smq_message_clear(smq_message *message)
+{
+    const size_t used = smq_message_length(message);
+    memset(message->payload, 0x00, used < SMQ_PAYLOAD_SIZE ? used : SMQ_PAYLOAD_SIZE);
+    memset(&message->header, 0x00, sizeof(message->header));
+}
+
+// The byte count mq_receive returned is authoritative, the length field the sender wrote is not trusted.
+static inline int __smq_message_received(smq_message *message, int received)
+{
+    if (received < (int)SMQ_HEADER_SIZE) {
+        return -EBADMSG;
+    }
+    message->header.length = (uint32_t)((size_t)received - SMQ_HEADER_SIZE);
+    return 0;
+}
+
+#ifdef SMQ_HAS_TRACING
+typedef struct
+{
+    atomic_bool enabled;
+    atomic_ulong sample_every;
+    atomic_size_t ring_events;
+    _Atomic(smq_trace_ring *) rings;
+    atomic_size_t threads;
+} smq_trace_state;
+
+static smq_trace_state __smq_trace;
+static _Thread_local smq_trace_ring *__smq_trace_ring;
+static _Thread_local unsigned long __smq_trace_sampled;
+
+static inline void smq_trace_start(void)
+{
+    __smq_trace_start((smq_trace_options){ .sample_every = 1 });
+}
+
+static inline void __smq_trace_start(smq_trace_options options)
+{
+    atomic_store(&__smq_trace.sample_every, options.sample_every > 1 ? options.sample_every : 1);
+    atomic_store(&__smq_trace.ring_events, options.ring_events > 0 ? options.ring_events : SMQ_DEFAULT_TRACE_RING_EVENTS);
+    atomic_store(&__smq_trace.enabled, true);
+}
+
+// Recorded events stay in their rings for smq_trace_dump.
+static inline void smq_trace_stop(void)
+{
+    atomic_store(&__smq_trace.enabled, false);
+}
+
+// A thread's first event links its ring in for good, so a dump still finds threads that have exited.
+static inline smq_trace_ring *__smq_trace_attach(void)
+{
+    const size_t wanted = atomic_load(&__smq_trace.ring_events);
+    size_t capacity = 1;
+    while (capacity < wanted) {
+        capacity <<= 1;
+    }
+    smq_trace_ring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL || (ring->events = calloc(capacity, sizeof(*ring->events))) == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->mask = capacity - 1;
+    atomic_init(&ring->head, 0);
+    ring->thread = atomic_fetch_add(&__smq_trace.threads, 1) + 1;
+    ring->next = atomic_load(&__smq_trace.rings);
+    while (!atomic_compare_exchange_weak(&__smq_trace.rings, &ring->next, ring)) {
+    }
+    __smq_trace_ring = ring;
+    return ring;
+}
+
+// Only the owning thread writes its ring, publishing head with release is all a concurrent dump needs.
+static inline void __smq_trace_record(const smq_message *message, uint8_t point)
+{
+    if (!(message->header.flags & SMQ_FLAG_TRACED) || !atomic_load_explicit(&__smq_trace.enabled, memory_order_relaxed)) {
+        return;
+    }
+    smq_trace_ring *ring = __smq_trace_ring != NULL ? __smq_trace_ring : __smq_trace_attach();
+    if (ring == NULL) {
+        return;
+    }
+    const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring->events[head & ring->mask] = (smq_trace_event){
+        .time_us = __smq_monotonic_us(),
+        .seq = message->header.seq,
+        .clientid = message->header.clientid,
+        .point = point
+    };
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Clients decide which requests are traced, everything downstream follows SMQ_FLAG_TRACED.
+static inline void __smq_trace_sample(smq_message *request)
+{
+    if (!atomic_load_explicit(&__smq_trace.enabled, memory_order_relaxed)
+        || __smq_trace_sampled++ % atomic_load_explicit(&__smq_trace.sample_every, memory_order_relaxed) != 0) {
+        return;
+    }
+    request->header.flags |= SMQ_FLAG_TRACED;
+    __smq_trace_record(request, SMQ_TRACE_CLIENT_SEND);
+}
+
+// The request is an async span from client send to receive, the handler a duration slice on the thread that ran it.
+static inline void __smq_trace_describe(uint8_t point, const char **name, const char **phase)
+{
+    static const char *names[] = { "request", "dequeue", "handler", "handler", "response_sent", "request" };
+    static const char *phases[] = { "b", "n", "B", "E", "n", "e" };
+    *name = point <= SMQ_TRACE_CLIENT_RECEIVE ? names[point] : "unknown";
+    *phase = point <= SMQ_TRACE_CLIENT_RECEIVE ? phases[point] : "n";
+}
+
+// Writes Chrome trace_event JSON, returns the number of events or a negated errno. Events of a ring that wraps during the dump may be torn.
+static inline long smq_trace_dump(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    long written = 0;
+    if (file == NULL) {
+        return -errno;
+    }
+    fputs("{\"traceEvents\":[", file);
+    for (smq_trace_ring *ring = atomic_load(&__smq_trace.rings); ring != NULL; ring = ring->next) {
+        const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (size_t i = head > ring->mask + 1 ? head - ring->mask - 1 : 0; i < head; i++) {
+            const smq_trace_event event = ring->events[i & ring->mask];
+            const char *name = NULL;
+            const char *phase = NULL;
+            __smq_trace_describe(event.point, &name, &phase);
+            fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"smq\",\"ph\":\"%s\",\"ts\":%llu,\"pid\":%ld,\"tid\":%zu,\"id\":\"%u:%u\",\"args\":{\"clientid\":%u,\"seq\":%u}}",
+                written > 0 ? "," : "", name, phase, (unsigned long long)event.time_us, (long)getpid(), ring->thread,
+                (unsigned)event.clientid, (unsigned)event.seq, (unsigned)event.clientid, (unsigned)event.seq);
+            written++;
+        }
+    }
+    fputs("\n]}\n", file);
+    return fclose(file) == 0 ? written : -errno;
+}
 #else
-    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_lock(&mutex);
-    res = listener->is_listening;
-    pthread_mutex_unlock(&mutex);
-#endif
-    return res;
+static inline void __smq_trace_record(const smq_message *message, uint8_t point)
+{
+    (void)message;
+    (void)point;
+}
+
+static inline void __smq_trace_sample(smq_message *request)
+{
+    (void)request;
+}
+#endif// SMQ_HAS_TRACING
+
+#define SMQ_LZ_MIN_MATCH 4
+#define SMQ_LZ_MAX_OFFSET 65535
+#define SMQ_LZ_HASH_BITS 10// 4 KiB of match positions on the stack, plenty for payloads of a few KiB
+
+static inline uint32_t __smq_lz_read32(const unsigned char *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline size_t __smq_lz_hash(uint32_t value)
+{
+    return (size_t)((value * 2654435761u) >> (32 - SMQ_LZ_HASH_BITS));
+}
+
+// Lengths that do not fit their 4 bit field continue in bytes of 255 and a final byte below it.
+static inline bool __smq_lz_put_length(unsigned char **out, const unsigned char *end, size_t length)
+{
+    for (; length >= 255; length -= 255) {
+        if (*out >= end) return false;
+        *(*out)++ = 255;
+    }
+    if (*out >= end) return false;
+    *(*out)++ = (unsigned char)length;
+    return true;
+}
+
+static inline bool __smq_lz_get_length(const unsigned char **in, const unsigned char *end, size_t *length)
+{
+    unsigned char byte = 255;
+    while (byte == 255) {
+        if (*in >= end) return false;
+        byte = *(*in)++;
+        *length += byte;
+    }
+    return true;
+}
+
+// A sequence is a token (literal length << 4 | match length - 4), the literals, a 2 byte offset and the match, the last one stops after its literals.
+static inline bool __smq_lz_put_sequence(unsigned char **out, const unsigned char *end, const unsigned char *literals, size_t literal_length, size_t offset, size_t match_length)
+{
+    const size_t extra = match_length > 0 ? match_length - SMQ_LZ_MIN_MATCH : 0;
+    if (*out >= end) return false;
+    *(*out)++ = (unsigned char)((literal_length < 15 ? literal_length : 15) << 4 | (extra < 15 ? extra : 15));
+    if (literal_length >= 15 && !__smq_lz_put_length(out, end, literal_length - 15)) return false;
+    if ((size_t)(end - *out) < literal_length) return false;
+    memcpy(*out, literals, literal_length);
+    *out += literal_length;
+    if (match_length == 0) return true;
+    if (end - *out < 2) return false;
+    *(*out)++ = (unsigned char)(offset & 0xFF);
+    *(*out)++ = (unsigned char)(offset >> 8);
+    return extra < 15 || __smq_lz_put_length(out, end, extra - 15);
+}
+
+// Greedy single probe LZ77, byte oriented so it needs no entropy stage, gives up with -ENOSPC as soon as capacity is exceeded.
+static inline int smq_lz_compress(const char *src, size_t length, char *dst, size_t capacity)
+{
+    uint32_t table[1 << SMQ_LZ_HASH_BITS] = { 0 };
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst;
+    const unsigned char *end = out + capacity;
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + SMQ_LZ_MIN_MATCH <= length) {
+        const uint32_t sequence = __smq_lz_read32(&in[pos]);
+        const size_t hash = __smq_lz_hash(sequence);
+        const size_t candidate = table[hash];
+        table[hash] = (uint32_t)pos;
+        if (candidate >= pos || pos - candidate > SMQ_LZ_MAX_OFFSET || __smq_lz_read32(&in[candidate]) != sequence) {
+            pos++;
+            continue;
+        }
+        size_t match = SMQ_LZ_MIN_MATCH;
+        while (pos + match < length && in[candidate + match] == in[pos + match]) {
+            match++;
+        }
+        if (!__smq_lz_put_sequence(&out, end, &in[anchor], pos - anchor, pos - candidate, match)) {
+            return -ENOSPC;
+        }
+        pos += match;
+        anchor = pos;
+    }
+    if (!__smq_lz_put_sequence(&out, end, &in[anchor], length - anchor, 0, 0)) {
+        return -ENOSPC;
+    }
+    return (int)(out - (unsigned char *)dst);
+}
+
+// Every length and offset is checked against both buffers, a corrupt payload gives -EBADMSG and never writes past dst.
+static inline int smq_lz_decompress(const char *src, size_t length, char *dst, size_t capacity)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    const unsigned char *end = in + length;
+    size_t written = 0;
+    while (in < end) {
+        const unsigned char token = *in++;
+        size_t literal_length = token >> 4;
+        size_t match_length = token & 0x0F;
+        if (literal_length == 15 && !__smq_lz_get_length(&in, end, &literal_length)) return -EBADMSG;
+        if ((size_t)(end - in) < literal_length || capacity - written < literal_length) return -EBADMSG;
+        memcpy(&dst[written], in, literal_length);
+        in += literal_length;
+        written += literal_length;
+        if (in == end) break;
+        if (end - in < 2) return -EBADMSG;
+        const size_t offset = (size_t)in[0] | (size_t)in[1] << 8;
+        in += 2;
+        if (match_length == 15 && !__smq_lz_get_length(&in, end, &match_length)) return -EBADMSG;
+        match_length += SMQ_LZ_MIN_MATCH;
+        if (offset == 0 || offset > written || capacity - written < match_length) return -EBADMSG;
+        for (size_t i = 0; i < match_length; i++, written++) {
+            dst[written] = dst[written - offset];// byte by byte, matches may overlap what they produce
+        }
+    }
+    return (int)written;
+}
+
+static inline smq_codec smq_codec_lz(void)
+{
+    return (smq_codec){
+        .encode = smq_lz_compress,
+        .decode = smq_lz_decompress,
+        .threshold = SMQ_DEFAULT_CODEC_THRESHOLD,
+        .min_saving_pct = SMQ_DEFAULT_CODEC_MIN_SAVING
+    };
+}
+
+// Writes the encoded payload to dst, 0 when the payload is below the threshold or would not shrink enough and goes out as it is.
+// dst holds SMQ_PAYLOAD_SIZE bytes, a min_saving_pct of 100 or more is never met so nothing is encoded.
+static inline size_t __smq_codec_encode(const smq_codec *codec, const smq_message *message, char *dst)
+{
+    const size_t length = smq_message_length(message);
+    if (codec->encode == NULL || length == 0 || length < codec->threshold || codec->min_saving_pct >= 100
+        || (message->header.flags & (SMQ_FLAG_COMPRESSED | SMQ_FLAG_OFFLOADED))) {
+        return 0;
+    }
+    // Capping the output at the smallest worthwhile size lets the encoder stop early on incompressible data.
+    const size_t worthwhile = length - 1 - length * codec->min_saving_pct / 100;
+    const int encoded = codec->encode(message->payload, length, dst, worthwhile < SMQ_PAYLOAD_SIZE ? worthwhile : SMQ_PAYLOAD_SIZE);
+    return encoded > 0 ? (size_t)encoded : 0;
+}
+
+// Replaces the payload by its encoding, the bytes it no longer uses are zeroed so smq_message_clear still leaves it clean.
+static inline void __smq_codec_encode_in_place(const smq_codec *codec, smq_message *message)
+{
+    char encoded[SMQ_PAYLOAD_SIZE];
+    const size_t length = smq_message_length(message);
+    const size_t written = __smq_codec_encode(codec, message, encoded);
+    if (written == 0) {
+        return;
+    }
+    memcpy(message->payload, encoded, written);
+    memset(&message->payload[written], 0x00, length - written);
+    smq_message_set_length(message, written);
+    message->header.flags |= SMQ_FLAG_COMPRESSED;
+}
+
+// -EPROTO when a compressed payload arrives without a codec, -EBADMSG when it does not decode into SMQ_PAYLOAD_SIZE.
+static inline int __smq_codec_decode(const smq_codec *codec, smq_message *message)
+{
+    char decoded[SMQ_PAYLOAD_SIZE];
+    if (!(message->header.flags & SMQ_FLAG_COMPRESSED)) {
+        return 0;
+    }
+    if (codec->decode == NULL) {
+        return -EPROTO;
+    }
+    const size_t length = smq_message_length(message);
+    const int written = codec->decode(message->payload, length, decoded, sizeof(decoded));
+    if (written < 0) {
+        return -EBADMSG;
+    }
+    memcpy(message->payload, decoded, (size_t)written);
+    if (length > (size_t)written) {
+        memset(&message->payload[written], 0x00, length - (size_t)written);
+    }
+    smq_message_set_length(message, (size_t)written);
+    message->header.flags &= (uint8_t)~SMQ_FLAG_COMPRESSED;
+    return 0;
+}
+
+static inline bool __smq_client_has_private_reply(const smq_client *client)
+{
+    return client->reply.desc != (mqd_t)-1;
+}
+
+static inline void __smq_client_prepare_request(const smq_client *client, smq_message *request, uint32_t seq, long ttl_ms)
+{
+    request->header.clientid = client->id;
+    request->header.isresponse = SMQ_STATUS_REQUEST;
+    // Flags describing the payload were set by the caller, only the routing ones are the client's.
+    request->header.flags = (request->header.flags & SMQ_FLAG_OFFLOADED) | (__smq_client_has_private_reply(client) ? SMQ_FLAG_PRIVATE_REPLY : 0)
+        | (client->codec.decode != NULL ? SMQ_FLAG_ACCEPTS_CODEC : 0);
+    request->header.seq = seq;
+    request->header.reply_tag = client->reply_tag;
+    if (client->route != 0) {
+        request->header.route = client->route;
+    }
+    request->header.deadline_ms = ttl_ms > 0 ? (uint64_t)(__smq_monotonic_ms() + ttl_ms) : 0;
+}
+
+// A negative timeout blocks, 0 only takes what is already queued.
+static inline int __smq_client_listen_reply(const smq_client *client, smq_message *response, long timeout_ms)
+{
+    if (client->busy_poll != NULL) {
+        return smq_channel_busy_listen(&client->reply, (char *)response, sizeof(*response), timeout_ms, client->busy_poll);
+    }
+    return timeout_ms < 0 ? smq_channel_blocking_listen(&client->reply, (char *)response, sizeof(*response))
+                          : smq_channel_timed_listen(&client->reply, (char *)response, sizeof(*response), timeout_ms);
+}
+
+// The compressed copy when the codec wants one, the request itself otherwise.
+static inline const smq_message *__smq_client_wire(const smq_client *client, const smq_message *request)
+{
+    size_t written = 0;
+    if (client->wire == NULL || (written = __smq_codec_encode(&client->codec, request, client->wire->payload)) == 0) {
+        return request;
+    }
+    client->wire->header = request->header;
+    client->wire->header.flags |= SMQ_FLAG_COMPRESSED;
+    smq_message_set_length(client->wire, written);
+    return client->wire;
+}
+
+static inline bool __smq_client_owns_response(const smq_client *client, const smq_message *request, const smq_message *response)
+{
+    return response->header.isresponse == SMQ_STATUS_RESPONSE && response->header.clientid == client->id && response->header.seq == request->header.seq;
+}
+
+static inline int __smq_client_finish(const smq_client *client, smq_message *response)
+{
+    __smq_trace_record(response, SMQ_TRACE_CLIENT_RECEIVE);
+    return __smq_codec_decode(&client->codec, response);
+}
+
+static inline int smq_client_blocking_request(smq_client *client, smq_message *request, smq_message *response, const int priority)
+{
+    int listen_res = 0;
+    // Every request gets its own seq, so a late response to an earlier one is never taken for its answer.
+    __smq_client_prepare_request(client, request, __smq_client_next_seq(client), 0);
+    __smq_trace_sample(request);
+    const smq_message *wire = __smq_client_wire(client, request);
+    if (smq_channel_blocking_send(&client->channel, (const char *)wire, smq_message_size(wire), priority) != 0) {
+        return -1;
+    }
+    if (__smq_client_has_private_reply(client)) {
+        while ((listen_res = __smq_client_listen_reply(client, response, -1)) > 0 || listen_res == -EINTR) {
+            if (listen_res > 0 && __smq_message_received(response, listen_res) == 0 && __smq_client_owns_response(client, request, response)) {
+                return __smq_client_finish(client, response);
+            }
+        }
+        return -1;
+    }
+    for (;;) {
+        if ((listen_res = smq_channel_blocking_listen(&client->channel, (char *)response, sizeof(*response))) < 0) {
+            if (listen_res == -EINTR) continue;
+            return -1;
+        }
+        if (__smq_message_received(response, listen_res) != 0) {
+            continue;
+        }
+        if (__smq_client_owns_response(client, request, response)) {
+            return __smq_client_finish(client, response);
+        }
+        (void)smq_channel_blocking_send(&client->channel, (char *)response, smq_message_size(response), priority);
+    }
+}
+
+// timeout_ms bounds the whole request, responses for someone else do not restart it.
+static inline int smq_client_timed_request(smq_client *client, smq_message *request, smq_message *response, const int priority, const long timeout_ms)
+{
+    int listen_res = 0;
+    long remaining_ms = timeout_ms;
+    __smq_client_prepare_request(client, request, __smq_client_next_seq(client), timeout_ms);
+    __smq_trace_sample(request);
+    const long deadline_ms = (long)request->header.deadline_ms;
+    const smq_message *wire = __smq_client_wire(client, request);
+    if (smq_channel_timed_send(&client->channel, (const char *)wire, smq_message_size(wire), priority, timeout_ms) != 0) {
+        return -1;
+    }
+    if (__smq_client_has_private_reply(client)) {
+        while ((remaining_ms = deadline_ms - __smq_monotonic_ms()) > 0
+               && ((listen_res = __smq_client_listen_reply(client, response, remaining_ms)) > 0 || listen_res == -EINTR)) {
+            if (listen_res > 0 && __smq_message_received(response, listen_res) == 0 && __smq_client_owns_response(client, request, response)) {
+                return __smq_client_finish(client, response);
+            }
+        }
+        return -1;
+    }
+    for (;;) {
+        if ((remaining_ms = deadline_ms - __smq_monotonic_ms()) <= 0) {
+            return -1;
+        }
+        if ((listen_res = smq_channel_timed_listen(&client->channel, (char *)response, sizeof(*response), remaining_ms)) < 0) {
+            if (listen_res == -EINTR) continue;
+            return -1;
+        }
+        if (__smq_message_received(response, listen_res) != 0) {
+            continue;
+        }
+        if (__smq_client_owns_response(client, request, response)) {
+            return __smq_client_finish(client, response);
+        }
+        (void)smq_channel_timed_send(&client->channel, (char *)response, smq_message_size(response), priority, remaining_ms);
+    }
+}
+
+#define SMQ_MQ_HARD_MSGMAX 65536// kernel ceilings for privileged processes
+#define SMQ_MQ_HARD_MSGSIZEMAX (16 * 1024 * 1024)
+#define SMQ_MQ_MSG_OVERHEAD 96// kernel bookkeeping charged per message, a msg_msg plus a priority tree node
+
+static inline long __smq_read_proc_long(const char *path)
+{
+    long value = -1;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return -1;
+    if (fscanf(file, "%ld", &value) != 1) {
+        value = -1;
+    }
+    fclose(file);
+    return value;
+}
+
+// Catches a queue geometry the kernel would refuse before mq_open does, with the limit that is in the way.
+static inline int __smq_channel_check_limits(const smq_channel *channel)
+{
+    const bool privileged = geteuid() == 0;
+    long msg_max = privileged ? SMQ_MQ_HARD_MSGMAX : __smq_read_proc_long("/proc/sys/fs/mqueue/msg_max");
+    long msgsize_max = privileged ? SMQ_MQ_HARD_MSGSIZEMAX : __smq_read_proc_long("/proc/sys/fs/mqueue/msgsize_max");
+    if (channel->maxmsgsize < (long)SMQ_HEADER_SIZE || channel->maxmsgsize > (long)sizeof(smq_message) || channel->maxmsgcount <= 0) {
+        printf("Error in opening channel: %s wants %ld messages of %ld bytes, messages must fit an smq_message\n", channel->path, channel->maxmsgcount, channel->maxmsgsize);
+        return -EINVAL;
+    }
+    if (channel->backend != SMQ_CHANNEL_BACKEND_MQ) {
+        return 0;
+    }
+    if (msg_max > 0 && channel->maxmsgcount > msg_max) {
+        printf("Error in opening channel: %s queue depth %ld exceeds /proc/sys/fs/mqueue/msg_max (%ld)\n", channel->path, channel->maxmsgcount, msg_max);
+        return -EINVAL;
+    }
+    if (msgsize_max > 0 && channel->maxmsgsize > msgsize_max) {
+        printf("Error in opening channel: %s message size %ld exceeds /proc/sys/fs/mqueue/msgsize_max (%ld)\n", channel->path, channel->maxmsgsize, msgsize_max);
+        return -EINVAL;
+    }
+#ifdef RLIMIT_MSGQUEUE
+    struct rlimit limit;
+    const unsigned long long bytes = (unsigned long long)channel->maxmsgcount * (unsigned long long)(channel->maxmsgsize + SMQ_MQ_MSG_OVERHEAD);
+    if (getrlimit(RLIMIT_MSGQUEUE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && bytes > (unsigned long long)limit.rlim_cur) {
+        printf("Error in opening channel: %s needs %llu bytes, more than RLIMIT_MSGQUEUE (%llu)\n", channel->path, bytes, (unsigned long long)limit.rlim_cur);
+        return -EINVAL;
+    }
+#endif// RLIMIT_MSGQUEUE
+    return 0;
+}
+
+static inline int __smq_channel_format_lane_path(char *dest, size_t size, const char *path, size_t lane)
+{
+    const int written = snprintf(dest, size, "%s-lane%zu", path, lane);
+    return (written < 0 || (size_t)written >= size) ? -ENAMETOOLONG : 0;
+}
+
+static inline int __smq_channel_format_reply_path(char *dest, size_t size, const char *path, uint16_t clientid)
+{
+    int len = snprintf(dest, size, "%s-reply-%u", path, (unsigned)clientid);
+    return len < 0 || (size_t)len >= size ? -ENAMETOOLONG : 0;
+}
+
+static inline int smq_client_create(smq_client *client, uint16_t id, const char *path)
+{
+    return __smq_client_create(client, id, path, (smq_client_options){ .private_reply = false });
+}
+
+static inline int __smq_client_create(smq_client *client, uint16_t id, const char *path, smq_client_options options)
+{
+    client->id = id;
+    client->channel = (smq_channel){
+        .maxmsgsize = sizeof(smq_message),
+        .maxmsgcount = SMQ_MAX_MSG_COUNT,
+        .desc = -1,
+        .mode = 0666,
+        .oflag = O_RDWR,
+        .backend = options.backend
+    };
+    client->reply = client->channel;
+    client->next_seq = 0;
+    client->inflight = NULL;
+    client->inflight_capacity = 0;
+    client->pending = 0;
+    client->scratch = NULL;
+    client->busy_poll = NULL;
+    client->codec = options.codec;
+    client->wire = NULL;
+    client->route = options.route;
+    client->reply_tag = 0;
+
+    memcpy(&client->channel.path, path, strlen(path) + 1);
+    if (options.lane > 0 && __smq_channel_format_lane_path(client->channel.path, sizeof(client->channel.path), path, options.lane) != 0) {
+        return -1;
+    }
+    if (smq_channel_create(&client->channel) != 0) {
+        return -1;
+    }
+    if (options.codec.encode != NULL && (client->wire = malloc(sizeof(*client->wire))) == NULL) {
+        smq_client_destroy(client);
+        return -1;
+    }
+    // Shared responses only ever travel on lane 0, so lane clients need their own reply queue.
+    if (!options.private_reply && options.max_inflight == 0 && options.lane == 0 && !options.unique_id && options.busy_poll_us == 0) {
+        return 0;
+    }
+    if (options.busy_poll_us > 0) {
+        if ((client->busy_poll = malloc(sizeof(*client->busy_poll))) == NULL) {
+            smq_client_destroy(client);
+            return -1;
+        }
+        smq_busy_poll_init(client->busy_poll, options.busy_poll_us);
+    }
+    if (options.max_inflight > 0) {
+        client->inflight_capacity = 1;
+        while (client->inflight_capacity < options.max_inflight) {
+            client->inflight_capacity <<= 1;
+        }
+        client->inflight = calloc(client->inflight_capacity, sizeof(*client->inflight));
+        client->scratch = malloc(sizeof(*client->scratch));
+        if (client->inflight == NULL || client->scratch == NULL) {
+            smq_client_destroy(client);
+            return -1;
+        }
+    }
+    client->reply.maxmsgcount = options.reply_maxmsgcount > 0 ? options.reply_maxmsgcount : SMQ_DEFAULT_REPLY_MSG_COUNT;
+    if ((size_t)client->reply.maxmsgcount < client->inflight_capacity) {
+        client->reply.maxmsgcount = (long)client->inflight_capacity;
+    }
+    client->reply.maxmsgsize = client->channel.maxmsgsize;// responses can be no bigger than the route carries
+    // A queue already under this name may belong to a live client, the id is taken rather than stolen.
+    client->reply.oflag = O_RDONLY | O_CREAT | O_EXCL;
+    if (__smq_channel_format_reply_path(client->reply.path, sizeof(client->reply.path), path, id) != 0
+        || __smq_channel_check_limits(&client->reply) != 0) {
+        smq_client_destroy(client);
+        return -1;
+    }
+    if (options.unique_id) {
+        return __smq_client_claim_id(client, path);
+    }
+    if (smq_channel_create(&client->reply) != 0) {
+        const int error = errno;
+        client->reply.desc = (mqd_t)-1;
+        smq_client_destroy(client);
+        return error == EEXIST ? -EEXIST : -1;
+    }
+    client->reply_tag = __smq_client_new_reply_tag();
+    return 0;
+}
+
+// Pid and clock make it unlikely that a listener still holds a queue of the same id with the same tag.
+static inline uint32_t __smq_client_new_reply_tag(void)
+{
+    return (uint32_t)__smq_monotonic_us() ^ ((uint32_t)getpid() << 20);
+}
+
+// Whoever creates "<path>-reply-<id>" exclusively owns the id, so ids stay unique across threads and processes.
+static inline int __smq_client_claim_id(smq_client *client, const char *path)
+{
+    static const uint32_t id_count = UINT16_MAX + 1;
+    // Processes start at different ids so they rarely have to probe past each other's.
+    const uint32_t start = (uint32_t)getpid() * 40503u;
+    for (uint32_t i = 0; i < id_count; i++) {
+        const uint16_t id = (uint16_t)(start + i);
+        if (__smq_channel_format_reply_path(client->reply.path, sizeof(client->reply.path), path, id) != 0) {
+            break;
+        }
+        client->reply.desc = (mqd_t)-1;
+        if (smq_channel_create(&client->reply) == 0) {
+            client->id = id;
+            client->reply_tag = __smq_client_new_reply_tag();
+            return 0;
+        }
+        if (errno != EEXIST) {
+            break;
+        }
+    }
+    client->reply.desc = (mqd_t)-1;
+    smq_client_destroy(client);
+    return -1;
+}
+
+static inline void smq_client_destroy(const smq_client *client)
+{
+    smq_channel_close(&client->channel);
+    if (__smq_client_has_private_reply(client)) {
+        smq_channel_destroy(&client->reply);
+    }
+    free(client->inflight);
+    free(client->scratch);
+    free(client->busy_poll);
+    free(client->wire);
+}
+
+#ifdef SMQ_HAS_ATOMICS
+static inline int smq_client_pool_create(smq_client_pool *pool, const char *path)
+{
+    return __smq_client_pool_create(pool, path, (smq_client_pool_options){ 0 });
+}
+
+// Every client opens its descriptors once here and claims its own id, checkout and return never enter the kernel.
+static inline int __smq_client_pool_create(smq_client_pool *pool, const char *path, smq_client_pool_options options)
+{
+    const size_t count = options.clients > 0 ? options.clients : SMQ_DEFAULT_CLIENT_POOL_SIZE;
+    *pool = (smq_client_pool){ 0 };
+    if ((pool->clients = calloc(count, sizeof(*pool->clients))) == NULL || smq_mpmc_init(&pool->idle, count) != 0) {
+        free(pool->clients);
+        return -ENOMEM;
+    }
+    for (; pool->count < count; pool->count++) {
+        smq_client *client = &pool->clients[pool->count];
+        if (smq_client_create_with(client, 0, path, .unique_id = true, .backend = options.backend, .reply_maxmsgcount = options.reply_maxmsgcount, .lane = options.lane, .codec = options.codec, .route = options.route) != 0) {
+            smq_client_pool_destroy(pool);
+            return -1;
+        }
+        smq_mpmc_push(&pool->idle, client);
+    }
+    return 0;
+}
+
+// NULL while every client is checked out.
+static inline smq_client *smq_client_pool_checkout(smq_client_pool *pool)
+{
+    return smq_mpmc_pop(&pool->idle);
+}
+
+static inline void smq_client_pool_return(smq_client_pool *pool, smq_client *client)
+{
+    smq_mpmc_push(&pool->idle, client);
+}
+
+// Every client must have been returned.
+static inline void smq_client_pool_destroy(smq_client_pool *pool)
+{
+    for (size_t i = 0; i < pool->count; i++) {
+        smq_client_destroy(&pool->clients[i]);
+    }
+    smq_mpmc_destroy(&pool->idle);
+    free(pool->clients);
+    *pool = (smq_client_pool){ 0 };
+}
+#endif// SMQ_HAS_ATOMICS
+
+static inline smq_client_inflight *__smq_client_inflight_slot(const smq_client *client, smq_request_id id)
+{
+    return &client->inflight[id & (client->inflight_capacity - 1)];
+}
+
+static inline uint32_t __smq_client_next_seq(smq_client *client)
+{
+    // 0 never names a request, so an empty inflight slot cannot match a response.
+    if (++client->next_seq == 0) {
+        client->next_seq = 1;
+    }
+    return client->next_seq;
+}
+
+static inline int __smq_client_submit(smq_client *client, smq_message *request, smq_message *response, smq_request_id *id, smq_client_submit_options options)
+{
+    int send_res = 0;
+    if (client->inflight == NULL) {
+        return -EINVAL;
+    }
+    const uint32_t seq = __smq_client_next_seq(client);
+    smq_client_inflight *slot = __smq_client_inflight_slot(client, seq);
+    if (slot->state != SMQ_REQUEST_FREE) {
+        client->next_seq--;
+        return -EAGAIN;
+    }
+    __smq_client_prepare_request(client, request, seq, options.ttl_ms);
+    __smq_trace_sample(request);
+    *slot = (smq_client_inflight){
+        .seq = seq,
+        .state = SMQ_REQUEST_PENDING,
+        .deadline_ms = request->header.deadline_ms,
+        .response = response,
+        .callback = options.callback,
+        .userdata = options.userdata
+    };
+    const smq_message *wire = __smq_client_wire(client, request);
+    if ((send_res = smq_channel_send(&client->channel, (const char *)wire, smq_message_size(wire), .timeout_ms = options.timeout_ms, .priority = options.priority)) != 0) {
+        slot->state = SMQ_REQUEST_FREE;
+        return send_res;
+    }
+    client->pending++;
+    *id = seq;
+    return 0;
+}
+
+static inline void __smq_client_complete(smq_client *client, const smq_message *received)
+{
+    smq_client_inflight *slot = __smq_client_inflight_slot(client, received->header.seq);
+    if (received->header.clientid != client->id || slot->state != SMQ_REQUEST_PENDING || slot->seq != received->header.seq) {
+        return;// late answer to a request that was already dropped
+    }
+    __smq_trace_record(received, SMQ_TRACE_CLIENT_RECEIVE);
+    memcpy(slot->response, received, smq_message_size(received));
+    __smq_client_settle(client, slot);
+}
+
+static inline void __smq_client_settle(smq_client *client, smq_client_inflight *slot)
+{
+    client->pending--;
+    if (slot->callback != NULL) {
+        slot->state = SMQ_REQUEST_FREE;
+        slot->callback(slot->response, slot->userdata);
+        return;
+    }
+    slot->state = SMQ_REQUEST_DONE;
+}
+
+// The listener never answers past the deadline, such requests end with an empty SMQ_STATUS_EXPIRED response.
+static inline void __smq_client_expire(smq_client *client)
+{
+    const uint64_t now_ms = (uint64_t)__smq_monotonic_ms();
+    for (size_t i = 0; i < client->inflight_capacity && client->pending > 0; i++) {
+        smq_client_inflight *slot = &client->inflight[i];
+        if (slot->state != SMQ_REQUEST_PENDING || slot->deadline_ms == 0 || now_ms <= slot->deadline_ms) {
+            continue;
+        }
+        slot->response->header = (smq_msg_header){
+            .clientid = client->id,
+            .status = SMQ_STATUS_EXPIRED,
+            .isresponse = SMQ_STATUS_RESPONSE,
+            .seq = slot->seq,
+            .deadline_ms = slot->deadline_ms
+        };
+        __smq_client_settle(client, slot);
+    }
+}
+
+// A negative timeout blocks, 0 only takes what is already queued.
+static inline int __smq_client_receive_one(smq_client *client, long timeout_ms)
+{
+    const int listen_res = __smq_client_listen_reply(client, client->scratch, timeout_ms);
+    if (listen_res < 0) {
+        return listen_res;
+    }
+    if (__smq_message_received(client->scratch, listen_res) == 0 && client->scratch->header.isresponse == SMQ_STATUS_RESPONSE) {
+        if (__smq_codec_decode(&client->codec, client->scratch) != 0) {
+            smq_message_set_length(client->scratch, 0);
+            client->scratch->header.status = SMQ_STATUS_UNDECODABLE;
+        }
+        __smq_client_complete(client, client->scratch);
+    }
+    return 0;
+}
+
+static inline int smq_client_poll(smq_client *client)
+{
+    if (client->inflight == NULL) {
+        return -EINVAL;
+    }
+    const size_t before = client->pending;
+    while (client->pending > 0 && __smq_client_receive_one(client, 0) == 0) {
+    }
+    __smq_client_expire(client);
+    return (int)(before - client->pending);
+}
+
+static inline bool smq_client_is_done(const smq_client *client, smq_request_id id)
+{
+    const smq_client_inflight *slot = __smq_client_inflight_slot(client, id);
+    return slot->seq == id && slot->state == SMQ_REQUEST_DONE;
+}
+
+// Gives the slot back without waiting, a response that still arrives for id is dropped.
+static inline int smq_client_cancel(smq_client *client, smq_request_id id)
+{
+    if (client->inflight == NULL) {
+        return -EINVAL;
+    }
+    smq_client_inflight *slot = __smq_client_inflight_slot(client, id);
+    if (slot->seq != id || slot->state == SMQ_REQUEST_FREE) {
+        return -ENOENT;
+    }
+    if (slot->state == SMQ_REQUEST_PENDING) {
+        client->pending--;
+    }
+    slot->state = SMQ_REQUEST_FREE;
+    return 0;
+}
+
+// A negative timeout blocks, 0 only takes what is already queued, like smq_client_poll.
+static inline int smq_client_wait(smq_client *client, smq_request_id id, long timeout_ms)
+{
+    int res = 0;
+    const long deadline_ms = smq_timestamp_ms() + timeout_ms;
+    if (client->inflight == NULL) {
+        return -EINVAL;
+    }
+    smq_client_inflight *slot = __smq_client_inflight_slot(client, id);
+    if (slot->seq != id || slot->state == SMQ_REQUEST_FREE) {
+        return -ENOENT;
+    }
+    while (slot->state == SMQ_REQUEST_PENDING) {
+        long wait_ms = timeout_ms < 0 ? -1 : deadline_ms - smq_timestamp_ms();
+        if (timeout_ms >= 0 && wait_ms < 0) {
+            wait_ms = 0;
+        }
+        // Wake up at the request's own deadline at the latest, it expires then.
+        if (slot->deadline_ms != 0) {
+            const long ttl_left_ms = (long)slot->deadline_ms - __smq_monotonic_ms() + 1;
+            wait_ms = wait_ms < 0 || ttl_left_ms < wait_ms ? (ttl_left_ms > 0 ? ttl_left_ms : 0) : wait_ms;
+        }
+        if ((res = __smq_client_receive_one(client, wait_ms)) < 0 && res != -ETIMEDOUT && res != -EINTR) {
+            return res;
+        }
+        if (res < 0) {
+            __smq_client_expire(client);
+            if (slot->state == SMQ_REQUEST_PENDING && timeout_ms >= 0 && smq_timestamp_ms() >= deadline_ms) {
+                return -ETIMEDOUT;// still in flight, wait again or smq_client_cancel it
+            }
+        }
+    }
+    slot->state = SMQ_REQUEST_FREE;
+    return 0;
+}
+
+
+static inline void smq_server_create(smq_server *server, const char *name)
+{
+    __smq_server_create(server, name, (smq_server_options){ .reactor_threads = 0 });
+}
+
+static inline void __smq_server_create(smq_server *server, const char *name, smq_server_options options)
+{
+    *server = (smq_server){
+        .listeners = NULL,
+        .options = options
+    };
+    memcpy(&server->name, name, strlen(name) + 1);
+#ifdef SMQ_HAS_ATOMICS
+    atomic_init(&server->running, false);
+#else
+    server->running = false;
+#endif
+#ifdef SMQ_HAS_REACTOR
+    server->reactor_epoll = -1;
+    server->reactor_event = -1;
+    server->reactor_threads = NULL;
+    atomic_init(&server->reactors_running, 0);
+#else
+    server->options.reactor_threads = 0;
+#endif// SMQ_HAS_REACTOR
+}
+
+static inline smq_server_listener **smq_server_get_last_listener(smq_server_listener **listeners)
+{
+    smq_server_listener **tmp = listeners;
+    while (*tmp != NULL) {
+        tmp = (smq_server_listener **)&((*tmp)->next);
+    }
+    return tmp;
+}
+
+static inline int smq_server_add_listener(smq_server *server, const char *path, void (*handler)(smq_message *request, smq_message *response))
+{
+    return __smq_server_add_listener(server, path, handler, (smq_server_listener_options){ .workers = 0 });
+}
+
+static inline int __smq_listener_check_lanes(const smq_server_listener *listener)
+{
+    if (listener->options.lanes <= 1) {
+        return 0;
+    }
+#ifdef SMQ_HAS_REACTOR
+    if (listener->options.lanes <= SMQ_MAX_LANES && listener->channel.backend == SMQ_CHANNEL_BACKEND_MQ) {
+        return 0;
+    }
+#endif// SMQ_HAS_REACTOR
+    printf("smq_server_add_listener: %s wants %zu lanes, lanes need the mq backend on Linux and at most SMQ_MAX_LANES\n", listener->channel.path, listener->options.lanes);
+    return -EINVAL;
+}
+
+// Gathering happens on the receiving thread, handing whole batches to workers or lanes is not supported.
+static inline int __smq_listener_check_batch(const smq_server_listener *listener)
+{
+    if (listener->batch_handler == NULL || (listener->options.workers == 0 && listener->options.lanes <= 1)) {
+        return 0;
+    }
+    printf("smq_server_add_listener: %s batch handlers run without workers and lanes\n", listener->channel.path);
+    return -EINVAL;
+}
+
+static inline int __smq_listener_create_lanes(smq_server_listener *listener)
+{
+    if (listener->options.lanes <= 1) {
+        return 0;
+    }
+    if ((listener->lanes = calloc(listener->options.lanes - 1, sizeof(*listener->lanes))) == NULL) {
+        return -ENOMEM;
+    }
+    for (size_t lane = 1; lane < listener->options.lanes; lane++) {
+        smq_channel *channel = &listener->lanes[lane - 1];
+        *channel = listener->channel;
+        channel->desc = -1;
+        if (__smq_channel_format_lane_path(channel->path, sizeof(channel->path), listener->channel.path, lane) != 0
+            || __smq_channel_check_limits(channel) != 0
+            || smq_channel_create(channel) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static inline void __smq_listener_destroy_lanes(smq_server_listener *listener)
+{
+    for (size_t lane = 1; listener->lanes != NULL && lane < listener->options.lanes; lane++) {
+        if (listener->lanes[lane - 1].desc != -1) {
+            smq_channel_destroy(&listener->lanes[lane - 1]);
+        }
+    }
+    free(listener->lanes);
+    listener->lanes = NULL;
+}
+
+static inline int __smq_server_link_listener(smq_server *server, const char *path, void (*handler)(smq_message *request, smq_message *response), smq_span_handler span_handler, smq_batch_handler batch_handler, smq_server_listener_options options);
+
+static inline int __smq_server_add_listener(smq_server *server, const char *path, void (*handler)(smq_message *request, smq_message *response), smq_server_listener_options options)
+{
+    return __smq_server_link_listener(server, path, handler, NULL, NULL, options);
+}
+
+static inline int smq_server_add_span_listener(smq_server *server, const char *path, smq_span_handler handler)
+{
+    return __smq_server_link_listener(server, path, NULL, handler, NULL, (smq_server_listener_options){ .workers = 0 });
+}
+
+static inline int __smq_server_add_span_listener(smq_server *server, const char *path, smq_span_handler handler, smq_server_listener_options options)
+{
+    return __smq_server_link_listener(server, path, NULL, handler, NULL, options);
+}
+
+static inline int smq_server_add_batch_listener(smq_server *server, const char *path, smq_batch_handler handler)
+{
+    return __smq_server_link_listener(server, path, NULL, NULL, handler, (smq_server_listener_options){ .workers = 0 });
+}
+
+static inline int __smq_server_add_batch_listener(smq_server *server, const char *path, smq_batch_handler handler, smq_server_listener_options options)
+{
+    return __smq_server_link_listener(server, path, NULL, NULL, handler, options);
+}
+
+static inline smq_server_listener *__smq_server_find_listener(smq_server *server, const char *path)
+{
+    char full_path[sizeof(server->listeners->channel.path)];
+    if (snprintf(full_path, sizeof(full_path), "%s%s", server->name, path) >= (int)sizeof(full_path)) {
+        return NULL;
+    }
+    for (smq_server_listener *lsner = server->listeners; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
+        if (strcmp(lsner->channel.path, full_path) == 0) {
+            return lsner;
+        }
+    }
+    return NULL;
+}
+
+static inline int smq_server_add_router(smq_server *server, const char *path)
+{
+    return __smq_server_add_router(server, path, (smq_server_listener_options){ .workers = 0 });
+}
+
+// One queue and one receive thread for any number of routes, every route added later only costs a table entry.
+static inline int __smq_server_add_router(smq_server *server, const char *path, smq_server_listener_options options)
+{
+    int ret = 0;
+    if (options.cache_entries > 0) {
+        return -EINVAL;// cached responses are keyed by payload alone, they would be shared between routes
+    }
+    if ((ret = __smq_server_link_listener(server, path, NULL, NULL, NULL, options)) != 0) {
+        return ret;
+    }
+    __smq_server_find_listener(server, path)->router = true;
+    return 0;
+}
+
+static inline int __smq_server_link_route(smq_server *server, const char *path, smq_route route)
+{
+    smq_server_listener *router = __smq_server_find_listener(server, path);
+    smq_route *routes = NULL;
+    if (router == NULL || !router->router) {
+        return -ENOENT;
+    }
+    if (route.id == 0 || route.id > SMQ_MAX_ROUTE_ID || (route.handler == NULL && route.span_handler == NULL)) {
+        return -EINVAL;
+    }
+    if (smq_server_is_running(server)) {
+        return -EBUSY;// the table is built once by smq_server_start
+    }
+    for (size_t i = 0; i < router->route_count; i++) {
+        if (router->routes[i].id == route.id) {
+            return -EEXIST;
+        }
+    }
+    if ((routes = realloc(router->routes, (router->route_count + 1) * sizeof(*routes))) == NULL) {
+        return -ENOMEM;
+    }
+    routes[router->route_count++] = route;
+    router->routes = routes;
+    return 0;
+}
+
+static inline int smq_server_add_route(smq_server *server, const char *path, uint16_t id, void (*handler)(smq_message *request, smq_message *response))
+{
+    return __smq_server_link_route(server, path, (smq_route){ .id = id, .handler = handler });
+}
+
+static inline int smq_server_add_span_route(smq_server *server, const char *path, uint16_t id, smq_span_handler handler)
+{
+    return __smq_server_link_route(server, path, (smq_route){ .id = id, .span_handler = handler });
+}
+
+// Dense table indexed by route id, dispatch is one bounds check and one load, it is as large as the highest id (at most SMQ_MAX_ROUTE_ID).
+static inline int __smq_listener_build_routes(smq_server_listener *listener)
+{
+    size_t size = 0;
+    free(listener->route_table);
+    listener->route_table = NULL;
+    listener->route_table_size = 0;
+    for (size_t i = 0; i < listener->route_count; i++) {
+        size = (size_t)listener->routes[i].id + 1 > size ? (size_t)listener->routes[i].id + 1 : size;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    if ((listener->route_table = calloc(size, sizeof(*listener->route_table))) == NULL) {
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < listener->route_count; i++) {
+        listener->route_table[listener->routes[i].id] = &listener->routes[i];
+    }
+    listener->route_table_size = size;
+    return 0;
+}
+
+static inline int __smq_server_link_listener(smq_server *server, const char *path, void (*handler)(smq_message *request, smq_message *response), smq_span_handler span_handler, smq_batch_handler batch_handler, smq_server_listener_options options)
+{
+    smq_server_listener **new_listener = smq_server_get_last_listener(&server->listeners);
+    size_t max_payload = options.max_payload > 0 ? options.max_payload : server->options.max_payload;
+    long queue_depth = options.queue_depth > 0 ? options.queue_depth : server->options.queue_depth;
+    if (max_payload == 0) max_payload = SMQ_PAYLOAD_SIZE;
+    if (queue_depth <= 0) queue_depth = SMQ_MAX_MSG_COUNT;
+    if (max_payload > SMQ_PAYLOAD_SIZE) {
+        printf("smq_server_add_listener: %s%s payload of %zu bytes exceeds SMQ_PAYLOAD_SIZE\n", server->name, path, max_payload);
+        return -EINVAL;
+    }
+    *new_listener = malloc(sizeof(smq_server_listener));
+    **new_listener = (smq_server_listener){
+        .channel = (smq_channel){
+          .maxmsgsize = (long)(SMQ_HEADER_SIZE + max_payload),
+          .maxmsgcount = queue_depth,
+          .desc = -1,
+          .mode = 0666,
+          .oflag = O_RDWR | O_CREAT,
+          .backend = options.backend },
+        .lanes = NULL,
+        .cache = NULL,
+        .handler = handler,
+        .span_handler = span_handler,
+        .batch_handler = batch_handler,
+        .gathered = NULL,
+        .router = false,
+        .routes = NULL,
+        .route_count = 0,
+        .route_table = NULL,
+        .route_table_size = 0,
+        .options = options,
+        .next = NULL,
+        .thread = 0,
+        .parent_server = server,
+        .is_listening = false,
+        .requeued = 0
+    };
+    smq_busy_poll_init(&(*new_listener)->busy_poll, options.busy_poll_us);
+    __smq_listener_init_replies(*new_listener);
+    memcpy(&(*new_listener)->channel.path, server->name, strlen(server->name));
+    memcpy(&(*new_listener)->channel.path[strlen(server->name)], path, strlen(path) + 1);
+    if (__smq_channel_check_limits(&(*new_listener)->channel) != 0 || __smq_listener_check_lanes(*new_listener) != 0 || __smq_listener_check_batch(*new_listener) != 0) {
+        free(*new_listener);
+        *new_listener = NULL;
+        return -EINVAL;
+    }
+    if (smq_channel_create(&(*new_listener)->channel) != 0) {
+        return -1;
+    }
+    if (options.cache_entries > 0 && batch_handler == NULL) {
+#ifdef SMQ_HAS_ATOMICS
+        (*new_listener)->cache = __smq_cache_create(options.cache_entries, max_payload, options.cache_ttl_ms);
+#endif// SMQ_HAS_ATOMICS
+        if ((*new_listener)->cache == NULL) {
+            puts("smq_server_add_listener unable to allocate response cache.");
+            return -ENOMEM;
+        }
+    }
+    return __smq_listener_create_lanes(*new_listener);
+}
+
+static inline size_t smq_server_listener_max_payload(const smq_server_listener *listener)
+{
+    return (size_t)listener->channel.maxmsgsize - SMQ_HEADER_SIZE;
+}
+
+
+static inline bool __smq_server_listener_is_ready(smq_server_listener *listener)
+{
+    bool res = false;
+#ifdef SMQ_HAS_ATOMICS
+    res = atomic_load(&listener->is_listening);
+#else
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&mutex);
+    res = listener->is_listening;
+    pthread_mutex_unlock(&mutex);
+#endif
+    return res;
+}
+
+static inline void __smq_server_listener_modify_readiness(smq_server_listener *listener, bool new_state)
+{
+#ifdef SMQ_HAS_ATOMICS
+    atomic_store(&listener->is_listening, new_state);
+#else
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&mutex);
+    listener->is_listening = new_state;
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+static inline void __smq_server_listener_count_requeue(smq_server_listener *listener)
+{
+#ifdef SMQ_HAS_ATOMICS
+    atomic_fetch_add_explicit(&listener->requeued, 1, memory_order_relaxed);
+#else
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&mutex);
+    listener->requeued++;
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+static inline unsigned long smq_server_listener_requeued(smq_server_listener *listener)
+{
+#ifdef SMQ_HAS_ATOMICS
+    return atomic_load_explicit(&listener->requeued, memory_order_relaxed);
+#else
+    return listener->requeued;
+#endif
+}
+
+#ifdef SMQ_HAS_METRICS
+#define __smq_listener_count(listener, counter, value) \
+    atomic_fetch_add_explicit(&(listener)->metrics.counter, (unsigned long)(value), memory_order_relaxed)
+
+static inline void __smq_listener_count_handler(smq_server_listener *listener, uint64_t elapsed_us)
+{
+    size_t bucket = 0;
+    while ((elapsed_us >>= 1) != 0 && bucket < SMQ_METRICS_HISTOGRAM_BUCKETS - 1) {
+        bucket++;
+    }
+    atomic_fetch_add_explicit(&listener->metrics.handler_us[bucket], 1, memory_order_relaxed);
+}
+#else
+#define __smq_listener_count(listener, counter, value) ((void)0)
+#define __smq_listener_count_handler(listener, elapsed_us) ((void)0)
+#endif// SMQ_HAS_METRICS
+
+static inline long __smq_channel_depth(const smq_channel *channel)
+{
+    struct mq_attr attr;
+#ifdef SMQ_HAS_SHM
+    if (channel->backend == SMQ_CHANNEL_BACKEND_SHM) {
+        return __smq_shm_depth(channel);
+    }
+#endif// SMQ_HAS_SHM
+    if (channel->backend != SMQ_CHANNEL_BACKEND_MQ || mq_getattr(channel->desc, &attr) != 0) {
+        return -1;
+    }
+    return attr.mq_curmsgs;
+}
+
+// Messages waiting over all lanes, -1 if any lane cannot tell.
+static inline long __smq_listener_depth(const smq_server_listener *listener)
+{
+    long total = __smq_channel_depth(&listener->channel);
+    for (size_t lane = 1; listener->lanes != NULL && lane < listener->options.lanes && total >= 0; lane++) {
+        const long depth = __smq_channel_depth(&listener->lanes[lane - 1]);
+        total = depth < 0 ? -1 : total + depth;
+    }
+    return total;
+}
+
+static inline void __smq_listener_stats_snapshot(smq_server_listener *listener, smq_listener_stats *stats)
+{
+    *stats = (smq_listener_stats){
+        .path = listener->channel.path,
+        .requeued = smq_server_listener_requeued(listener),
+        .queue_depth = __smq_listener_depth(listener)
+    };
+#ifdef SMQ_HAS_METRICS
+    stats->requests = atomic_load_explicit(&listener->metrics.requests, memory_order_relaxed);
+    stats->bytes_in = atomic_load_explicit(&listener->metrics.bytes_in, memory_order_relaxed);
+    stats->bytes_out = atomic_load_explicit(&listener->metrics.bytes_out, memory_order_relaxed);
+    stats->timeouts = atomic_load_explicit(&listener->metrics.timeouts, memory_order_relaxed);
+    stats->send_retries = atomic_load_explicit(&listener->metrics.send_retries, memory_order_relaxed);
+    stats->expired = atomic_load_explicit(&listener->metrics.expired, memory_order_relaxed);
+    stats->shed = atomic_load_explicit(&listener->metrics.shed, memory_order_relaxed);
+    stats->cache_hits = atomic_load_explicit(&listener->metrics.cache_hits, memory_order_relaxed);
+    stats->cache_misses = atomic_load_explicit(&listener->metrics.cache_misses, memory_order_relaxed);
+    stats->reply_opens = atomic_load_explicit(&listener->metrics.reply_opens, memory_order_relaxed);
+    for (size_t i = 0; i < SMQ_METRICS_HISTOGRAM_BUCKETS; i++) {
+        stats->handler_us[i] = atomic_load_explicit(&listener->metrics.handler_us[i], memory_order_relaxed);
+    }
+#endif// SMQ_HAS_METRICS
+}
+
+static inline size_t smq_server_stats_snapshot(smq_server *server, smq_listener_stats *stats, size_t capacity)
+{
+    size_t count = 0;
+    for (smq_server_listener *lsner = server->listeners; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
+        if (count < capacity) {
+            __smq_listener_stats_snapshot(lsner, &stats[count]);
+        }
+        count++;
+    }
+    return count;
+}
+
+static inline unsigned long smq_listener_stats_handler_percentile_us(const smq_listener_stats *stats, double percentile)
+{
+    unsigned long total = 0;
+    unsigned long seen = 0;
+    for (size_t i = 0; i < SMQ_METRICS_HISTOGRAM_BUCKETS; i++) {
+        total += stats->handler_us[i];
+    }
+    for (size_t i = 0; i < SMQ_METRICS_HISTOGRAM_BUCKETS; i++) {
+        seen += stats->handler_us[i];
+        if (seen > 0 && (double)seen >= percentile / 100.0 * (double)total) {
+            return (2ul << i) - 1;// upper edge of the bucket
+        }
+    }
+    return 0;
+}
+
+static inline void __smq_listener_init_replies(smq_server_listener *listener)
+{
+    pthread_mutex_init(&listener->replies.lock, NULL);
+    listener->replies.slots = NULL;
+    listener->replies.capacity = 0;
+    listener->replies.count = 0;
+}
+
+static inline size_t __smq_reply_table_index(const smq_reply_table *table, uint16_t clientid)
+{
+    size_t i = ((size_t)clientid * 40503u) & (table->capacity - 1);
+    while (table->slots[i] != NULL && table->slots[i]->clientid != clientid) {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return i;
+}
+
+static inline int __smq_reply_table_grow(smq_reply_table *table)
+{
+    smq_reply_table grown = { .capacity = table->capacity > 0 ? table->capacity * 2 : SMQ_REPLY_TABLE_MIN };
+    if ((grown.slots = calloc(grown.capacity, sizeof(*grown.slots))) == NULL) {
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i] != NULL) {
+            grown.slots[__smq_reply_table_index(&grown, table->slots[i]->clientid)] = table->slots[i];
+        }
+    }
+    free(table->slots);
+    table->slots = grown.slots;
+    table->capacity = grown.capacity;
+    return 0;
+}
+
+// The client's slot, added on its first reply, NULL only when memory runs out.
+static inline smq_reply_slot *__smq_reply_table_get(smq_reply_table *table, uint16_t clientid)
+{
+    smq_reply_slot *slot = NULL;
+    pthread_mutex_lock(&table->lock);
+    if ((table->count + 1) * 2 > table->capacity && __smq_reply_table_grow(table) != 0) {
+        pthread_mutex_unlock(&table->lock);
+        return NULL;
+    }
+    const size_t i = __smq_reply_table_index(table, clientid);
+    if ((slot = table->slots[i]) == NULL && (slot = malloc(sizeof(*slot))) != NULL) {
+        pthread_mutex_init(&slot->lock, NULL);
+        slot->clientid = clientid;
+        slot->reply_tag = 0;
+        slot->channel.desc = (mqd_t)-1;
+        table->slots[i] = slot;
+        table->count++;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return slot;
+}
+
+static inline void __smq_reply_slot_close(smq_reply_slot *slot)
+{
+    if (slot->channel.desc != (mqd_t)-1) {
+        smq_channel_close(&slot->channel);
+        slot->channel.desc = (mqd_t)-1;
+    }
+}
+
+// Every thread that answers has stopped, so no slot is held any more.
+static inline void __smq_listener_close_replies(smq_server_listener *listener)
+{
+    for (size_t i = 0; i < listener->replies.capacity; i++) {
+        if (listener->replies.slots[i] != NULL) {
+            __smq_reply_slot_close(listener->replies.slots[i]);
+        }
+    }
+}
+
+static inline void __smq_listener_destroy_replies(smq_server_listener *listener)
+{
+    __smq_listener_close_replies(listener);
+    for (size_t i = 0; i < listener->replies.capacity; i++) {
+        if (listener->replies.slots[i] != NULL) {
+            pthread_mutex_destroy(&listener->replies.slots[i]->lock);
+            free(listener->replies.slots[i]);
+        }
+    }
+    free(listener->replies.slots);
+    pthread_mutex_destroy(&listener->replies.lock);
+}
+
+// Opens the client's reply queue unless the slot already holds it, a different tag means the client re-created it.
+static inline int __smq_reply_slot_open(smq_server_listener *listener, smq_reply_slot *slot, const smq_msg_header *header)
+{
+    if (slot->channel.desc != (mqd_t)-1 && slot->reply_tag == header->reply_tag) {
+        return 0;
+    }
+    __smq_reply_slot_close(slot);
+    slot->channel = (smq_channel){
+        .maxmsgsize = sizeof(smq_message),
+        .maxmsgcount = SMQ_DEFAULT_REPLY_MSG_COUNT,
+        .desc = -1,
+        .mode = 0666,
+        .oflag = O_WRONLY,
+        .backend = listener->channel.backend
+    };
+    if (__smq_channel_format_reply_path(slot->channel.path, sizeof(slot->channel.path), listener->channel.path, header->clientid) != 0) {
+        return -ENAMETOOLONG;
+    }
+    if (smq_channel_create(&slot->channel) != 0) {
+        slot->channel.desc = (mqd_t)-1;
+        return -ENOENT;
+    }
+    slot->reply_tag = header->reply_tag;
+    __smq_listener_count(listener, reply_opens, 1);
+    return 0;
+}
+
+static inline int __smq_listener_send_private_reply(smq_server_listener *listener, const smq_message *msgresp, long timeout_ms)
+{
+    int send_res = 0;
+    smq_reply_slot *slot = NULL;
+    // Nobody reads the reply queue after the deadline, waiting past it only stalls the route.
+    if (msgresp->header.deadline_ms != 0) {
+        const long remaining_ms = (long)msgresp->header.deadline_ms - __smq_monotonic_ms();
+        if (remaining_ms <= 0) {
+            __smq_listener_count(listener, expired, 1);
+            return -ETIMEDOUT;
+        }
+        timeout_ms = remaining_ms < timeout_ms ? remaining_ms : timeout_ms;
+    }
+    if ((slot = __smq_reply_table_get(&listener->replies, msgresp->header.clientid)) == NULL) {
+        return -ENOMEM;
+    }
+    pthread_mutex_lock(&slot->lock);
+    if ((send_res = __smq_reply_slot_open(listener, slot, &msgresp->header)) == 0) {
+        // Single attempt, a client that stopped reading its reply queue must not stall the route.
+        send_res = smq_channel_timed_send(&slot->channel, (const char *)msgresp, smq_message_size(msgresp), 0, timeout_ms);
+    }
+    if (send_res == -ETIMEDOUT) {
+        __smq_listener_count(listener, timeouts, 1);
+    }
+    // The client may be gone, the next reply opens its queue afresh.
+    if (send_res != 0) {
+        __smq_reply_slot_close(slot);
+    }
+    pthread_mutex_unlock(&slot->lock);
+    return send_res;
+}
+
+static const long __smq_listener_timeout_ms = 700;
+static const long __smq_reactor_reply_timeout_ms = 20;
+
+// A reactor thread answers for every pollable route, a client that stopped reading may hold it up only briefly.
+static inline long __smq_listener_reply_timeout_ms(const smq_server_listener *listener)
+{
+#ifdef SMQ_HAS_REACTOR
+    if (listener->parent_server->options.reactor_threads > 0 && __smq_listener_is_pollable(listener)) {
+        return __smq_reactor_reply_timeout_ms;
+    }
+#endif// SMQ_HAS_REACTOR
+    return __smq_listener_timeout_ms;
+}
+
+static inline size_t __smq_listener_batch_size(const smq_server_listener *listener)
+{
+    return listener->options.batch_size > 0 ? listener->options.batch_size : SMQ_DEFAULT_LISTENER_BATCH;
+}
+
+static inline void __smq_listener_stamp_response(const smq_message *msgrecv, smq_message *msgresp)
+{
+    msgresp->header.clientid = msgrecv->header.clientid;
+    msgresp->header.seq = msgrecv->header.seq;
+    msgresp->header.deadline_ms = msgrecv->header.deadline_ms;
+    msgresp->header.route = msgrecv->header.route;
+    msgresp->header.reply_tag = msgrecv->header.reply_tag;
+    msgresp->header.isresponse = SMQ_STATUS_RESPONSE;
+    msgresp->header.flags |= msgrecv->header.flags & SMQ_FLAG_TRACED;
+}
+
+static inline bool __smq_listener_expired(smq_server_listener *listener, const smq_message *msgrecv)
+{
+    if (msgrecv->header.deadline_ms == 0 || (uint64_t)__smq_monotonic_ms() <= msgrecv->header.deadline_ms) {
+        return false;
+    }
+    __smq_listener_count(listener, expired, 1);
+    return true;
+}
+
+static inline unsigned long __smq_listener_handler_avg_us(smq_server_listener *listener)
+{
+#ifdef SMQ_HAS_ATOMICS
+    return atomic_load_explicit(&listener->handler_avg_us, memory_order_relaxed);
+#else
+    return listener->handler_avg_us;
+#endif
+}
+
+// Exponential moving average with weight 1/8, concurrent workers may lose an update which only delays it a little.
+static inline void __smq_listener_track_handler(smq_server_listener *listener, uint64_t elapsed_us)
+{
+    const unsigned long avg = __smq_listener_handler_avg_us(listener);
+#ifdef SMQ_HAS_ATOMICS
+    atomic_store_explicit(&listener->handler_avg_us, avg - avg / 8 + (unsigned long)elapsed_us / 8, memory_order_relaxed);
+#else
+    listener->handler_avg_us = avg - avg / 8 + (unsigned long)elapsed_us / 8;
+#endif
+}
+
+// Sampled once per receive batch, a queue depth check costs a syscall.
+static inline bool __smq_listener_overloaded(smq_server_listener *listener)
+{
+    if (listener->options.shed_handler_us > 0 && __smq_listener_handler_avg_us(listener) > listener->options.shed_handler_us) {
+        return true;
+    }
+    return listener->options.shed_queue_depth > 0 && __smq_listener_depth(listener) >= listener->options.shed_queue_depth;
+}
+
+static inline void __smq_listener_shed(smq_server_listener *listener, const smq_message *msgrecv, smq_message *msgresp)
+{
+    __smq_listener_count(listener, shed, 1);
+    smq_message_set_length(msgresp, 0);
+    msgresp->header.status = SMQ_STATUS_OVERLOADED;
+    __smq_listener_stamp_response(msgrecv, msgresp);
+}
+
+// Span handlers see an offloaded request's slab data directly, false when its slot was already reclaimed.
+static inline bool __smq_listener_request_view(smq_server_listener *listener, const smq_message *msgrecv, smq_request_view *request)
+{
+    *request = (smq_request_view){ .data = msgrecv->payload, .length = smq_message_length(msgrecv) };
+#ifdef SMQ_HAS_SHM
+    if (listener->options.slab != NULL && (msgrecv->header.flags & SMQ_FLAG_OFFLOADED)) {
+        request->data = smq_message_slab_data(msgrecv, listener->options.slab, &request->length);
+        return request->data != NULL;
+    }
+#else
+    (void)listener;
+#endif// SMQ_HAS_SHM
+    return true;
+}
+
+// Once a request is handled, expired or shed its slab slot goes back, the descriptor is dead after that.
+static inline void __smq_listener_clear_request(smq_server_listener *listener, smq_message *msgrecv)
+{
+#ifdef SMQ_HAS_SHM
+    if (listener->options.slab != NULL && msgrecv->header.isresponse == SMQ_STATUS_REQUEST) {
+        (void)smq_message_release_slab(msgrecv, listener->options.slab);
+    }
+#else
+    (void)listener;
+#endif// SMQ_HAS_SHM
+    smq_message_clear(msgrecv);
+}
+
+// With a codec a response only has to fit the route once compressed, so handlers may fill the whole payload.
+static inline size_t __smq_listener_response_capacity(const smq_server_listener *listener)
+{
+    return listener->options.codec.encode != NULL ? SMQ_PAYLOAD_SIZE : smq_server_listener_max_payload(listener);
+}
+
+// Compressed requests are decoded in place before anything looks at the payload, false when they were answered with a status instead.
+static inline bool __smq_listener_decode_request(smq_server_listener *listener, smq_message *msgrecv, smq_message *msgresp)
+{
+    if (__smq_codec_decode(&listener->options.codec, msgrecv) == 0) {
+        return true;
+    }
+    smq_message_set_length(msgresp, 0);
+    msgresp->header.status = SMQ_STATUS_UNDECODABLE;
+    __smq_listener_stamp_response(msgrecv, msgresp);
+    return false;
+}
+
+// Only clients that said they can decode get compressed responses, whatever still does not fit the route is dropped.
+static inline void __smq_listener_encode_response(smq_server_listener *listener, const smq_message *msgrecv, smq_message *msgresp)
+{
+    if (msgrecv->header.flags & SMQ_FLAG_ACCEPTS_CODEC) {
+        __smq_codec_encode_in_place(&listener->options.codec, msgresp);
+    }
+    if (smq_message_length(msgresp) > smq_server_listener_max_payload(listener)) {
+        smq_message_clear(msgresp);
+        msgresp->header.status = SMQ_STATUS_TOO_LARGE;
+    }
+}
+
+static inline const smq_route *__smq_listener_route(const smq_server_listener *listener, const smq_message *msgrecv)
+{
+    return msgrecv->header.route < listener->route_table_size ? listener->route_table[msgrecv->header.route] : NULL;
+}
+
+static inline void __smq_listener_run_handler(smq_server_listener *listener, const smq_message *msgrecv, smq_message *msgresp)
+{
+#ifdef SMQ_HAS_METRICS
+    const bool timed = true;
+#else
+    const bool timed = listener->options.shed_handler_us > 0;
+#endif// SMQ_HAS_METRICS
+    void (*handler)(smq_message *request, smq_message *response) = listener->handler;
+    smq_span_handler span_handler = listener->span_handler;
+    if (listener->router) {
+        const smq_route *route = __smq_listener_route(listener, msgrecv);
+        if (route == NULL) {
+            smq_message_set_length(msgresp, 0);
+            msgresp->header.status = SMQ_STATUS_NO_ROUTE;
+            return;
+        }
+        handler = route->handler;
+        span_handler = route->span_handler;
+    }
+    const uint64_t started_us = timed ? __smq_monotonic_us() : 0;
+    smq_request_view request;
+    if (span_handler != NULL && !__smq_listener_request_view(listener, msgrecv, &request)) {
+        smq_message_set_length(msgresp, 0);
+        msgresp->header.status = SMQ_STATUS_STALE;
+    } else if (span_handler != NULL) {
+        const smq_response_span response = { .data = msgresp->payload, .capacity = __smq_listener_response_capacity(listener) };
+        __smq_trace_record(msgrecv, SMQ_TRACE_HANDLER_START);
+        const int written = span_handler(request, response);
+        __smq_trace_record(msgrecv, SMQ_TRACE_HANDLER_END);
+        if (written < 0) {
+            smq_message_set_length(msgresp, 0);
+            msgresp->header.status = (uint8_t)(-written > 0xFF ? 0xFF : -written);
+        } else if ((size_t)written > response.capacity) {
+            smq_message_set_length(msgresp, 0);
+            msgresp->header.status = SMQ_STATUS_TOO_LARGE;
+        } else {
+            smq_message_set_length(msgresp, (size_t)written);
+        }
+    } else {
+        // Handlers that never report a length keep the old behaviour of shipping the whole payload.
+        smq_message_set_length(msgresp, smq_server_listener_max_payload(listener));
+        __smq_trace_record(msgrecv, SMQ_TRACE_HANDLER_START);
+        handler((smq_message *)msgrecv, msgresp);
+        __smq_trace_record(msgrecv, SMQ_TRACE_HANDLER_END);
+    }
+    if (timed) {
+        const uint64_t elapsed_us = __smq_monotonic_us() - started_us;
+        __smq_listener_count_handler(listener, elapsed_us);
+        if (listener->options.shed_handler_us > 0) {
+            __smq_listener_track_handler(listener, elapsed_us);
+        }
+    }
+    if (smq_message_length(msgresp) > __smq_listener_response_capacity(listener)) {
+        smq_message_clear(msgresp);
+        msgresp->header.status = SMQ_STATUS_TOO_LARGE;
+    }
+}
+
+static inline void __smq_listener_invoke(smq_server_listener *listener, const smq_message *msgrecv, smq_message *msgresp)
+{
+#ifdef SMQ_HAS_ATOMICS
+    // Offloaded requests would be keyed by their descriptor, which never repeats.
+    if (listener->cache == NULL || (msgrecv->header.flags & SMQ_FLAG_OFFLOADED)) {
+        __smq_listener_run_handler(listener, msgrecv, msgresp);
+    } else if (__smq_cache_lookup(listener->cache, msgrecv, msgresp)) {
+        __smq_listener_count(listener, cache_hits, 1);
+    } else {
+        __smq_listener_count(listener, cache_misses, 1);
+        __smq_listener_run_handler(listener, msgrecv, msgresp);
+        __smq_cache_store(listener->cache, msgrecv, msgresp);
+    }
+#else
+    __smq_listener_run_handler(listener, msgrecv, msgresp);
+#endif// SMQ_HAS_ATOMICS
+    __smq_listener_count(listener, requests, 1);
+    __smq_listener_count(listener, bytes_in, smq_message_length(msgrecv));
+    __smq_listener_count(listener, bytes_out, smq_message_length(msgresp));
+    __smq_listener_encode_response(listener, msgrecv, msgresp);
+    __smq_listener_stamp_response(msgrecv, msgresp);
+}
+
+// One handler call for the whole batch, the shedding average is kept per request so thresholds mean the same as elsewhere.
+static inline void __smq_listener_invoke_batch(smq_server_listener *listener, smq_message **requests, smq_message **responses, size_t count)
+{
+#ifdef SMQ_HAS_METRICS
+    const bool timed = true;
+#else
+    const bool timed = listener->options.shed_handler_us > 0;
+#endif// SMQ_HAS_METRICS
+    const uint64_t started_us = timed ? __smq_monotonic_us() : 0;
+    for (size_t i = 0; i < count; i++) {
+        smq_message_set_length(responses[i], smq_server_listener_max_payload(listener));
+    }
+    for (size_t i = 0; i < count; i++) {
+        __smq_trace_record(requests[i], SMQ_TRACE_HANDLER_START);
+    }
+    listener->batch_handler(requests, responses, count);
+    for (size_t i = 0; i < count; i++) {
+        __smq_trace_record(requests[i], SMQ_TRACE_HANDLER_END);
+    }
+    if (timed) {
+        const uint64_t elapsed_us = __smq_monotonic_us() - started_us;
+        __smq_listener_count_handler(listener, elapsed_us);
+        if (listener->options.shed_handler_us > 0) {
+            __smq_listener_track_handler(listener, elapsed_us / count);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (smq_message_length(responses[i]) > __smq_listener_response_capacity(listener)) {
+            smq_message_clear(responses[i]);
+            responses[i]->header.status = SMQ_STATUS_TOO_LARGE;
+        }
+        __smq_listener_count(listener, requests, 1);
+        __smq_listener_count(listener, bytes_in, smq_message_length(requests[i]));
+        __smq_listener_count(listener, bytes_out, smq_message_length(responses[i]));
+        __smq_listener_encode_response(listener, requests[i], responses[i]);
+        __smq_listener_stamp_response(requests[i], responses[i]);
+    }
+}
+
+static inline void __smq_listener_send_all(smq_server_listener *listener, const smq_channel_buffer *buffers, size_t count)
+{
+    int send_res = 0;
+    while (count > 0) {
+        if ((send_res = smq_channel_send_batch(&listener->channel, buffers, count, .timeout_ms = __smq_listener_timeout_ms)) < 0) {
+            switch (send_res) {
+            case -ETIMEDOUT: {
+                // Nobody drains the route once the server stops, keep retrying only while it runs.
+                if (smq_server_is_running(listener->parent_server)) {
+                    __smq_listener_count(listener, send_retries, 1);
+                    continue;
+                }
+                break;
+            }
+            }
+            return;
+        }
+        buffers += send_res;
+        count -= (size_t)send_res;
+    }
+}
+
+static inline void __smq_listener_send_response(smq_server_listener *listener, const smq_message *msgrecv, smq_message *msgresp)
+{
+    const smq_channel_buffer buffer = { .data = (char *)msgresp, .length = smq_message_size(msgresp) };
+    if (msgrecv->header.flags & SMQ_FLAG_PRIVATE_REPLY) {
+        (void)__smq_listener_send_private_reply(listener, msgresp, __smq_listener_reply_timeout_ms(listener));
+    } else {
+        __smq_listener_send_all(listener, &buffer, 1);
+    }
+    __smq_trace_record(msgresp, SMQ_TRACE_RESPONSE_SEND);
+}
+
+static inline void __smq_listener_handle(smq_server_listener *listener, smq_message *msgrecv, smq_message *msgresp)
+{
+    // Checked again here, the request may have expired while it waited for a worker.
+    if (!__smq_listener_expired(listener, msgrecv)) {
+        if (__smq_listener_decode_request(listener, msgrecv, msgresp)) {
+            __smq_listener_invoke(listener, msgrecv, msgresp);
+        }
+        __smq_listener_send_response(listener, msgrecv, msgresp);
+    }
+    __smq_listener_clear_request(listener, msgrecv);
+    smq_message_clear(msgresp);
+}
+
+static inline void __smq_listener_requeue(smq_server_listener *listener, const smq_message *msgrecv)
+{
+    const smq_channel_buffer buffer = { .data = (char *)msgrecv, .length = smq_message_size(msgrecv) };
+    __smq_server_listener_count_requeue(listener);
+    __smq_listener_send_all(listener, &buffer, 1);
+}
+
+// Private replies leave at once, responses for the shared route queue are collected into outgoing.
+static inline void __smq_listener_queue_response(smq_server_listener *listener, const smq_message *msgrecv, smq_message *msgresp, smq_channel_buffer *outgoing, size_t *pending)
+{
+    if (msgrecv->header.flags & SMQ_FLAG_PRIVATE_REPLY) {
+        (void)__smq_listener_send_private_reply(listener, msgresp, __smq_listener_reply_timeout_ms(listener));
+        __smq_trace_record(msgresp, SMQ_TRACE_RESPONSE_SEND);
+        return;
+    }
+    outgoing[(*pending)++] = (smq_channel_buffer){ .data = (char *)msgresp, .length = smq_message_size(msgresp) };
+}
+
+// Handles everything one wakeup delivered, responses and foreign messages for the shared route queue leave in one batch.
+static inline void __smq_listener_process_batch(smq_server_listener *listener, smq_message **msgrecv, smq_message **msgresp, const smq_channel_buffer *received, smq_channel_buffer *outgoing, size_t count)
+{
+    size_t pending = 0;
+    size_t gathered = 0;
+    const size_t batch = __smq_listener_batch_size(listener);
+    const bool overloaded = __smq_listener_overloaded(listener);
+    for (size_t i = 0; i < count; i++) {
+        if (__smq_message_received(msgrecv[i], (int)received[i].length) != 0) {
+            continue;
+        }
+        if (msgrecv[i]->header.isresponse != SMQ_STATUS_REQUEST) {
+            __smq_server_listener_count_requeue(listener);
+            outgoing[pending++] = (smq_channel_buffer){ .data = (char *)msgrecv[i], .length = smq_message_size(msgrecv[i]) };
+            continue;
+        }
+        __smq_trace_record(msgrecv[i], SMQ_TRACE_SERVER_DEQUEUE);
+        if (__smq_listener_expired(listener, msgrecv[i])) {
+            continue;
+        }
+        if (overloaded) {
+            __smq_listener_shed(listener, msgrecv[i], msgresp[i]);
+        } else if (__smq_listener_decode_request(listener, msgrecv[i], msgresp[i])) {
+            if (listener->batch_handler != NULL) {
+                listener->gathered[gathered] = msgrecv[i];
+                listener->gathered[batch + gathered++] = msgresp[i];
+                continue;
+            }
+            __smq_listener_invoke(listener, msgrecv[i], msgresp[i]);
+        }
+        __smq_listener_queue_response(listener, msgrecv[i], msgresp[i], outgoing, &pending);
+    }
+    if (gathered > 0) {
+        __smq_listener_invoke_batch(listener, listener->gathered, &listener->gathered[batch], gathered);
+        for (size_t i = 0; i < gathered; i++) {
+            __smq_listener_queue_response(listener, listener->gathered[i], listener->gathered[batch + i], outgoing, &pending);
+        }
+    }
+    __smq_listener_send_all(listener, outgoing, pending);
+    for (size_t i = 0; i < count; i++) {
+        if (!(msgrecv[i]->header.flags & SMQ_FLAG_PRIVATE_REPLY)) {
+            __smq_trace_record(msgresp[i], SMQ_TRACE_RESPONSE_SEND);// only answered requests have a stamped response
+        }
+        __smq_listener_clear_request(listener, msgrecv[i]);
+        smq_message_clear(msgresp[i]);
+    }
+}
+
+#ifdef SMQ_HAS_ATOMICS
+// Pinned listeners allocate their buffers on their own thread so first touch places them on its NUMA node.
+static inline bool __smq_listener_has_local_pool(const smq_server_listener *listener)
+{
+    return listener->options.thread.cpus != 0;
+}
+
+static inline size_t __smq_listener_pool_capacity(const smq_server_listener *listener)
+{
+    const size_t needed = __smq_listener_batch_size(listener) * 2;
+    return listener->options.workers * 4 > needed ? listener->options.workers * 4 : needed;// two jobs per worker, request and response each
+}
+
+// calloc leaves fresh pages untouched, writing them here faults them in on this thread's node.
+static inline int __smq_listener_local_pool_init(smq_server_listener *listener)
+{
+    const size_t capacity = __smq_listener_pool_capacity(listener);
+    if (smq_message_pool_init(&listener->pool, capacity) != 0) {
+        return -ENOMEM;
+    }
+    memset(listener->pool.arena, 0x00, capacity * sizeof(*listener->pool.arena));
+    return 0;
+}
+
+static inline smq_message_pool *__smq_server_pool_for(smq_server *server, smq_server_listener *listener)
+{
+    return listener != NULL && listener->pool.arena != NULL ? &listener->pool : &server->pool;
+}
+#endif// SMQ_HAS_ATOMICS
+
+static inline void __smq_server_return_messages(smq_server *server, smq_server_listener *listener, smq_message **messages, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (messages[i] == NULL) continue;
+#ifdef SMQ_HAS_ATOMICS
+        smq_message_pool_release(__smq_server_pool_for(server, listener), messages[i]);
+#else
+        (void)server;
+        (void)listener;
+        free(messages[i]);
+#endif
+        messages[i] = NULL;
+    }
+}
+
+// Receiving threads take their buffers once and hand them back when they exit, from the listener's own pool if it has one.
+static inline int __smq_server_take_messages(smq_server *server, smq_server_listener *listener, smq_message **messages, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+#ifdef SMQ_HAS_ATOMICS
+        messages[i] = smq_message_pool_acquire(__smq_server_pool_for(server, listener));
+#else
+        messages[i] = calloc(1, sizeof(*messages[i]));
+#endif
+        if (messages[i] == NULL) {
+            __smq_server_return_messages(server, listener, messages, i);
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+typedef struct
+{
+    size_t current;
+    bool turn_started;
+    size_t deficit[SMQ_MAX_LANES];
+} smq_lane_scheduler;
+
+#ifdef SMQ_HAS_REACTOR
+// Deficit round robin over the lanes, a lane keeps the turn until it used its weight or ran dry, an empty lane forfeits what is left.
+static inline int __smq_listener_receive_lanes(smq_server_listener *listener, smq_lane_scheduler *scheduler, smq_channel_buffer *buffers, size_t count)
+{
+    const size_t lanes = listener->options.lanes;
+    struct pollfd fds[SMQ_MAX_LANES];
+    for (size_t visited = 0; visited <= lanes; visited++) {
+        const size_t lane = scheduler->current;
+        const smq_channel *channel = lane == 0 ? &listener->channel : &listener->lanes[lane - 1];
+        if (!scheduler->turn_started) {
+            scheduler->deficit[lane] += listener->options.lane_weights[lane] > 0 ? listener->options.lane_weights[lane] : 1;
+            scheduler->turn_started = true;
+        }
+        const size_t wanted = scheduler->deficit[lane] < count ? scheduler->deficit[lane] : count;
+        const int received = __smq_channel_drain(channel, buffers, wanted);
+        if (received > 0) {
+            scheduler->deficit[lane] -= (size_t)received;
+        }
+        if (received < (int)wanted || scheduler->deficit[lane] == 0) {
+            if (received < (int)wanted) {
+                scheduler->deficit[lane] = 0;
+            }
+            scheduler->turn_started = false;
+            scheduler->current = (lane + 1) % lanes;
+        }
+        if (received > 0) {
+            return received;
+        }
+    }
+    for (size_t lane = 0; lane < lanes; lane++) {
+        fds[lane] = (struct pollfd){ .fd = lane == 0 ? listener->channel.desc : listener->lanes[lane - 1].desc, .events = POLLIN };
+    }
+    (void)poll(fds, (nfds_t)lanes, (int)__smq_listener_timeout_ms);
+    return 0;
+}
+#endif// SMQ_HAS_REACTOR
+
+static inline int __smq_listener_receive(smq_server_listener *listener, smq_lane_scheduler *scheduler, smq_channel_buffer *buffers, size_t count)
+{
+#ifdef SMQ_HAS_REACTOR
+    if (listener->options.lanes > 1) {
+        return __smq_listener_receive_lanes(listener, scheduler, buffers, count);
+    }
+#endif// SMQ_HAS_REACTOR
+    (void)scheduler;
+    if (listener->options.busy_poll_us > 0) {
+        const int ret = smq_channel_busy_listen(&listener->channel, buffers[0].data, buffers[0].size, __smq_listener_timeout_ms, &listener->busy_poll);
+        if (ret < 0) {
+            return ret;
+        }
+        buffers[0].length = (size_t)ret;
+        return 1 + __smq_channel_drain(&listener->channel, &buffers[1], count - 1);
+    }
+    return smq_channel_listen_batch(&listener->channel, buffers, count, .timeout_ms = __smq_listener_timeout_ms);
+}
+
+// Batch listeners hold on to a partial batch for up to .batch_delay_us so the handler sees more than one request per call.
+static inline int __smq_listener_gather(smq_server_listener *listener, smq_channel_buffer *buffers, int received, size_t count)
+{
+    const uint64_t until_us = __smq_monotonic_us() + listener->options.batch_delay_us;
+    while (received > 0 && (size_t)received < count) {
+        const uint64_t now_us = __smq_monotonic_us();
+        if (now_us >= until_us) {
+            break;
+        }
+        const int ret = __smq_channel_timed_listen_us(&listener->channel, buffers[received].data, buffers[received].size, (long)(until_us - now_us));
+        if (ret < 0) {
+            break;
+        }
+        buffers[received].length = (size_t)ret;
+        received += 1 + __smq_channel_drain(&listener->channel, &buffers[received + 1], count - (size_t)received - 1);
+    }
+    return received;
+}
+
+static inline void __smq_listener_inline_proc(smq_server_listener *listener)
+{
+    smq_lane_scheduler scheduler = { 0 };
+    int received = 0;
+    const size_t batch = __smq_listener_batch_size(listener);
+    smq_message **messages = calloc(batch * 2, sizeof(*messages));
+    smq_channel_buffer *buffers = calloc(batch * 2, sizeof(*buffers));
+    if (messages == NULL || buffers == NULL || __smq_server_take_messages(listener->parent_server, listener, messages, batch * 2) != 0) {
+        puts("smq_server_start unable to allocate listener buffers.");
+        goto cleanup;
+    }
+    if (listener->batch_handler != NULL && (listener->gathered = calloc(batch * 2, sizeof(*listener->gathered))) == NULL) {
+        puts("smq_server_start unable to allocate listener buffers.");
+        goto release;
+    }
+    for (size_t i = 0; i < batch; i++) {
+        buffers[i] = (smq_channel_buffer){ .data = (char *)messages[i], .size = sizeof(*messages[i]) };
+    }
+    while (smq_server_is_running(listener->parent_server)) {
+        if ((received = __smq_listener_receive(listener, &scheduler, buffers, batch)) <= 0) {
+            continue;
+        }
+        if (listener->batch_handler != NULL && listener->options.batch_delay_us > 0) {
+            received = __smq_listener_gather(listener, buffers, received, batch);
+        }
+        __smq_listener_process_batch(listener, messages, &messages[batch], buffers, &buffers[batch], (size_t)received);
+    }
+    free(listener->gathered);
+    listener->gathered = NULL;
+release:
+    __smq_server_return_messages(listener->parent_server, listener, messages, batch * 2);
+cleanup:
+    free(buffers);
+    free(messages);
+}
+
+#ifdef SMQ_HAS_ATOMICS
+typedef struct
+{
+    smq_message *request;
+    smq_message *response;
+} smq_server_job;
+
+typedef struct
+{
+    smq_server_listener *listener;
+    smq_mpmc_queue pending;
+    smq_mpmc_queue idle;
+    sem_t pending_count;
+    sem_t idle_count;
+    smq_server_job *jobs;
+    size_t job_count;
+    pthread_t *threads;
+    size_t workers;
+} smq_server_worker_pool;
+
+static inline int __smq_sem_wait(sem_t *sem)
+{
+    int res = 0;
+    while ((res = sem_wait(sem)) != 0 && errno == EINTR) {
+    }
+    return res;
+}
+
+static inline void *__smq_listener_worker_proc(void *pool_)
+{
+    smq_server_worker_pool *pool = (smq_server_worker_pool *)pool_;
+    smq_server_job *job = NULL;
+    __smq_thread_place(&pool->listener->options.worker_thread);
+    for (;;) {
+        __smq_sem_wait(&pool->pending_count);
+        // Every post is either a queued job or a stop token, an empty queue means stop.
+        if ((job = smq_mpmc_pop(&pool->pending)) == NULL) {
+            break;
+        }
+        __smq_listener_handle(pool->listener, job->request, job->response);
+        smq_mpmc_push(&pool->idle, job);
+        sem_post(&pool->idle_count);
+    }
+    return NULL;
+}
+
+static inline void __smq_listener_pool_destroy(smq_server_worker_pool *pool)
+{
+    for (size_t i = 0; pool->jobs != NULL && i < pool->job_count; i++) {
+        __smq_server_return_messages(pool->listener->parent_server, pool->listener, &pool->jobs[i].request, 1);
+        __smq_server_return_messages(pool->listener->parent_server, pool->listener, &pool->jobs[i].response, 1);
+    }
+    smq_mpmc_destroy(&pool->pending);
+    smq_mpmc_destroy(&pool->idle);
+    sem_destroy(&pool->pending_count);
+    sem_destroy(&pool->idle_count);
+    free(pool->jobs);
+    free(pool->threads);
+}
+
+static inline int __smq_listener_pool_take_messages(smq_server_worker_pool *pool)
+{
+    for (size_t i = 0; i < pool->job_count; i++) {
+        if (__smq_server_take_messages(pool->listener->parent_server, pool->listener, &pool->jobs[i].request, 1) != 0
+            || __smq_server_take_messages(pool->listener->parent_server, pool->listener, &pool->jobs[i].response, 1) != 0) {
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static inline int __smq_listener_pool_init(smq_server_worker_pool *pool, smq_server_listener *listener)
+{
+    const size_t workers = listener->options.workers;
+    const size_t jobs = workers * 2;// one being handled and one waiting per worker keeps the receive stage ahead
+    *pool = (smq_server_worker_pool){ .listener = listener, .workers = workers, .job_count = jobs };
+    pool->jobs = calloc(jobs, sizeof(*pool->jobs));
+    pool->threads = calloc(workers, sizeof(*pool->threads));
+    if (pool->jobs == NULL || pool->threads == NULL
+        || __smq_listener_pool_take_messages(pool) != 0
+        || smq_mpmc_init(&pool->pending, jobs) != 0
+        || smq_mpmc_init(&pool->idle, jobs) != 0
+        || sem_init(&pool->pending_count, 0, 0) != 0
+        || sem_init(&pool->idle_count, 0, (unsigned)jobs) != 0) {
+        __smq_listener_pool_destroy(pool);
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < jobs; i++) {
+        smq_mpmc_push(&pool->idle, &pool->jobs[i]);
+    }
+    for (size_t i = 0; i < workers; i++) {
+        if (__smq_thread_create(&pool->threads[i], &listener->options.worker_thread, __smq_listener_worker_proc, (void *)pool) != 0) {
+            pool->workers = i;
+            break;
+        }
+    }
+    // Nothing runs the jobs, hand their messages back before the caller falls back to inline.
+    if (pool->workers == 0) {
+        __smq_listener_pool_destroy(pool);
+        return -EAGAIN;
+    }
+    return 0;
+}
+
+static inline void __smq_listener_pooled_proc(smq_server_listener *listener)
+{
+    smq_lane_scheduler scheduler = { 0 };
+    int received = 0;
+    size_t held = 0;
+    const size_t batch = __smq_listener_batch_size(listener);
+    smq_server_job **jobs = calloc(batch, sizeof(*jobs));
+    smq_channel_buffer *buffers = calloc(batch, sizeof(*buffers));
+    smq_server_worker_pool pool;
+    if (jobs == NULL || buffers == NULL || __smq_listener_pool_init(&pool, listener) != 0) {
+        puts("smq_server_start unable to spawn listener workers.");
+        free(jobs);
+        free(buffers);
+        __smq_listener_inline_proc(listener);
+        return;
+    }
+    while (smq_server_is_running(listener->parent_server)) {
+        if (held == 0) {
+            __smq_sem_wait(&pool.idle_count);
+            jobs[held++] = smq_mpmc_pop(&pool.idle);
+        }
+        while (held < batch && sem_trywait(&pool.idle_count) == 0) {
+            jobs[held++] = smq_mpmc_pop(&pool.idle);
+        }
+        for (size_t i = 0; i < held; i++) {
+            buffers[i] = (smq_channel_buffer){ .data = (char *)jobs[i]->request, .size = sizeof(*jobs[i]->request) };
+        }
+        if ((received = __smq_listener_receive(listener, &scheduler, buffers, held)) <= 0) {
+            continue;
+        }
+        size_t kept = 0;
+        const bool overloaded = __smq_listener_overloaded(listener);
+        for (size_t i = 0; i < held; i++) {
+            smq_server_job *job = jobs[i];
+            if ((int)i >= received) {
+                jobs[kept++] = job;
+                continue;
+            }
+            if (__smq_message_received(job->request, (int)buffers[i].length) != 0) {
+                smq_message_clear(job->request);
+                jobs[kept++] = job;
+                continue;
+            }
+            if (job->request->header.isresponse != SMQ_STATUS_REQUEST) {
+                __smq_listener_requeue(listener, job->request);
+                smq_message_clear(job->request);
+                jobs[kept++] = job;
+                continue;
+            }
+            __smq_trace_record(job->request, SMQ_TRACE_SERVER_DEQUEUE);
+            // Expired and shed requests are settled on the receive thread, they never take a worker.
+            if (__smq_listener_expired(listener, job->request)) {
+                __smq_listener_clear_request(listener, job->request);
+                jobs[kept++] = job;
+                continue;
+            }
+            if (overloaded) {
+                __smq_listener_shed(listener, job->request, job->response);
+                __smq_listener_send_response(listener, job->request, job->response);
+                __smq_listener_clear_request(listener, job->request);
+                smq_message_clear(job->response);
+                jobs[kept++] = job;
+                continue;
+            }
+            smq_mpmc_push(&pool.pending, job);
+            sem_post(&pool.pending_count);
+        }
+        held = kept;
+    }
+    for (size_t i = 0; i < pool.workers; i++) {
+        sem_post(&pool.pending_count);
+    }
+    for (size_t i = 0; i < pool.workers; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    __smq_listener_pool_destroy(&pool);
+    free(jobs);
+    free(buffers);
+}
+#endif// SMQ_HAS_ATOMICS
+
+static inline void *__smq_listener_proc(void *listener_)
+{
+    smq_server_listener *listener = (smq_server_listener *)listener_;
+    __smq_thread_place(&listener->options.thread);
+#ifdef SMQ_HAS_ATOMICS
+    if (__smq_listener_has_local_pool(listener) && listener->pool.arena == NULL && __smq_listener_local_pool_init(listener) != 0) {
+        puts("smq_server_start unable to allocate listener pool.");
+        return NULL;
+    }
+#endif// SMQ_HAS_ATOMICS
+    __smq_server_listener_modify_readiness(listener, true);
+#ifdef SMQ_HAS_ATOMICS
+    if (listener->options.workers > 0) {
+        __smq_listener_pooled_proc(listener);
+    } else {
+        __smq_listener_inline_proc(listener);
+    }
+    smq_message_pool_destroy(&listener->pool);
+#else
+    __smq_listener_inline_proc(listener);
+#endif// SMQ_HAS_ATOMICS
+    __smq_server_listener_modify_readiness(listener, false);
+    return NULL;
+}
+
+static inline void __smq_server_modify_running_state(smq_server *server, bool new_state)
+{
+#ifdef SMQ_HAS_ATOMICS
+    atomic_store(&server->running, new_state);
+#else
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&mutex);
+    server->running = new_state;
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+static inline bool smq_server_is_running(smq_server *server)
+{
+    bool res = false;
+#ifdef SMQ_HAS_ATOMICS
+    res = atomic_load(&server->running);
+#else
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&mutex);
+    res = server->running;
+    pthread_mutex_unlock(&mutex);
+#endif
+    return res;
+}
+
+// Stack size can only be chosen at creation, affinity and priority are applied by the thread itself through __smq_thread_place.
+static inline int __smq_thread_create(pthread_t *thread, const smq_thread_options *options, void *(*proc)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    int res = 0;
+    if (options->stack_size == 0) {
+        return pthread_create(thread, NULL, proc, arg);
+    }
+    if ((res = pthread_attr_init(&attr)) != 0) {
+        return res;
+    }
+    if ((res = pthread_attr_setstacksize(&attr, options->stack_size < (size_t)PTHREAD_STACK_MIN ? (size_t)PTHREAD_STACK_MIN : options->stack_size)) == 0) {
+        res = pthread_create(thread, &attr, proc, arg);
+    }
+    pthread_attr_destroy(&attr);
+    return res;
+}
+
+// Runs first thing on the thread, so everything it allocates afterwards is first touched from the CPUs it is pinned to.
+static inline void __smq_thread_place(const smq_thread_options *options)
+{
+    if (options->cpus != 0) {
+#ifdef SMQ_HAS_AFFINITY
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < 64; cpu++) {
+            if (options->cpus & ((uint64_t)1 << cpu)) CPU_SET(cpu, &set);
+        }
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            puts("smq_server_start unable to pin thread.");
+        }
+#else
+        puts("smq_server_start unable to pin thread, affinity needs Linux and _GNU_SOURCE.");
+#endif// SMQ_HAS_AFFINITY
+    }
+    if (options->fifo_priority > 0) {
+        const struct sched_param param = { .sched_priority = options->fifo_priority };
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+            puts("smq_server_start unable to set SCHED_FIFO priority.");
+        }
+    }
+}
+
+static inline int smq_server_spawn_subprocess(smq_server_listener *listener)
+{
+    return __smq_thread_create(&listener->thread, &listener->options.thread, __smq_listener_proc, (void *)listener);
+}
+
+static inline void *__smq_server_run(void *server)
+{
+    smq_server_start((smq_server *)server);
+}
+
+static inline int smq_server_start_non_blocking(pthread_t *thread, smq_server *server)
+{
+    return pthread_create(thread, NULL, __smq_server_run, (void *)server);
+}
+
+#ifdef SMQ_HAS_REACTOR
+#define SMQ_REACTOR_EVENTS 32
+
+// Only single lane mq listeners that handle inline can share a reactor, shm rings are not pollable and worker pools, lanes and busy polling own their receive thread.
+static inline bool __smq_listener_is_pollable(const smq_server_listener *listener)
+{
+    return listener->channel.backend == SMQ_CHANNEL_BACKEND_MQ && listener->options.workers == 0 && listener->options.lanes <= 1 && listener->options.busy_poll_us == 0 && listener->batch_handler == NULL;
+}
+
+static inline void __smq_server_reactor_modify_readiness(smq_server *server, bool new_state)
+{
+    for (smq_server_listener *lsner = server->listeners; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
+        if (__smq_listener_is_pollable(lsner)) {
+            __smq_server_listener_modify_readiness(lsner, new_state);
+        }
+    }
+}
+
+static inline void __smq_server_reactor_arm(smq_server *server, smq_server_listener *listener, int op)
+{
+    struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = listener };
+    epoll_ctl(server->reactor_epoll, op, listener->channel.desc, &event);
+}
+
+static inline size_t __smq_server_reactor_batch_size(smq_server *server)
+{
+    size_t batch = 1;
+    for (smq_server_listener *lsner = server->listeners; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
+        if (__smq_listener_is_pollable(lsner) && __smq_listener_batch_size(lsner) > batch) {
+            batch = __smq_listener_batch_size(lsner);
+        }
+    }
+    return batch;
+}
+
+static inline void *__smq_server_reactor_proc(void *server_)
+{
+    smq_server *server = (smq_server *)server_;
+    struct epoll_event events[SMQ_REACTOR_EVENTS];
+    const size_t batch = __smq_server_reactor_batch_size(server);
+    int ready = 0;
+    __smq_thread_place(&server->options.reactor_thread);
+    smq_message **messages = calloc(batch * 2, sizeof(*messages));
+    smq_channel_buffer *buffers = calloc(batch * 2, sizeof(*buffers));
+    if (messages == NULL || buffers == NULL || __smq_server_take_messages(server, NULL, messages, batch * 2) != 0) {
+        puts("smq_server_start unable to allocate reactor buffers.");
+        goto cleanup;
+    }
+    while (smq_server_is_running(server)) {
+        if ((ready = epoll_wait(server->reactor_epoll, events, SMQ_REACTOR_EVENTS, -1)) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < ready; i++) {
+            smq_server_listener *listener = (smq_server_listener *)events[i].data.ptr;
+            if (listener == NULL) {
+                continue;// stop event, never read so every reactor thread sees it
+            }
+            const size_t count = __smq_listener_batch_size(listener);
+            for (size_t j = 0; j < count; j++) {
+                buffers[j] = (smq_channel_buffer){ .data = (char *)messages[j], .size = sizeof(*messages[j]) };
+            }
+            // One batch per readiness event keeps a busy route from starving the others, level triggering brings us back.
+            const int received = __smq_channel_drain(&listener->channel, buffers, count);
+            if (received > 0) {
+                __smq_listener_process_batch(listener, messages, &messages[batch], buffers, &buffers[batch], (size_t)received);
+            }
+            __smq_server_reactor_arm(server, listener, EPOLL_CTL_MOD);
+        }
+    }
+    __smq_server_return_messages(server, NULL, messages, batch * 2);
+cleanup:
+    free(buffers);
+    free(messages);
+    if (atomic_fetch_sub(&server->reactors_running, 1) == 1) {
+        __smq_server_reactor_modify_readiness(server, false);
+    }
+    return NULL;
+}
+
+static inline void __smq_server_reactor_start(smq_server *server)
+{
+    const size_t threads = server->options.reactor_threads;
+    struct epoll_event stop_event = { .events = EPOLLIN, .data.ptr = NULL };
+    server->reactor_epoll = epoll_create1(EPOLL_CLOEXEC);
+    server->reactor_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server->reactor_threads = calloc(threads, sizeof(*server->reactor_threads));
+    if (server->reactor_epoll == -1 || server->reactor_event == -1 || server->reactor_threads == NULL
+        || epoll_ctl(server->reactor_epoll, EPOLL_CTL_ADD, server->reactor_event, &stop_event) != 0) {
+        puts("smq_server_start unable to set up reactor.");
+        __smq_server_modify_running_state(server, false);
+        return;
+    }
+    for (smq_server_listener *lsner = server->listeners; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
+        if (!__smq_listener_is_pollable(lsner)) {
+            if (smq_server_spawn_subprocess(lsner) != 0) {
+                puts("smq_server_start unable to spawn thread.");
+            }
+            continue;
+        }
+        __smq_server_reactor_arm(server, lsner, EPOLL_CTL_ADD);
+    }
+    atomic_store(&server->reactors_running, threads);
+    __smq_server_reactor_modify_readiness(server, true);
+    for (size_t i = 1; i < threads; i++) {
+        if (__smq_thread_create(&server->reactor_threads[i], &server->options.reactor_thread, __smq_server_reactor_proc, (void *)server) != 0) {
+            puts("smq_server_start unable to spawn reactor thread.");
+            server->reactor_threads[i] = 0;
+            atomic_fetch_sub(&server->reactors_running, 1);
+        }
+    }
+    (void)__smq_server_reactor_proc((void *)server);
+}
+
+static inline void __smq_server_reactor_stop(smq_server *server)
+{
+    const uint64_t wake = 1;
+    if (server->reactor_event != -1 && write(server->reactor_event, &wake, sizeof(wake)) != sizeof(wake)) {
+        puts("smq_server_stop unable to wake reactor");
+    }
+    for (size_t i = 1; server->reactor_threads != NULL && i < server->options.reactor_threads; i++) {
+        if (server->reactor_threads[i] != 0) {
+            pthread_join(server->reactor_threads[i], NULL);
+            server->reactor_threads[i] = 0;
+        }
+    }
+    for (smq_server_listener *lsner = server->listeners; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
+        if (lsner->thread != 0) {
+            pthread_join(lsner->thread, NULL);
+            lsner->thread = 0;
+        }
+    }
+    // The first reactor runs on the thread that called smq_server_start.
+    while (atomic_load(&server->reactors_running) > 0) {
+        sched_yield();
+    }
+    if (server->reactor_epoll != -1) close(server->reactor_epoll);
+    if (server->reactor_event != -1) close(server->reactor_event);
+    free(server->reactor_threads);
+    server->reactor_epoll = -1;
+    server->reactor_event = -1;
+    server->reactor_threads = NULL;
+}
+#endif// SMQ_HAS_REACTOR
+
+#ifdef SMQ_HAS_ATOMICS
+// Every receive buffer the listeners will hold at once, plus the spare messages handlers asked for.
+static inline size_t __smq_server_pool_capacity(smq_server *server)
+{
+    size_t capacity = server->options.spare_messages;
+    for (smq_server_listener *lsner = server->listeners; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
+#ifdef SMQ_HAS_REACTOR
+        if (server->options.reactor_threads > 0 && __smq_listener_is_pollable(lsner)) {
+            continue;
+        }
+#endif// SMQ_HAS_REACTOR
+        if (!__smq_listener_has_local_pool(lsner)) {
+            capacity += __smq_listener_pool_capacity(lsner);
+        }
+    }
+#ifdef SMQ_HAS_REACTOR
+    capacity += server->options.reactor_threads * __smq_server_reactor_batch_size(server) * 2;
+#endif// SMQ_HAS_REACTOR
+    return capacity;
+}
+
+static inline smq_message_pool *smq_server_message_pool(smq_server *server)
+{
+    return server->pool.arena != NULL ? &server->pool : NULL;
+}
+#endif// SMQ_HAS_ATOMICS
+
+static inline void smq_server_start(smq_server *server)
+{
+    if (server->listeners == NULL) return;
+    smq_server_listener *first_listener = (smq_server_listener *)server->listeners;
+    if (smq_server_is_running(server) == true) {
+        return;
+    }
+    for (smq_server_listener *lsner = server->listeners; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
+        if (lsner->router && __smq_listener_build_routes(lsner) != 0) {
+            puts("smq_server_start unable to allocate route table.");
+            return;
+        }
+    }
+#ifdef SMQ_HAS_ATOMICS
+    if (server->pool.arena == NULL && smq_message_pool_init(&server->pool, __smq_server_pool_capacity(server)) != 0) {
+        puts("smq_server_start unable to allocate message pool.");
+        return;
+    }
+#endif// SMQ_HAS_ATOMICS
+    __smq_server_modify_running_state(server, true);
+#ifdef SMQ_HAS_REACTOR
+    if (server->options.reactor_threads > 0) {
+        __smq_server_reactor_start(server);
+        return;
+    }
+#endif// SMQ_HAS_REACTOR
+    for (smq_server_listener *lsner = (smq_server_listener *)first_listener->next; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
+        if (smq_server_spawn_subprocess(lsner) != 0) {
+            puts("smq_server_start unable to spawn thread.");
+            return;
+        }
+    }
+    (void)__smq_listener_proc((void *)first_listener);
+}
+
+static inline bool smq_server_ready(smq_server *server, long timeout_ms)
+{
+    long abs_timeout = smq_timestamp_ms() + timeout_ms;
+
+    for (smq_server_listener *lsner = server->listeners; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
+        while (!__smq_server_listener_is_ready(lsner)) {
+            if (smq_timestamp_ms() > abs_timeout) {
+                return false;
+            }
+            sched_yield();
+        }
+    }
+    return true;
+}
+
+static inline void smq_server_stop(smq_server *server)
+{
+    __smq_server_modify_running_state(server, false);
+    if (server->listeners == NULL) return;
+    if (!__smq_server_join_listeners(server)) return;
+    for (smq_server_listener *lsner = server->listeners; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
+        __smq_listener_close_replies(lsner);
+    }
+}
+
+// False when a listener thread could not be joined and may still be answering.
+static inline bool __smq_server_join_listeners(smq_server *server)
+{
+#ifdef SMQ_HAS_REACTOR
+    if (server->options.reactor_threads > 0) {
+        __smq_server_reactor_stop(server);
+        return true;
+    }
+#endif// SMQ_HAS_REACTOR
+    if (server->listeners->next == NULL) {
+        while (__smq_server_listener_is_ready(server->listeners)) {
+            sched_yield();
+        }
+        return true;
+    }
+
+    for (smq_server_listener *lsner = (smq_server_listener *)server->listeners->next; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
+        if (pthread_join(lsner->thread, NULL) != 0) {
+            puts("smq_server_stop phtread unable to join");
+            return false;
+        }
+    }
+    // The first listener runs on the thread that called smq_server_start, it hands its buffers back before going idle.
+    while (__smq_server_listener_is_ready(server->listeners)) {
+        sched_yield();
+    }
+    return true;
+}
+
+static inline void smq_server_destroy(smq_server *server)
+{
+    smq_server_listener *lsner = server->listeners;
+    smq_server_stop(server);
+    while (lsner != NULL) {
+        smq_server_listener *tmp = (smq_server_listener *)lsner->next;
+        smq_channel_destroy(&lsner->channel);
+        __smq_listener_destroy_lanes(lsner);
+        __smq_listener_destroy_replies(lsner);
+#ifdef SMQ_HAS_ATOMICS
+        __smq_cache_destroy(lsner->cache);
+#endif// SMQ_HAS_ATOMICS
+        free(lsner->route_table);
+        free(lsner->routes);
+        free(lsner);
+        lsner = tmp;
+    }
+#ifdef SMQ_HAS_ATOMICS
+    smq_message_pool_destroy(&server->pool);
+#endif// SMQ_HAS_ATOMICS
+}
+
+#ifdef SMQ_HAS_ATOMICS
+static inline int smq_mpmc_init(smq_mpmc_queue *queue, size_t capacity)
+{
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    queue->cells = malloc(size * sizeof(*queue->cells));
+    if (queue->cells == NULL) {
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&queue->cells[i].sequence, i);
+        queue->cells[i].data = NULL;
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    return 0;
+}
+
+static inline bool smq_mpmc_push(smq_mpmc_queue *queue, void *data)
+{
+    smq_mpmc_cell *cell = NULL;
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        cell = &queue->cells[pos & queue->mask];
+        intptr_t diff = (intptr_t)atomic_load_explicit(&cell->sequence, memory_order_acquire) - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->data = data;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+static inline void *smq_mpmc_pop(smq_mpmc_queue *queue)
+{
+    void *data = NULL;
+    smq_mpmc_cell *cell = NULL;
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        cell = &queue->cells[pos & queue->mask];
+        intptr_t diff = (intptr_t)atomic_load_explicit(&cell->sequence, memory_order_acquire) - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    data = cell->data;
+    atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+    return data;
+}
+
+static inline void smq_mpmc_destroy(smq_mpmc_queue *queue)
+{
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+static inline int smq_message_pool_init(smq_message_pool *pool, size_t capacity)
+{
+    *pool = (smq_message_pool){ .capacity = capacity };
+    if ((pool->arena = calloc(capacity, sizeof(*pool->arena))) == NULL || smq_mpmc_init(&pool->free, capacity) != 0) {
+        free(pool->arena);
+        pool->arena = NULL;
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        smq_mpmc_push(&pool->free, &pool->arena[i]);
+    }
+    return 0;
+}
+
+static inline void smq_message_pool_destroy(smq_message_pool *pool)
+{
+    if (pool->arena == NULL) return;
+    smq_mpmc_destroy(&pool->free);
+    free(pool->arena);
+    pool->arena = NULL;
+}
+
+// Returns NULL once every message is out, the pool never grows.
+static inline smq_message *smq_message_pool_acquire(smq_message_pool *pool)
+{
+    return (smq_message *)smq_mpmc_pop(&pool->free);
+}
+
+// The message is cleared on the way back, so acquired messages always start zeroed.
+static inline void smq_message_pool_release(smq_message_pool *pool, smq_message *message)
+{
+    smq_message_clear(message);
+    smq_mpmc_push(&pool->free, message);
+}
+
+static inline void smq_message_cache_init(smq_message_cache *cache, smq_message_pool *pool)
+{
+    cache->pool = pool;
+    cache->count = 0;
+}
+
+static inline smq_message *smq_message_cache_acquire(smq_message_cache *cache)
+{
+    smq_message *message = NULL;
+    if (cache->count == 0) {
+        while (cache->count < SMQ_MESSAGE_CACHE_SIZE / 2 && (message = smq_message_pool_acquire(cache->pool)) != NULL) {
+            cache->messages[cache->count++] = message;
+        }
+    }
+    return cache->count > 0 ? cache->messages[--cache->count] : NULL;
+}
+
+static inline void smq_message_cache_release(smq_message_cache *cache, smq_message *message)
+{
+    if (cache->count == SMQ_MESSAGE_CACHE_SIZE) {
+        while (cache->count > SMQ_MESSAGE_CACHE_SIZE / 2) {
+            smq_mpmc_push(&cache->pool->free, cache->messages[--cache->count]);
+        }
+    }
+    smq_message_clear(message);
+    cache->messages[cache->count++] = message;
+}
+
+// Must run before the owning thread exits, cached messages are invisible to everyone else.
+static inline void smq_message_cache_flush(smq_message_cache *cache)
+{
+    while (cache->count > 0) {
+        smq_mpmc_push(&cache->pool->free, cache->messages[--cache->count]);
+    }
+}
+
+#define SMQ_CACHE_WAYS 4
+
+typedef struct
+{
+    atomic_uint seq;// seqlock, odd while the writer is inside
+    atomic_bool referenced;// CLOCK bit, set on every hit
+    bool used;
+    uint8_t status;
+    uint32_t key_length;
+    uint32_t value_length;
+    uint64_t hash;
+    long expires_ms;// 0 never expires
+    char *key;
+    char *value;
+} smq_response_cache_entry;
+
+typedef struct
+{
+    atomic_bool busy;// one writer per set, a second one just skips caching
+    unsigned int hand;
+    smq_response_cache_entry entries[SMQ_CACHE_WAYS];
+} smq_response_cache_set;
+
+// Set associative, readers never lock: they copy under the entry seqlock and retry nothing, a torn read is a miss.
+struct smq_response_cache_t
+{
+    smq_response_cache_set *sets;
+    size_t set_mask;
+    size_t value_size;
+    long ttl_ms;
+    char *slab;
+};
+
+static inline uint64_t __smq_hash_mix(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdull;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ull;
+    value ^= value >> 33;
+    return value;
+}
+
+// Eight bytes per multiply, good enough to spread payloads over the cache sets.
+static inline uint64_t __smq_hash_bytes(const char *data, size_t length)
+{
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ length;
+    uint64_t word = 0;
+    size_t offset = 0;
+    for (; offset + sizeof(word) <= length; offset += sizeof(word)) {
+        memcpy(&word, data + offset, sizeof(word));
+        hash = (hash ^ __smq_hash_mix(word)) * 0x9e3779b97f4a7c15ull;
+    }
+    if (offset < length) {
+        word = 0;
+        memcpy(&word, data + offset, length - offset);
+        hash = (hash ^ __smq_hash_mix(word)) * 0x9e3779b97f4a7c15ull;
+    }
+    return __smq_hash_mix(hash);
+}
+
+static inline smq_response_cache *__smq_cache_create(size_t entries, size_t value_size, long ttl_ms)
+{
+    size_t sets = 1;
+    smq_response_cache *cache = calloc(1, sizeof(*cache));
+    while (sets * SMQ_CACHE_WAYS < entries) {
+        sets <<= 1;
+    }
+    if (cache == NULL) return NULL;
+    *cache = (smq_response_cache){ .set_mask = sets - 1, .value_size = value_size, .ttl_ms = ttl_ms };
+    cache->sets = calloc(sets, sizeof(*cache->sets));
+    cache->slab = malloc(sets * SMQ_CACHE_WAYS * value_size * 2);// key and value per entry
+    if (cache->sets == NULL || cache->slab == NULL) {
+        __smq_cache_destroy(cache);
+        return NULL;
+    }
+    for (size_t i = 0; i < sets * SMQ_CACHE_WAYS; i++) {
+        smq_response_cache_entry *entry = &cache->sets[i / SMQ_CACHE_WAYS].entries[i % SMQ_CACHE_WAYS];
+        entry->key = cache->slab + i * value_size * 2;
+        entry->value = entry->key + value_size;
+    }
+    return cache;
+}
+
+static inline void __smq_cache_destroy(smq_response_cache *cache)
+{
+    if (cache == NULL) return;
+    free(cache->sets);
+    free(cache->slab);
+    free(cache);
+}
+
+static inline bool __smq_cache_lookup(smq_response_cache *cache, const smq_message *request, smq_message *response)
+{
+    const size_t length = smq_message_length(request);
+    const uint64_t hash = __smq_hash_bytes(request->payload, length);
+    smq_response_cache_set *set = &cache->sets[hash & cache->set_mask];
+    const long now_ms = cache->ttl_ms > 0 ? __smq_monotonic_ms() : 0;
+    for (size_t way = 0; way < SMQ_CACHE_WAYS; way++) {
+        smq_response_cache_entry *entry = &set->entries[way];
+        const unsigned int seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+        if ((seq & 1u) != 0 || !entry->used || entry->hash != hash || entry->key_length != length
+            || (entry->expires_ms != 0 && now_ms > entry->expires_ms)) {
+            continue;
+        }
+        const uint32_t value_length = entry->value_length;
+        if (value_length > cache->value_size || memcmp(entry->key, request->payload, length) != 0) {
+            continue;
+        }
+        memcpy(response->payload, entry->value, value_length);
+        response->header.status = entry->status;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq) {
+            memset(response->payload, 0x00, value_length);// overwritten while we copied
+            response->header.status = SMQ_STATUS_OK;
+            continue;
+        }
+        smq_message_set_length(response, value_length);
+        atomic_store_explicit(&entry->referenced, true, memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+static inline void __smq_cache_store(smq_response_cache *cache, const smq_message *request, const smq_message *response)
+{
+    const size_t length = smq_message_length(request);
+    const size_t value_length = smq_message_length(response);
+    if (response->header.status != SMQ_STATUS_OK || length > cache->value_size || value_length > cache->value_size) {
+        return;
+    }
+    const uint64_t hash = __smq_hash_bytes(request->payload, length);
+    const long now_ms = __smq_monotonic_ms();
+    smq_response_cache_set *set = &cache->sets[hash & cache->set_mask];
+    smq_response_cache_entry *victim = NULL;
+    if (atomic_exchange_explicit(&set->busy, true, memory_order_acquire)) {
+        return;
+    }
+    // CLOCK within the set, free and expired entries go first, a referenced entry gets a second chance.
+    for (size_t way = 0; way < SMQ_CACHE_WAYS && victim == NULL; way++) {
+        smq_response_cache_entry *entry = &set->entries[way];
+        if (!entry->used || (entry->expires_ms != 0 && now_ms > entry->expires_ms)) {
+            victim = entry;
+        }
+    }
+    for (size_t step = 0; victim == NULL; step++) {
+        smq_response_cache_entry *entry = &set->entries[set->hand];
+        set->hand = (set->hand + 1) % SMQ_CACHE_WAYS;
+        // Readers keep setting bits while we sweep, after two rounds take whatever the hand points at.
+        if (!atomic_exchange_explicit(&entry->referenced, false, memory_order_relaxed) || step >= 2 * SMQ_CACHE_WAYS) {
+            victim = entry;
+        }
+    }
+    const unsigned int seq = atomic_load_explicit(&victim->seq, memory_order_relaxed);
+    atomic_store_explicit(&victim->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    victim->used = true;
+    victim->status = response->header.status;
+    victim->hash = hash;
+    victim->key_length = (uint32_t)length;
+    victim->value_length = (uint32_t)value_length;
+    victim->expires_ms = cache->ttl_ms > 0 ? now_ms + cache->ttl_ms : 0;
+    memcpy(victim->key, request->payload, length);
+    memcpy(victim->value, response->payload, value_length);
+    atomic_store_explicit(&victim->referenced, false, memory_order_relaxed);
+    atomic_store_explicit(&victim->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&set->busy, false, memory_order_release);
+}
+#endif// SMQ_HAS_ATOMICS
+
+static const long msins = 1000;
+static const long nsinms = 1000000;
+static const long nsinsec = 1000000000;
+
+static inline long smq_timespec_to_timestamp_ms(struct timespec *time)
+{
+    return time->tv_sec * msins + time->tv_nsec / nsinms;
+}
+
+static inline long smq_timestamp_ms()
+{
+    struct timespec time = smq_time_now();
+    return smq_timespec_to_timestamp_ms(&time);
+}
+
+static inline void smq_abs_timeout(struct timespec *restrict time, long offset_ms)
+{
+    time->tv_nsec += offset_ms * nsinms;
+    time->tv_sec += time->tv_nsec / nsinsec;
+    time->tv_nsec -= (time->tv_nsec / nsinsec) * nsinsec;
+}
+
+static inline struct timespec smq_time_now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_REALTIME, &time);
+    return time;
+}
+
+// Deadlines in message headers use this clock, it is shared by every process on the host and never jumps.
+static inline long __smq_monotonic_ms(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return smq_timespec_to_timestamp_ms(&time);
+}
+
+static inline uint64_t __smq_monotonic_us(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000u + (uint64_t)time.tv_nsec / 1000u;
 }
 
-static inline void __smq_server_listener_modify_readiness(smq_server_listener *listener, bool new_state)
+#ifdef SMQ_HAS_SHM
+#define SMQ_SHM_MAGIC 0x534d5131u
+
+typedef struct
 {
-#ifdef SMQ_HAS_ATOMICS
-    atomic_store(&listener->is_listening, new_state);
-#else
-    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_lock(&mutex);
-    listener->is_listening = new_state;
-    pthread_mutex_unlock(&mutex);
-#endif
+    atomic_uint ready;// SMQ_SHM_MAGIC once the creator has initialised the ring
+    uint32_t slot_count;
+    uint32_t slot_size;
+    uint32_t stride;
+    char pad0[SMQ_CACHELINE_SIZE - 4 * sizeof(uint32_t)];
+    atomic_size_t enqueue_pos;
+    char pad1[SMQ_CACHELINE_SIZE - sizeof(atomic_size_t)];
+    atomic_size_t dequeue_pos;
+    char pad2[SMQ_CACHELINE_SIZE - sizeof(atomic_size_t)];
+    atomic_uint pushed;// futex word listeners sleep on
+    atomic_uint listen_waiters;
+    char pad3[SMQ_CACHELINE_SIZE - 2 * sizeof(atomic_uint)];
+    atomic_uint popped;// futex word senders sleep on while the ring is full
+    atomic_uint send_waiters;
+    char pad4[SMQ_CACHELINE_SIZE - 2 * sizeof(atomic_uint)];
+} smq_shm_ring;
+
+typedef struct
+{
+    atomic_size_t sequence;
+    uint32_t length;
+} smq_shm_slot;
+
+static inline int __smq_futex_wait(atomic_uint *word, unsigned int expected, long timeout_ms)
+{
+    struct timespec relative = { .tv_sec = timeout_ms / msins, .tv_nsec = (timeout_ms % msins) * nsinms };
+    return syscall(SYS_futex, (unsigned int *)word, FUTEX_WAIT, expected, timeout_ms < 0 ? NULL : &relative, NULL, 0) == -1 ? -errno : 0;
 }
 
-static inline void *__smq_listener_proc(void *listener_)
+static inline void __smq_futex_wake(atomic_uint *word)
 {
-    static const long timeout_ms = 700;
-    int listen_res = 0;
-    int send_res = 0;
-    smq_message *msgresp = malloc(sizeof(*msgresp));
-    smq_message *msgrecv = malloc(sizeof(*msgrecv));
-    smq_server_listener *listener = (smq_server_listener *)listener_;
-    __smq_server_listener_modify_readiness(listener, true);
-    while (smq_server_is_running(listener->parent_server)) {
-        if ((listen_res = smq_channel_timed_listen(&listener->channel, (char *)msgrecv, sizeof(*msgrecv), timeout_ms)) < 0) {
-            switch (listen_res) {
-            case -ETIMEDOUT: {
-                continue;
+    syscall(SYS_futex, (unsigned int *)word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static inline smq_shm_slot *__smq_shm_slot(smq_shm_ring *ring, size_t pos)
+{
+    return (smq_shm_slot *)((char *)ring + sizeof(*ring) + (pos & (ring->slot_count - 1)) * ring->stride);
+}
+
+static inline uint32_t __smq_shm_stride(uint32_t slot_size)
+{
+    return (uint32_t)((sizeof(smq_shm_slot) + slot_size + SMQ_CACHELINE_SIZE - 1) & ~(size_t)(SMQ_CACHELINE_SIZE - 1));
+}
+
+static inline void __smq_shm_ring_init(smq_shm_ring *ring, uint32_t slot_count, uint32_t slot_size)
+{
+    ring->slot_count = slot_count;
+    ring->slot_size = slot_size;
+    ring->stride = __smq_shm_stride(slot_size);
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+    atomic_init(&ring->pushed, 0);
+    atomic_init(&ring->listen_waiters, 0);
+    atomic_init(&ring->popped, 0);
+    atomic_init(&ring->send_waiters, 0);
+    for (uint32_t i = 0; i < slot_count; i++) {
+        atomic_init(&__smq_shm_slot(ring, i)->sequence, i);
+    }
+    atomic_store_explicit(&ring->ready, SMQ_SHM_MAGIC, memory_order_release);
+}
+
+// Someone else creates the segment, wait until it is sized and its leading ready word holds magic before trusting its geometry.
+static inline void *__smq_shm_map_ready(smq_channel *channel, size_t header_size, unsigned int magic)
+{
+    static const int open_attempts = 1000;
+    struct stat st;
+    void *map = NULL;
+    for (int attempt = 0; attempt < open_attempts; attempt++) {
+        if (fstat(channel->desc, &st) == 0 && (size_t)st.st_size >= header_size) {
+            if ((map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, channel->desc, 0)) == MAP_FAILED) {
+                return NULL;
             }
+            if (atomic_load_explicit((atomic_uint *)map, memory_order_acquire) == magic) {
+                channel->ring = map;
+                channel->mapsize = (size_t)st.st_size;
+                return map;
             }
+            munmap(map, (size_t)st.st_size);
         }
-        if (msgrecv->header.isresponse == SMQ_STATUS_REQUEST) {
-            listener->handler(msgrecv, msgresp);
-            msgresp->header.isresponse = SMQ_STATUS_RESPONSE;
-            while ((send_res = smq_channel_timed_send(&listener->channel, (char *)msgresp, sizeof(*msgresp), 0, timeout_ms)) < 0) {
-                switch (send_res) {
-                case -ETIMEDOUT: {
-                    continue;
-                }
-                }
-            }
-            memset(msgrecv, 0x00, sizeof(*msgrecv));
-            memset(msgresp, 0x00, sizeof(*msgresp));
-            continue;
+        sched_yield();
+    }
+    errno = ETIMEDOUT;
+    return NULL;
+}
+
+static inline int __smq_shm_channel_create(smq_channel *channel)
+{
+    smq_shm_ring *ring = NULL;
+    uint32_t slot_count = 2;
+    const uint32_t slot_size = (uint32_t)channel->maxmsgsize;
+    bool creator = false;
+    while (slot_count < (uint32_t)channel->maxmsgcount) {
+        slot_count <<= 1;
+    }
+    channel->ring = NULL;
+    channel->desc = (channel->oflag & O_CREAT) ? shm_open(channel->path, O_RDWR | O_CREAT | O_EXCL, channel->mode) : -1;
+    if (channel->desc != -1) {
+        creator = true;
+        const size_t size = sizeof(*ring) + (size_t)slot_count * __smq_shm_stride(slot_size);
+        if (ftruncate(channel->desc, (off_t)size) != 0 || (ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, channel->desc, 0)) == MAP_FAILED) {
+            goto fail;
         }
-        while ((send_res = smq_channel_timed_send(&listener->channel, (char *)msgrecv, sizeof(*msgrecv), 0, timeout_ms)) < 0) {
-            switch (send_res) {
-            case -ETIMEDOUT: {
-                continue;
+        __smq_shm_ring_init(ring, slot_count, slot_size);
+        channel->ring = ring;
+        channel->mapsize = size;
+        return 0;
+    }
+    if ((channel->oflag & O_CREAT) && (errno != EEXIST || (channel->oflag & O_EXCL))) {
+        goto fail;
+    }
+    if ((channel->desc = shm_open(channel->path, O_RDWR, channel->mode)) == -1) {
+        goto fail;
+    }
+    if ((ring = __smq_shm_map_ready(channel, sizeof(*ring), SMQ_SHM_MAGIC)) != NULL) {
+        channel->maxmsgsize = ring->slot_size;
+        channel->maxmsgcount = ring->slot_count;
+        return 0;
+    }
+fail:
+    __smq_channel_report_error(channel);
+    const int error = errno;
+    if (channel->desc != -1) {
+        close(channel->desc);
+        if (creator) shm_unlink(channel->path);
+    }
+    channel->desc = -1;
+    errno = error;
+    return -1;
+}
+
+static inline void __smq_shm_channel_close(const smq_channel *channel)
+{
+    if (channel->ring != NULL) {
+        munmap(channel->ring, channel->mapsize);
+    }
+    if (channel->desc != -1) {
+        close(channel->desc);
+    }
+}
+
+// Both sides of the ring sleep the same way: announce as waiter, re-check, then futex wait on the counter the other side bumps.
+static inline int __smq_shm_wait(atomic_uint *word, atomic_uint *waiters, unsigned int seen, long deadline_ms)
+{
+    int res = 0;
+    long remaining = -1;
+    if (deadline_ms >= 0 && (remaining = deadline_ms - __smq_monotonic_ms()) <= 0) {
+        return -ETIMEDOUT;
+    }
+    atomic_fetch_add(waiters, 1);
+    res = __smq_futex_wait(word, seen, remaining);
+    atomic_fetch_sub(waiters, 1);
+    return res == -EAGAIN || res == -ETIMEDOUT ? 0 : res;
+}
+
+static inline void __smq_shm_notify(atomic_uint *word, atomic_uint *waiters)
+{
+    atomic_fetch_add(word, 1);
+    if (atomic_load(waiters) > 0) {
+        __smq_futex_wake(word);
+    }
+}
+
+static inline int __smq_shm_send(const smq_channel *channel, const char *data, const size_t size, long timeout_ms)
+{
+    smq_shm_ring *ring = (smq_shm_ring *)channel->ring;
+    const long deadline_ms = timeout_ms >= 0 ? __smq_monotonic_ms() + timeout_ms : -1;
+    smq_shm_slot *slot = NULL;
+    size_t pos = 0;
+    int res = 0;
+    if (size > ring->slot_size) {
+        return -EMSGSIZE;
+    }
+    for (;;) {
+        const unsigned int seen = atomic_load(&ring->popped);
+        pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        slot = __smq_shm_slot(ring, pos);
+        intptr_t diff = (intptr_t)atomic_load_explicit(&slot->sequence, memory_order_acquire) - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
             }
+        } else if (diff < 0) {
+            if ((res = __smq_shm_wait(&ring->popped, &ring->send_waiters, seen, deadline_ms)) != 0) {
+                return res;
             }
         }
     }
-    free(msgresp);
-    free(msgrecv);
-    __smq_server_listener_modify_readiness(listener, false);
-    return NULL;
+    slot->length = (uint32_t)size;
+    memcpy((char *)slot + sizeof(*slot), data, size);
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    __smq_shm_notify(&ring->pushed, &ring->listen_waiters);
+    return 0;
 }
 
-static inline void __smq_server_modify_running_state(smq_server *server, bool new_state)
+static inline long __smq_shm_depth(const smq_channel *channel)
 {
-#ifdef SMQ_HAS_ATOMICS
-    atomic_store(&server->running, new_state);
-#else
-    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_lock(&mutex);
-    server->running = new_state;
-    pthread_mutex_unlock(&mutex);
-#endif
+    smq_shm_ring *ring = (smq_shm_ring *)channel->ring;
+    const size_t dequeue_pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    const size_t enqueue_pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    return enqueue_pos > dequeue_pos ? (long)(enqueue_pos - dequeue_pos) : 0;
 }
 
-static inline bool smq_server_is_running(smq_server *server)
+static inline int __smq_shm_listen(const smq_channel *channel, char *data, const size_t size, long timeout_ms)
 {
-    bool res = false;
-#ifdef SMQ_HAS_ATOMICS
-    res = atomic_load(&server->running);
-#else
-    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_lock(&mutex);
-    res = server->running;
-    pthread_mutex_unlock(&mutex);
-#endif
+    smq_shm_ring *ring = (smq_shm_ring *)channel->ring;
+    const long deadline_ms = timeout_ms >= 0 ? __smq_monotonic_ms() + timeout_ms : -1;
+    smq_shm_slot *slot = NULL;
+    size_t pos = 0;
+    int res = 0;
+    for (;;) {
+        const unsigned int seen = atomic_load(&ring->pushed);
+        pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+        slot = __smq_shm_slot(ring, pos);
+        intptr_t diff = (intptr_t)atomic_load_explicit(&slot->sequence, memory_order_acquire) - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (slot->length > size) {
+                return -EMSGSIZE;
+            }
+            if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            if ((res = __smq_shm_wait(&ring->pushed, &ring->listen_waiters, seen, deadline_ms)) != 0) {
+                return res;
+            }
+        }
+    }
+    res = (int)slot->length;
+    memcpy(data, (char *)slot + sizeof(*slot), slot->length);
+    atomic_store_explicit(&slot->sequence, pos + ring->slot_count, memory_order_release);
+    __smq_shm_notify(&ring->popped, &ring->send_waiters);
     return res;
 }
 
-static inline int smq_server_spawn_subprocess(smq_server_listener *listener)
+#define SMQ_BROADCAST_MAGIC 0x534d5142u
+
+typedef struct
+{
+    atomic_uint ready;// SMQ_BROADCAST_MAGIC once the publisher has initialised the ring
+    uint32_t slot_count;
+    uint32_t slot_size;
+    uint32_t stride;
+    uint32_t owner;// pid of the publisher, the ring is taken while it runs
+    char pad0[SMQ_CACHELINE_SIZE - 5 * sizeof(uint32_t)];
+    atomic_size_t head;// sequence the publisher writes next
+    atomic_uint published;// futex word subscribers sleep on
+    atomic_uint waiters;
+    char pad1[SMQ_CACHELINE_SIZE - sizeof(atomic_size_t) - 2 * sizeof(atomic_uint)];
+} smq_broadcast_ring;
+
+// Broadcast slots reuse smq_shm_slot, sequence is 2 * seq + 2 once message seq is complete and odd while it is written.
+static inline smq_shm_slot *__smq_broadcast_slot(smq_broadcast_ring *ring, size_t seq)
 {
-    return pthread_create(&listener->thread, NULL, __smq_listener_proc, (void *)listener);
+    return (smq_shm_slot *)((char *)ring + sizeof(*ring) + (seq & (ring->slot_count - 1)) * ring->stride);
 }
 
-static inline void *__smq_server_run(void *server)
+static inline void __smq_futex_wake_all(atomic_uint *word)
 {
-    smq_server_start((smq_server *)server);
+    syscall(SYS_futex, (unsigned int *)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
 }
 
-static inline int smq_server_start_non_blocking(pthread_t *thread, smq_server *server)
+// A ring whose publisher died, or never got as far as recording itself, may be replaced.
+static inline bool __smq_broadcast_owned(const char *path)
 {
-    return pthread_create(thread, NULL, __smq_server_run, (void *)server);
+    struct stat st;
+    smq_broadcast_ring *ring = NULL;
+    bool owned = false;
+    const int desc = shm_open(path, O_RDONLY, 0);
+    if (desc == -1) {
+        return false;
+    }
+    if (fstat(desc, &st) == 0 && (size_t)st.st_size >= sizeof(*ring)
+        && (ring = mmap(NULL, sizeof(*ring), PROT_READ, MAP_SHARED, desc, 0)) != MAP_FAILED) {
+        const pid_t owner = (pid_t)ring->owner;
+        owned = owner > 0 && (kill(owner, 0) == 0 || errno == EPERM);
+        munmap(ring, sizeof(*ring));
+    }
+    close(desc);
+    return owned;
 }
 
-static inline void smq_server_start(smq_server *server)
+static inline int smq_publisher_create(smq_publisher *publisher, const char *path)
 {
-    if (server->listeners == NULL) return;
-    smq_server_listener *first_listener = (smq_server_listener *)server->listeners;
-    if (smq_server_is_running(server) == true) {
-        return;
+    return __smq_publisher_create(publisher, path, (smq_publisher_options){ 0 });
+}
+
+static inline int __smq_publisher_create(smq_publisher *publisher, const char *path, smq_publisher_options options)
+{
+    smq_channel *channel = &publisher->channel;
+    smq_broadcast_ring *ring = NULL;
+    const size_t wanted = options.slot_count > 0 ? options.slot_count : SMQ_DEFAULT_BROADCAST_SLOTS;
+    const uint32_t slot_size = (uint32_t)(options.slot_size > 0 ? options.slot_size : sizeof(smq_message));
+    uint32_t slot_count = 2;
+    int error = 0;
+    while (slot_count < wanted) {
+        slot_count <<= 1;
     }
-    __smq_server_modify_running_state(server, true);
-    for (smq_server_listener *lsner = (smq_server_listener *)first_listener->next; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
-        if (smq_server_spawn_subprocess(lsner) != 0) {
-            puts("smq_server_start unable to spawn thread.");
-            return;
-        }
+    *channel = (smq_channel){
+        .maxmsgsize = slot_size,
+        .maxmsgcount = slot_count,
+        .desc = -1,
+        .mode = 0666,
+        .oflag = O_RDWR | O_CREAT,
+        .backend = SMQ_CHANNEL_BACKEND_SHM
+    };
+    memcpy(channel->path, path, strlen(path) + 1);
+    // A ring left behind by a publisher that died is replaced, subscribers still mapping it just stop seeing messages.
+    if ((channel->desc = shm_open(channel->path, O_RDWR | O_CREAT | O_EXCL, channel->mode)) == -1 && errno == EEXIST
+        && !__smq_broadcast_owned(channel->path)) {
+        shm_unlink(channel->path);
+        channel->desc = shm_open(channel->path, O_RDWR | O_CREAT | O_EXCL, channel->mode);
     }
-    (void)__smq_listener_proc((void *)first_listener);
+    if (channel->desc == -1) {
+        goto fail;
+    }
+    channel->mapsize = sizeof(*ring) + (size_t)slot_count * __smq_shm_stride(slot_size);
+    if (ftruncate(channel->desc, (off_t)channel->mapsize) != 0 || (ring = mmap(NULL, channel->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, channel->desc, 0)) == MAP_FAILED) {
+        goto fail;
+    }
+    ring->slot_count = slot_count;
+    ring->slot_size = slot_size;
+    ring->stride = __smq_shm_stride(slot_size);
+    ring->owner = (uint32_t)getpid();
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->published, 0);
+    atomic_init(&ring->waiters, 0);
+    for (uint32_t i = 0; i < slot_count; i++) {
+        atomic_init(&__smq_broadcast_slot(ring, i)->sequence, 0);
+    }
+    atomic_store_explicit(&ring->ready, SMQ_BROADCAST_MAGIC, memory_order_release);
+    channel->ring = ring;
+    return 0;
+fail:
+    error = errno;
+    printf("Error in opening channel: %s\n", strerror(error));
+    if (channel->desc != -1) {
+        close(channel->desc);
+        shm_unlink(channel->path);
+    }
+    channel->desc = -1;
+    return error == EEXIST ? -EEXIST : -1;
 }
 
-static inline bool smq_server_ready(smq_server *server, long timeout_ms)
+// Single writer: no claim on the slot, it is overwritten whether or not every subscriber has read it.
+static inline int smq_publisher_publish(smq_publisher *publisher, const void *data, size_t size)
 {
-    long abs_timeout = smq_timestamp_ms() + timeout_ms;
+    smq_broadcast_ring *ring = (smq_broadcast_ring *)publisher->channel.ring;
+    const size_t seq = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    smq_shm_slot *slot = __smq_broadcast_slot(ring, seq);
+    if (size > ring->slot_size) {
+        return -EMSGSIZE;
+    }
+    atomic_store_explicit(&slot->sequence, 2 * seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->length = (uint32_t)size;
+    memcpy((char *)slot + sizeof(*slot), data, size);
+    atomic_store_explicit(&slot->sequence, 2 * seq + 2, memory_order_release);
+    atomic_store_explicit(&ring->head, seq + 1, memory_order_release);
+    atomic_fetch_add(&ring->published, 1);
+    if (atomic_load(&ring->waiters) > 0) {
+        __smq_futex_wake_all(&ring->published);
+    }
+    return 0;
+}
 
-    for (smq_server_listener *lsner = server->listeners; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
-        long time_now = smq_timestamp_ms();
-        while (!__smq_server_listener_is_ready(lsner) || abs_timeout > time_now) {
-            time_now = smq_timestamp_ms();
-            sched_yield();
+// The path is unlinked only while it still names this publisher's ring, a successor that replaced it keeps its own.
+static inline void smq_publisher_destroy(smq_publisher *publisher)
+{
+    struct stat own;
+    struct stat current;
+    int desc = -1;
+    const bool linked = publisher->channel.desc != -1 && fstat(publisher->channel.desc, &own) == 0
+        && (desc = shm_open(publisher->channel.path, O_RDONLY, 0)) != -1 && fstat(desc, &current) == 0
+        && own.st_dev == current.st_dev && own.st_ino == current.st_ino;
+    if (desc != -1) {
+        close(desc);
+    }
+    __smq_shm_channel_close(&publisher->channel);
+    if (linked) {
+        shm_unlink(publisher->channel.path);
+    }
+}
+
+static inline int smq_subscriber_open(smq_subscriber *subscriber, const char *path)
+{
+    smq_channel *channel = &subscriber->channel;
+    smq_broadcast_ring *ring = NULL;
+    *channel = (smq_channel){ .desc = -1, .mode = 0666, .oflag = O_RDWR, .backend = SMQ_CHANNEL_BACKEND_SHM };
+    memcpy(channel->path, path, strlen(path) + 1);
+    subscriber->cursor = 0;
+    subscriber->lost = 0;
+    if ((channel->desc = shm_open(channel->path, O_RDWR, channel->mode)) == -1) {
+        goto fail;
+    }
+    if ((ring = __smq_shm_map_ready(channel, sizeof(*ring), SMQ_BROADCAST_MAGIC)) != NULL) {
+        channel->maxmsgsize = ring->slot_size;
+        channel->maxmsgcount = ring->slot_count;
+        // Late joiners start with the next message instead of replaying what the ring still holds.
+        subscriber->cursor = atomic_load_explicit(&ring->head, memory_order_acquire);
+        return 0;
+    }
+fail:
+    printf("Error in opening channel: %s\n", strerror(errno));
+    if (channel->desc != -1) {
+        close(channel->desc);
+    }
+    channel->desc = -1;
+    return -1;
+}
+
+// Returns the message length, -ETIMEDOUT, or -EOVERFLOW once after the publisher lapped this subscriber, lost then says by how much.
+static inline int smq_subscriber_receive(smq_subscriber *subscriber, void *data, size_t size, long timeout_ms)
+{
+    smq_broadcast_ring *ring = (smq_broadcast_ring *)subscriber->channel.ring;
+    const long deadline_ms = timeout_ms >= 0 ? __smq_monotonic_ms() + timeout_ms : -1;
+    const size_t seq = subscriber->cursor;
+    size_t head = 0;
+    int res = 0;
+    for (;;) {
+        const unsigned int seen = atomic_load(&ring->published);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head != seq) {
+            break;
         }
-        if (time_now > abs_timeout) {
-            return false;
+        if ((res = __smq_shm_wait(&ring->published, &ring->waiters, seen, deadline_ms)) != 0) {
+            return res;
         }
     }
-    return true;
+    if (head - seq <= ring->slot_count) {
+        smq_shm_slot *slot = __smq_broadcast_slot(ring, seq);
+        const size_t complete = 2 * seq + 2;
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) == complete) {
+            const uint32_t length = slot->length;
+            memcpy(data, (char *)slot + sizeof(*slot), length < size ? length : size);
+            atomic_thread_fence(memory_order_acquire);
+            // Unchanged sequence means the copy was not torn by the publisher reusing the slot.
+            if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) == complete) {
+                // Reported once and passed over, a bigger buffer would not get it back either once the slot is reused.
+                subscriber->cursor = seq + 1;
+                return length > size ? -EMSGSIZE : (int)length;
+            }
+        }
+    }
+    // Skip to the oldest message the publisher cannot be rewriting right now.
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    subscriber->cursor = head - ring->slot_count + 1;
+    subscriber->lost += subscriber->cursor - seq;
+    return -EOVERFLOW;
 }
 
-static inline void smq_server_stop(smq_server *server)
+static inline void smq_subscriber_close(smq_subscriber *subscriber)
 {
-    __smq_server_modify_running_state(server, false);
-    if (server->listeners == NULL) return;
-    if (server->listeners->next == NULL) {
-        while (__smq_server_listener_is_ready(server->listeners)) {
-            sched_yield();
-        }
-        return;
+    __smq_shm_channel_close(&subscriber->channel);
+}
+
+#define SMQ_SLAB_MAGIC 0x534d5153u
+#define SMQ_SLAB_ALIGN 4096// slot data starts page aligned
+
+// Followed by the generation of every slot, the allocation bitmap and, page aligned, the slots themselves.
+typedef struct
+{
+    atomic_uint ready;// SMQ_SLAB_MAGIC once the creator has initialised the slab
+    uint32_t slot_count;
+    uint64_t slot_size;
+    uint64_t data_offset;
+    char pad0[SMQ_CACHELINE_SIZE - 2 * sizeof(uint32_t) - 2 * sizeof(uint64_t)];
+    atomic_size_t hint;// bitmap word the last allocation came from
+    char pad1[SMQ_CACHELINE_SIZE - sizeof(atomic_size_t)];
+} smq_slab_header;
+
+static inline size_t __smq_slab_words(size_t slot_count)
+{
+    return (slot_count + 63) / 64;
+}
+
+static inline atomic_uint *__smq_slab_generations(smq_slab_header *header)
+{
+    return (atomic_uint *)(header + 1);
+}
+
+static inline _Atomic uint64_t *__smq_slab_bitmap(smq_slab_header *header)
+{
+    const size_t offset = (sizeof(*header) + header->slot_count * sizeof(atomic_uint) + 7) & ~(size_t)7;
+    return (_Atomic uint64_t *)((char *)header + offset);
+}
+
+static inline size_t __smq_slab_data_offset(size_t slot_count)
+{
+    const size_t bitmap_offset = (sizeof(smq_slab_header) + slot_count * sizeof(atomic_uint) + 7) & ~(size_t)7;
+    return (bitmap_offset + __smq_slab_words(slot_count) * sizeof(uint64_t) + SMQ_SLAB_ALIGN - 1) & ~(size_t)(SMQ_SLAB_ALIGN - 1);
+}
+
+static inline void __smq_slab_init(smq_slab_header *header, uint32_t slot_count, uint64_t slot_size)
+{
+    header->slot_count = slot_count;
+    header->slot_size = slot_size;
+    header->data_offset = __smq_slab_data_offset(slot_count);
+    atomic_init(&header->hint, 0);
+    for (uint32_t i = 0; i < slot_count; i++) {
+        atomic_init(&__smq_slab_generations(header)[i], 0);
     }
+    for (size_t i = 0; i < __smq_slab_words(slot_count); i++) {
+        // Bits past the last slot are marked taken so the allocator never hands them out.
+        const size_t used = slot_count - i * 64;
+        atomic_init(&__smq_slab_bitmap(header)[i], used >= 64 ? 0 : ~(uint64_t)0 << used);
+    }
+    atomic_store_explicit(&header->ready, SMQ_SLAB_MAGIC, memory_order_release);
+}
 
-    for (smq_server_listener *lsner = (smq_server_listener *)server->listeners->next; lsner != NULL; lsner = (smq_server_listener *)lsner->next) {
-        if (pthread_join(lsner->thread, NULL) != 0) {
-            puts("smq_server_stop phtread unable to join");
-            return;
+static inline int smq_slab_create(smq_slab *slab, const char *path)
+{
+    return __smq_slab_create(slab, path, (smq_slab_options){ 0 });
+}
+
+// Whoever comes first creates the slab with its options, later callers map it and take the creator's geometry.
+static inline int __smq_slab_create(smq_slab *slab, const char *path, smq_slab_options options)
+{
+    smq_channel *channel = &slab->channel;
+    smq_slab_header *header = NULL;
+    const uint32_t slot_count = (uint32_t)(options.slot_count > 0 ? options.slot_count : SMQ_DEFAULT_SLAB_SLOTS);
+    const uint64_t slot_size = options.slot_size > 0 ? options.slot_size : SMQ_DEFAULT_SLAB_SLOT_SIZE;
+    bool creator = false;
+    *channel = (smq_channel){
+        .maxmsgsize = (long)slot_size,
+        .maxmsgcount = slot_count,
+        .desc = -1,
+        .mode = 0666,
+        .oflag = O_RDWR | O_CREAT,
+        .backend = SMQ_CHANNEL_BACKEND_SHM
+    };
+    memcpy(channel->path, path, strlen(path) + 1);
+    slab->threshold = options.threshold > 0 ? options.threshold : SMQ_PAYLOAD_SIZE;
+    if ((channel->desc = shm_open(channel->path, O_RDWR | O_CREAT | O_EXCL, channel->mode)) != -1) {
+        creator = true;
+        channel->mapsize = __smq_slab_data_offset(slot_count) + slot_count * slot_size;
+        if (ftruncate(channel->desc, (off_t)channel->mapsize) != 0 || (header = mmap(NULL, channel->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, channel->desc, 0)) == MAP_FAILED) {
+            goto fail;
         }
+        __smq_slab_init(header, slot_count, slot_size);
+        channel->ring = header;
+        return 0;
+    }
+    if (errno != EEXIST || (channel->desc = shm_open(channel->path, O_RDWR, channel->mode)) == -1) {
+        goto fail;
     }
+    if ((header = __smq_shm_map_ready(channel, sizeof(*header), SMQ_SLAB_MAGIC)) != NULL) {
+        channel->maxmsgsize = (long)header->slot_size;
+        channel->maxmsgcount = header->slot_count;
+        return 0;
+    }
+fail:
+    printf("Error in opening channel: %s\n", strerror(errno));
+    if (channel->desc != -1) {
+        close(channel->desc);
+        if (creator) shm_unlink(channel->path);
+    }
+    channel->desc = -1;
+    return -1;
 }
 
-static inline void smq_server_destroy(smq_server *server)
+static inline void smq_slab_close(smq_slab *slab)
 {
-    smq_server_listener *lsner = server->listeners;
-    smq_server_stop(server);
-    while (lsner != NULL) {
-        smq_server_listener *tmp = (smq_server_listener *)lsner->next;
-        smq_channel_destroy(&lsner->channel);
-        free(lsner);
-        lsner = tmp;
+    __smq_shm_channel_close(&slab->channel);
+}
+
+static inline void smq_slab_destroy(smq_slab *slab)
+{
+    smq_slab_close(slab);
+    shm_unlink(slab->channel.path);
+}
+
+// First fit over the bitmap starting at the word the last allocation came from, -ENOSPC when every slot is out.
+static inline int smq_slab_alloc(smq_slab *slab, size_t length, smq_slab_descriptor *descriptor)
+{
+    smq_slab_header *header = (smq_slab_header *)slab->channel.ring;
+    _Atomic uint64_t *bitmap = __smq_slab_bitmap(header);
+    const size_t words = __smq_slab_words(header->slot_count);
+    const size_t start = atomic_load_explicit(&header->hint, memory_order_relaxed);
+    if (length > header->slot_size || length > UINT32_MAX) {
+        return -EMSGSIZE;
+    }
+    for (size_t n = 0; n < words; n++) {
+        const size_t word = (start + n) % words;
+        uint64_t bits = atomic_load_explicit(&bitmap[word], memory_order_relaxed);
+        while (bits != ~(uint64_t)0) {
+            const uint64_t lowest = ~bits & (bits + 1);
+            if (!atomic_compare_exchange_weak_explicit(&bitmap[word], &bits, bits | lowest, memory_order_acquire, memory_order_relaxed)) {
+                continue;
+            }
+            size_t bit = 0;
+            while ((lowest >> bit) != 1) {
+                bit++;
+            }
+            const size_t slot = word * 64 + bit;
+            atomic_store_explicit(&header->hint, word, memory_order_relaxed);
+            *descriptor = (smq_slab_descriptor){
+                .offset = slot * header->slot_size,
+                .length = (uint32_t)length,
+                .generation = atomic_fetch_add_explicit(&__smq_slab_generations(header)[slot], 1, memory_order_acq_rel) + 1
+            };
+            return 0;
+        }
     }
+    return -ENOSPC;
 }
 
-static const long msins = 1000;
-static const long nsinms = 1000000;
-static const long nsinsec = 1000000000;
+static inline bool __smq_slab_valid(const smq_slab_header *header, const smq_slab_descriptor *descriptor)
+{
+    return descriptor->offset % header->slot_size == 0 && descriptor->offset / header->slot_size < header->slot_count && descriptor->length <= header->slot_size;
+}
 
-static inline long smq_timespec_to_timestamp_ms(struct timespec *time)
+// NULL for descriptors that do not point into this slab or whose slot was released since.
+static inline void *smq_slab_data(smq_slab *slab, const smq_slab_descriptor *descriptor)
 {
-    return time->tv_sec * msins + time->tv_nsec / nsinms;
+    smq_slab_header *header = (smq_slab_header *)slab->channel.ring;
+    if (!__smq_slab_valid(header, descriptor)) {
+        return NULL;
+    }
+    const size_t slot = descriptor->offset / header->slot_size;
+    if (atomic_load_explicit(&__smq_slab_generations(header)[slot], memory_order_acquire) != descriptor->generation) {
+        return NULL;
+    }
+    return (char *)header + header->data_offset + descriptor->offset;
 }
 
-static inline long smq_timestamp_ms()
+// Only the first release of a descriptor frees the slot, any later one gets -ESTALE.
+static inline int smq_slab_release(smq_slab *slab, const smq_slab_descriptor *descriptor)
 {
-    struct timespec time = smq_time_now();
-    return smq_timespec_to_timestamp_ms(&time);
+    smq_slab_header *header = (smq_slab_header *)slab->channel.ring;
+    if (!__smq_slab_valid(header, descriptor)) {
+        return -EINVAL;
+    }
+    const size_t slot = descriptor->offset / header->slot_size;
+    unsigned int generation = descriptor->generation;
+    if (!atomic_compare_exchange_strong_explicit(&__smq_slab_generations(header)[slot], &generation, generation + 1, memory_order_acq_rel, memory_order_relaxed)) {
+        return -ESTALE;
+    }
+    atomic_fetch_and_explicit(&__smq_slab_bitmap(header)[slot / 64], ~((uint64_t)1 << (slot % 64)), memory_order_release);
+    return 0;
 }
 
-static inline void smq_abs_timeout(struct timespec *restrict time, long offset_ms)
+// Payloads up to the slab threshold stay inline, larger ones are copied into a slot and only the descriptor is written.
+static inline int smq_message_write_slab(smq_message *message, smq_slab *slab, const void *data, size_t length)
 {
-    time->tv_nsec += offset_ms * nsinms;
-    time->tv_sec += time->tv_nsec / nsinsec;
-    time->tv_nsec -= (time->tv_nsec / nsinsec) * nsinsec;
+    smq_slab_descriptor descriptor;
+    int res = 0;
+    if (length <= slab->threshold) {
+        message->header.flags &= (uint8_t)~SMQ_FLAG_OFFLOADED;
+        return smq_message_write(message, data, length);
+    }
+    if ((res = smq_slab_alloc(slab, length, &descriptor)) != 0) {
+        return res;
+    }
+    memcpy(smq_slab_data(slab, &descriptor), data, length);
+    message->header.flags |= SMQ_FLAG_OFFLOADED;
+    return smq_message_write(message, &descriptor, sizeof(descriptor));
 }
 
-static inline struct timespec smq_time_now()
+static inline const void *smq_message_slab_data(const smq_message *message, smq_slab *slab, size_t *length)
 {
-    struct timespec time;
-    clock_gettime(CLOCK_REALTIME, &time);
-    return time;
+    smq_slab_descriptor descriptor;
+    const void *data = NULL;
+    if (!(message->header.flags & SMQ_FLAG_OFFLOADED)) {
+        *length = smq_message_length(message);
+        return message->payload;
+    }
+    memcpy(&descriptor, message->payload, sizeof(descriptor));
+    data = smq_slab_data(slab, &descriptor);
+    *length = data != NULL ? descriptor.length : 0;
+    return data;
+}
+
+static inline int smq_message_release_slab(const smq_message *message, smq_slab *slab)
+{
+    smq_slab_descriptor descriptor;
+    if (!(message->header.flags & SMQ_FLAG_OFFLOADED)) {
+        return 0;
+    }
+    memcpy(&descriptor, message->payload, sizeof(descriptor));
+    return smq_slab_release(slab, &descriptor);
 }
+#endif// SMQ_HAS_SHM
 
 #endif// SMQ_IMPL
 #endif// SMQ_H
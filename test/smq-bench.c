@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#define SMQ_IMPL
+#include <smq/smq.h>
+
+// Log-linear histogram in the spirit of HdrHistogram: one row per power of two, 32 linear sub-buckets per row (~3% error).
+#define BENCH_SUB_BUCKET_BITS 5
+#define BENCH_SUB_BUCKETS (1 << BENCH_SUB_BUCKET_BITS)
+#define BENCH_ROWS 64
+
+typedef struct
+{
+    uint64_t counts[BENCH_ROWS][BENCH_SUB_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} bench_histogram;
+
+typedef struct
+{
+    const char *output;
+    size_t requests;
+} bench_config;
+
+static inline uint64_t bench_now_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ull + (uint64_t)time.tv_nsec;
+}
+
+static void bench_histogram_record(bench_histogram *histogram, uint64_t value)
+{
+    size_t row = 0;
+    while ((value >> row) >= BENCH_SUB_BUCKETS) {
+        row++;
+    }
+    histogram->counts[row][(value >> row) & (BENCH_SUB_BUCKETS - 1)]++;
+    histogram->total++;
+    if (value > histogram->max) histogram->max = value;
+}
+
+static void bench_histogram_merge(bench_histogram *into, const bench_histogram *from)
+{
+    for (size_t row = 0; row < BENCH_ROWS; row++) {
+        for (size_t sub = 0; sub < BENCH_SUB_BUCKETS; sub++) {
+            into->counts[row][sub] += from->counts[row][sub];
+        }
+    }
+    into->total += from->total;
+    if (from->max > into->max) into->max = from->max;
+}
+
+static uint64_t bench_histogram_percentile(const bench_histogram *histogram, double percentile)
+{
+    uint64_t seen = 0;
+    const uint64_t target = (uint64_t)((percentile / 100.0) * (double)histogram->total + 0.5);
+    for (size_t row = 0; row < BENCH_ROWS; row++) {
+        for (size_t sub = 0; sub < BENCH_SUB_BUCKETS; sub++) {
+            seen += histogram->counts[row][sub];
+            if (seen >= target && seen > 0) {
+                const uint64_t upper = (((uint64_t)sub + 1) << row) - 1;// report the bucket's upper edge
+                return upper < histogram->max ? upper : histogram->max;
+            }
+        }
+    }
+    return histogram->max;
+}
+
+static void bench_print_header(const bench_config *config)
+{
+    if (strcmp(config->output, "csv") == 0) {
+        puts("scenario,backend,mode,payload,clients,listeners,requests,errors,throughput_rps,p50_us,p99_us,p999_us,max_us");
+    } else {
+        puts("[");
+    }
+}
+
+// requests counts the round trips that succeeded, errors the ones that failed and are left out of the latencies.
+static void bench_print_row(const bench_config *config, const char *scenario, const char *backend, const char *mode, size_t payload, size_t clients, size_t listeners, const bench_histogram *histogram, uint64_t errors, uint64_t elapsed_ns)
+{
+    static bool first = true;
+    const double throughput = elapsed_ns > 0 ? (double)histogram->total * 1e9 / (double)elapsed_ns : 0.0;
+    const double p50 = (double)bench_histogram_percentile(histogram, 50.0) / 1000.0;
+    const double p99 = (double)bench_histogram_percentile(histogram, 99.0) / 1000.0;
+    const double p999 = (double)bench_histogram_percentile(histogram, 99.9) / 1000.0;
+    const double max = (double)histogram->max / 1000.0;
+    if (strcmp(config->output, "csv") == 0) {
+        printf("%s,%s,%s,%zu,%zu,%zu,%llu,%llu,%.0f,%.2f,%.2f,%.2f,%.2f\n", scenario, backend, mode, payload, clients, listeners, (unsigned long long)histogram->total, (unsigned long long)errors, throughput, p50, p99, p999, max);
+    } else {
+        printf("%s  {\"scenario\": \"%s\", \"backend\": \"%s\", \"mode\": \"%s\", \"payload\": %zu, \"clients\": %zu, \"listeners\": %zu, \"requests\": %llu, \"errors\": %llu, "
+               "\"throughput_rps\": %.0f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, \"max_us\": %.2f}",
+          first ? "" : ",\n", scenario, backend, mode, payload, clients, listeners, (unsigned long long)histogram->total, (unsigned long long)errors, throughput, p50, p99, p999, max);
+    }
+    first = false;
+    fflush(stdout);
+}
+
+static void bench_print_footer(const bench_config *config)
+{
+    if (strcmp(config->output, "json") == 0) {
+        puts("\n]");
+    }
+}
+
+static const char *bench_backend_name(int backend)
+{
+    return backend == SMQ_CHANNEL_BACKEND_SHM ? "shm" : "mq";
+}
+
+static void bench_channel(const bench_config *config, int backend, size_t payload, bool timed)
+{
+    bench_histogram *histogram = calloc(1, sizeof(*histogram));
+    smq_message *message = calloc(1, sizeof(*message));
+    smq_channel channel = {
+        .maxmsgsize = sizeof(smq_message),
+        .maxmsgcount = 10,
+        .desc = -1,
+        .mode = 0666,
+        .oflag = O_RDWR | O_CREAT,
+        .path = "/smq-bench-channel",
+        .backend = backend
+    };
+    if (smq_channel_create(&channel) != 0) {
+        free(histogram);
+        free(message);
+        return;
+    }
+    uint64_t errors = 0;
+    const uint64_t start_ns = bench_now_ns();
+    for (size_t i = 0; i < config->requests; i++) {
+        const uint64_t op_start_ns = bench_now_ns();
+        int res = 0;
+        if (timed) {
+            if ((res = smq_channel_timed_send(&channel, (char *)message, payload, 0, 1000)) >= 0) {
+                res = smq_channel_timed_listen(&channel, (char *)message, sizeof(*message), 1000);
+            }
+        } else {
+            if ((res = smq_channel_blocking_send(&channel, (char *)message, payload, 0)) >= 0) {
+                res = smq_channel_blocking_listen(&channel, (char *)message, sizeof(*message));
+            }
+        }
+        if (res < 0) {
+            errors++;
+            continue;
+        }
+        bench_histogram_record(histogram, bench_now_ns() - op_start_ns);
+    }
+    bench_print_row(config, "channel_send_listen", bench_backend_name(backend), timed ? "timed" : "blocking", payload, 1, 0, histogram, errors, bench_now_ns() - start_ns);
+    smq_channel_destroy(&channel);
+    free(histogram);
+    free(message);
+}
+
+static void bench_handler_echo(smq_message *request, smq_message *response)
+{
+    memcpy(response->payload, request->payload, smq_message_length(request));
+    smq_message_set_length(response, smq_message_length(request));
+}
+
+typedef struct
+{
+    const bench_config *config;
+    char path[64];
+    uint16_t id;
+    int backend;
+    size_t payload;
+    size_t requests;
+    bool timed;
+    bench_histogram histogram;
+    uint64_t errors;
+} bench_client_args;
+
+static void *bench_client_proc(void *args_)
+{
+    bench_client_args *args = (bench_client_args *)args_;
+    smq_client client = { 0 };
+    smq_message *request = calloc(1, sizeof(*request));
+    smq_message *response = calloc(1, sizeof(*response));
+    if (smq_client_create_with(&client, args->id, args->path, .private_reply = true, .backend = args->backend) == 0) {
+        smq_message_set_length(request, args->payload);
+        for (size_t i = 0; i < args->requests; i++) {
+            const uint64_t start_ns = bench_now_ns();
+            const int res = args->timed ? smq_client_timed_request(&client, request, response, 0, 1000) : smq_client_blocking_request(&client, request, response, 0);
+            if (res == 0) {
+                bench_histogram_record(&args->histogram, bench_now_ns() - start_ns);
+            } else {
+                args->errors++;
+            }
+        }
+        smq_client_destroy(&client);
+    } else {
+        args->errors = args->requests;
+    }
+    free(request);
+    free(response);
+    return NULL;
+}
+
+static void bench_request_response(const bench_config *config, int backend, size_t payload, size_t clients, size_t listeners, bool timed)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    char route[32];
+    pthread_t *threads = calloc(clients, sizeof(*threads));
+    bench_client_args *args = calloc(clients, sizeof(*args));
+    bench_histogram *histogram = calloc(1, sizeof(*histogram));
+    uint64_t errors = 0;
+    smq_server_create(&server, "/smq-bench");
+    for (size_t i = 0; i < listeners; i++) {
+        snprintf(route, sizeof(route), "-%zu", i);
+        if (smq_server_add_listener_with(&server, route, bench_handler_echo, .backend = backend) != 0) {
+            fprintf(stderr, "smq-bench: unable to add listener /smq-bench%s, skipping %s request_response\n", route, bench_backend_name(backend));
+            smq_server_destroy(&server);
+            goto cleanup;
+        }
+    }
+    smq_server_start_non_blocking(&server_handle, &server);
+    if (!smq_server_ready(&server, 1000)) {
+        fprintf(stderr, "smq-bench: listeners not ready, skipping %s request_response\n", bench_backend_name(backend));
+        goto stop;
+    }
+    const uint64_t start_ns = bench_now_ns();
+    for (size_t i = 0; i < clients; i++) {
+        args[i] = (bench_client_args){
+            .config = config,
+            .id = (uint16_t)(i + 1),
+            .backend = backend,
+            .payload = payload,
+            .requests = config->requests / clients,
+            .timed = timed
+        };
+        snprintf(args[i].path, sizeof(args[i].path), "/smq-bench-%zu", i % listeners);
+        pthread_create(&threads[i], NULL, bench_client_proc, &args[i]);
+    }
+    for (size_t i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        bench_histogram_merge(histogram, &args[i].histogram);
+        errors += args[i].errors;
+    }
+    const uint64_t elapsed_ns = bench_now_ns() - start_ns;
+    bench_print_row(config, "request_response", bench_backend_name(backend), timed ? "timed" : "blocking", payload, clients, listeners, histogram, errors, elapsed_ns);
+stop:
+    smq_server_destroy(&server);
+    pthread_join(server_handle, NULL);
+cleanup:
+    free(threads);
+    free(args);
+    free(histogram);
+}
+
+static void bench_usage(const char *program)
+{
+    printf("Usage: %s [--csv | --json] [--requests N]\n", program);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t payloads[] = { 16, 1024, SMQ_PAYLOAD_SIZE };
+    static const size_t client_counts[] = { 1, 4, 16 };
+    static const size_t listener_counts[] = { 1, 4 };
+    static const bool modes[] = { false, true };
+    bench_config config = { .output = "csv", .requests = 20000 };
+    int backends[] = { SMQ_CHANNEL_BACKEND_MQ, SMQ_CHANNEL_BACKEND_SHM };
+#ifdef SMQ_HAS_SHM
+    const size_t backend_count = 2;
+#else
+    const size_t backend_count = 1;
+#endif
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--csv") == 0) {
+            config.output = "csv";
+        } else if (strcmp(argv[i], "--json") == 0) {
+            config.output = "json";
+        } else if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+            config.requests = strtoul(argv[++i], NULL, 10);
+        } else {
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    bench_print_header(&config);
+    for (size_t b = 0; b < backend_count; b++) {
+        for (size_t p = 0; p < sizeof(payloads) / sizeof(payloads[0]); p++) {
+            for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+                bench_channel(&config, backends[b], SMQ_HEADER_SIZE + payloads[p], modes[m]);
+            }
+        }
+    }
+    for (size_t b = 0; b < backend_count; b++) {
+        for (size_t p = 0; p < sizeof(payloads) / sizeof(payloads[0]); p++) {
+            for (size_t l = 0; l < sizeof(listener_counts) / sizeof(listener_counts[0]); l++) {
+                for (size_t c = 0; c < sizeof(client_counts) / sizeof(client_counts[0]); c++) {
+                    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+                        bench_request_response(&config, backends[b], payloads[p], client_counts[c], listener_counts[l], modes[m]);
+                    }
+                }
+            }
+        }
+    }
+    bench_print_footer(&config);
+    return 0;
+}
@@ -98,6 +98,80 @@ STF_TEST_CASE(smq_channel_transmission, timed_listen_test)
     smq_channel_destroy(&channel);
 }
 
+STF_TEST_CASE(smq_channel_transmission, batch_send_then_batch_listen_drains_queue)
+{
+    static const char *messages[] = { "one", "two", "three", "four", "five" };
+    static const size_t message_count = sizeof(messages) / sizeof(messages[0]);
+    smq_channel_buffer outgoing[sizeof(messages) / sizeof(messages[0])];
+    smq_channel_buffer incoming[8];
+    char *storage = calloc(8, sizeof(smq_message));
+    smq_channel channel = {
+        .maxmsgsize = sizeof(smq_message),
+        .maxmsgcount = 10,
+        .desc = -1,
+        .mode = 0666,
+        .oflag = O_RDWR | O_CREAT,
+        .path = "/test"
+    };
+    for (size_t i = 0; i < message_count; i++) {
+        outgoing[i] = (smq_channel_buffer){ .data = (char *)messages[i], .length = strlen(messages[i]) + 1 };
+    }
+    for (size_t i = 0; i < 8; i++) {
+        incoming[i] = (smq_channel_buffer){ .data = storage + i * sizeof(smq_message), .size = sizeof(smq_message) };
+    }
+    STF_EXPECT(smq_channel_create(&channel) != -1, .failure_msg = "smq_channel_create() was not able to get descriptor");
+    STF_EXPECT(smq_channel_send_batch(&channel, outgoing, message_count, .timeout_ms = 500) == (int)message_count);
+    STF_EXPECT(smq_channel_listen_batch(&channel, incoming, 8, .timeout_ms = 500) == (int)message_count, .failure_msg = "batch listen did not drain every queued message");
+    for (size_t i = 0; i < message_count; i++) {
+        STF_EXPECT(incoming[i].length == strlen(messages[i]) + 1);
+        STF_EXPECT(strcmp(incoming[i].data, messages[i]) == 0);
+    }
+    STF_EXPECT(smq_channel_listen_batch(&channel, incoming, 8, .timeout_ms = 100) == -ETIMEDOUT);
+    smq_channel_destroy(&channel);
+    free(storage);
+}
+
+static void *delayed_send(void *channel)
+{
+    static const char *message = "late";
+    const struct timespec delay = { .tv_nsec = 20 * 1000 * 1000 };
+    nanosleep(&delay, NULL);
+    smq_channel_blocking_send((smq_channel *)channel, message, strlen(message) + 1, 0);
+    return NULL;
+}
+
+STF_TEST_CASE(smq_channel_transmission, busy_listen_stops_spinning_on_sparse_traffic)
+{
+    static const unsigned long max_spin_us = 200;
+    static const char *message = "spin";
+    char rec[sizeof(smq_message)] = { 0 };
+    smq_busy_poll state;
+    smq_channel channel = {
+        .maxmsgsize = sizeof(smq_message),
+        .maxmsgcount = 10,
+        .desc = -1,
+        .mode = 0666,
+        .oflag = O_RDWR | O_CREAT,
+        .path = "/test"
+    };
+    smq_busy_poll_init(&state, max_spin_us);
+    STF_EXPECT(state.budget_us == max_spin_us);
+    STF_EXPECT(smq_channel_create(&channel) != -1, .failure_msg = "smq_channel_create() was not able to get descriptor");
+    STF_EXPECT(smq_channel_blocking_send(&channel, message, strlen(message) + 1, 0) == 0);
+    STF_EXPECT(smq_channel_busy_listen(&channel, rec, sizeof(rec), 500, &state) == (int)strlen(message) + 1);
+    STF_EXPECT(strcmp(rec, message) == 0);
+    STF_EXPECT(state.budget_us > 0, .failure_msg = "a message that was already queued should keep the spin");
+    STF_EXPECT(smq_channel_busy_listen(&channel, rec, sizeof(rec), 0, &state) == -ETIMEDOUT);
+    for (int i = 0; i < 16 && state.budget_us > 0; i++) {
+        pthread_t sender;
+        STF_EXPECT(pthread_create(&sender, NULL, delayed_send, (void *)&channel) == 0);
+        STF_EXPECT(smq_channel_busy_listen(&channel, rec, sizeof(rec), 500, &state) > 0);
+        pthread_join(sender, NULL);
+    }
+    STF_EXPECT(state.budget_us == 0, .failure_msg = "messages 20 ms apart should not be spun for");
+    smq_channel_destroy(&channel);
+}
+
 int main(void)
 {
     return STF_RUN_TESTS();
@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stf/stf.h>
+#define SMQ_IMPL
+#include <smq/smq.h>
+
+static smq_channel shm_channel(const char *path)
+{
+    smq_channel channel = {
+        .maxmsgsize = sizeof(smq_message),
+        .maxmsgcount = 4,
+        .desc = -1,
+        .mode = 0666,
+        .oflag = O_RDWR | O_CREAT,
+        .backend = SMQ_CHANNEL_BACKEND_SHM
+    };
+    memcpy(channel.path, path, strlen(path) + 1);
+    return channel;
+}
+
+STF_TEST_CASE(smq_channel_shm, create_then_destroy_removes_segment)
+{
+    smq_channel channel = shm_channel("/shm-test");
+    STF_EXPECT(smq_channel_create(&channel) == 0, .failure_msg = "failed to map shm ring");
+    STF_EXPECT(access("/dev/shm/shm-test", F_OK) == 0);
+    smq_channel_destroy(&channel);
+    STF_EXPECT(access("/dev/shm/shm-test", F_OK) != 0);
+}
+
+STF_TEST_CASE(smq_channel_shm, send_then_listen_keeps_message_boundaries)
+{
+    static const char *first = "first";
+    static const char *second = "second message";
+    char rec[sizeof(smq_message)] = { 0 };
+    smq_channel sender = shm_channel("/shm-test");
+    smq_channel receiver = shm_channel("/shm-test");
+    receiver.oflag = O_RDWR;
+    STF_EXPECT(smq_channel_create(&sender) == 0);
+    STF_EXPECT(smq_channel_create(&receiver) == 0, .failure_msg = "second mapping of the ring failed");
+    STF_EXPECT(smq_channel_send(&sender, first, strlen(first) + 1) == 0);
+    STF_EXPECT(smq_channel_send(&sender, second, strlen(second) + 1, .timeout_ms = 100) == 0);
+    STF_EXPECT(smq_channel_listen(&receiver, rec, sizeof(rec)) == (int)strlen(first) + 1);
+    STF_EXPECT(strcmp(rec, first) == 0);
+    STF_EXPECT(smq_channel_listen(&receiver, rec, sizeof(rec), .timeout_ms = 100) == (int)strlen(second) + 1);
+    STF_EXPECT(strcmp(rec, second) == 0);
+    smq_channel_close(&receiver);
+    smq_channel_destroy(&sender);
+}
+
+STF_TEST_CASE(smq_channel_shm, timed_listen_on_empty_ring_times_out)
+{
+    static const long timeout_ms = 200;
+    char rec[sizeof(smq_message)];
+    smq_channel channel = shm_channel("/shm-test");
+    STF_EXPECT(smq_channel_create(&channel) == 0);
+    const long before_ms = smq_timestamp_ms();
+    STF_EXPECT(smq_channel_timed_listen(&channel, rec, sizeof(rec), timeout_ms) == -ETIMEDOUT);
+    STF_EXPECT(smq_timestamp_ms() - before_ms >= timeout_ms);
+    smq_channel_destroy(&channel);
+}
+
+STF_TEST_CASE(smq_channel_shm, timed_send_on_full_ring_times_out)
+{
+    static const char *msg = "msg";
+    smq_channel channel = shm_channel("/shm-test");
+    STF_EXPECT(smq_channel_create(&channel) == 0);
+    for (long i = 0; i < channel.maxmsgcount; i++) {
+        STF_EXPECT(smq_channel_timed_send(&channel, msg, strlen(msg), 0, 100) == 0);
+    }
+    STF_EXPECT(smq_channel_timed_send(&channel, msg, strlen(msg), 0, 100) == -ETIMEDOUT);
+    smq_channel_destroy(&channel);
+}
+
+void handler_echo(smq_message *request, smq_message *response)
+{
+    smq_message_write(response, request->payload, smq_message_length(request));
+}
+
+#define SHM_CLIENT_COUNT 8
+#define SHM_REQUEST_COUNT 50
+
+void *shm_requests(void *args)
+{
+    const uint16_t id = (uint16_t)(uintptr_t)args;
+    smq_client client = { 0 };
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    uintptr_t mismatches = 0;
+    if (smq_client_create_with(&client, id, "/shm-server-echo", .private_reply = true, .backend = SMQ_CHANNEL_BACKEND_SHM) != 0) {
+        return (void *)(uintptr_t)SHM_REQUEST_COUNT;
+    }
+    for (int i = 0; i < SHM_REQUEST_COUNT; i++) {
+        smq_message_set_length(&client_request, (size_t)snprintf(client_request.payload, sizeof(client_request.payload), "client %u request %d", (unsigned)id, i) + 1);
+        if (smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) != 0
+            || strcmp(client_request.payload, server_response.payload) != 0) {
+            mismatches++;
+        }
+    }
+    smq_client_destroy(&client);
+    return (void *)mismatches;
+}
+
+STF_TEST_CASE(smq_channel_shm, server_and_clients_over_shm_backend)
+{
+    pthread_t server_handle = 0;
+    pthread_t clients[SHM_CLIENT_COUNT];
+    smq_server server = { 0 };
+    smq_server_create(&server, "/shm-server");
+    STF_EXPECT(smq_server_add_listener_with(&server, "-echo", handler_echo, .backend = SMQ_CHANNEL_BACKEND_SHM, .workers = 2) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    for (uintptr_t i = 0; i < SHM_CLIENT_COUNT; i++) {
+        STF_EXPECT(pthread_create(&clients[i], NULL, shm_requests, (void *)(i + 1)) == 0);
+    }
+    for (size_t j = 0; j < SHM_CLIENT_COUNT; j++) {
+        void *mismatches = NULL;
+        STF_EXPECT(pthread_join(clients[j], &mismatches) == 0);
+        STF_EXPECT((uintptr_t)mismatches == 0, .failure_msg = "client received a response that was not its own");
+    }
+    STF_EXPECT(smq_server_listener_requeued(server.listeners) == 0);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+STF_TEST_CASE(smq_channel_shm, publish_once_reaches_every_subscriber)
+{
+    static const char *messages[] = { "tick 1", "tick 2", "tick 3" };
+    char rec[sizeof(smq_message)] = { 0 };
+    smq_publisher publisher = { 0 };
+    smq_subscriber subscribers[3];
+    smq_subscriber late = { 0 };
+    STF_EXPECT(smq_publisher_create(&publisher, "/shm-broadcast") == 0, .failure_msg = "failed to map broadcast ring");
+    for (size_t i = 0; i < 3; i++) {
+        STF_EXPECT(smq_subscriber_open(&subscribers[i], "/shm-broadcast") == 0);
+    }
+    for (size_t i = 0; i < 3; i++) {
+        STF_EXPECT(smq_publisher_publish(&publisher, messages[i], strlen(messages[i]) + 1) == 0);
+    }
+    STF_EXPECT(smq_subscriber_open(&late, "/shm-broadcast") == 0);
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < 3; j++) {
+            STF_EXPECT(smq_subscriber_receive(&subscribers[i], rec, sizeof(rec), 100) == (int)strlen(messages[j]) + 1);
+            STF_EXPECT(strcmp(rec, messages[j]) == 0, .failure_msg = "subscriber read messages out of order");
+        }
+        STF_EXPECT(smq_subscriber_receive(&subscribers[i], rec, sizeof(rec), 0) == -ETIMEDOUT);
+        STF_EXPECT(subscribers[i].lost == 0);
+        smq_subscriber_close(&subscribers[i]);
+    }
+    STF_EXPECT(smq_subscriber_receive(&late, rec, sizeof(rec), 0) == -ETIMEDOUT, .failure_msg = "late subscriber replayed old messages");
+    smq_subscriber_close(&late);
+    smq_publisher_destroy(&publisher);
+    STF_EXPECT(access("/dev/shm/shm-broadcast", F_OK) != 0);
+}
+
+STF_TEST_CASE(smq_channel_shm, lapped_subscriber_detects_overrun)
+{
+    static const uint32_t published = 10;
+    uint32_t value = 0;
+    const char oversized[sizeof(value) + 1] = { 0 };
+    smq_publisher publisher = { 0 };
+    smq_subscriber subscriber = { 0 };
+    STF_EXPECT(smq_publisher_create_with(&publisher, "/shm-broadcast", .slot_size = sizeof(value), .slot_count = 4) == 0);
+    STF_EXPECT(smq_subscriber_open(&subscriber, "/shm-broadcast") == 0);
+    for (uint32_t i = 0; i < published; i++) {
+        STF_EXPECT(smq_publisher_publish(&publisher, &i, sizeof(i)) == 0);
+    }
+    STF_EXPECT(smq_publisher_publish(&publisher, oversized, sizeof(oversized)) == -EMSGSIZE);
+    STF_EXPECT(smq_subscriber_receive(&subscriber, &value, sizeof(value), 100) == -EOVERFLOW);
+    STF_EXPECT(subscriber.lost == published - 3, .failure_msg = "expected every message but the newest three to be lost");
+    for (uint32_t i = published - 3; i < published; i++) {
+        STF_EXPECT(smq_subscriber_receive(&subscriber, &value, sizeof(value), 100) == (int)sizeof(value));
+        STF_EXPECT(value == i);
+    }
+    smq_subscriber_close(&subscriber);
+    smq_publisher_destroy(&publisher);
+}
+
+STF_TEST_CASE(smq_channel_shm, subscriber_skips_a_message_bigger_than_its_buffer)
+{
+    uint32_t value = 0;
+    const uint64_t wide = 1;
+    const uint32_t narrow = 2;
+    smq_publisher publisher = { 0 };
+    smq_subscriber subscriber = { 0 };
+    STF_EXPECT(smq_publisher_create_with(&publisher, "/shm-broadcast", .slot_size = sizeof(wide), .slot_count = 4) == 0);
+    STF_EXPECT(smq_subscriber_open(&subscriber, "/shm-broadcast") == 0);
+    STF_EXPECT(smq_publisher_publish(&publisher, &wide, sizeof(wide)) == 0);
+    STF_EXPECT(smq_publisher_publish(&publisher, &narrow, sizeof(narrow)) == 0);
+    STF_EXPECT(smq_subscriber_receive(&subscriber, &value, sizeof(value), 100) == -EMSGSIZE);
+    STF_EXPECT(smq_subscriber_receive(&subscriber, &value, sizeof(value), 100) == (int)sizeof(value), .failure_msg = "subscriber is stuck on the message it could not take");
+    STF_EXPECT(value == narrow && subscriber.lost == 0);
+    smq_subscriber_close(&subscriber);
+    smq_publisher_destroy(&publisher);
+}
+
+STF_TEST_CASE(smq_channel_shm, publisher_keeps_a_ring_it_does_not_own)
+{
+    const uint32_t value = 7;
+    uint32_t rec = 0;
+    smq_publisher publisher = { 0 };
+    smq_publisher rival = { 0 };
+    smq_publisher successor = { 0 };
+    smq_subscriber subscriber = { 0 };
+    STF_EXPECT(smq_publisher_create_with(&publisher, "/shm-broadcast", .slot_size = sizeof(value)) == 0);
+    STF_EXPECT(smq_publisher_create_with(&rival, "/shm-broadcast", .slot_size = sizeof(value)) == -EEXIST, .failure_msg = "live publisher's ring was replaced");
+    smq_publisher_destroy(&rival);
+    STF_EXPECT(smq_subscriber_open(&subscriber, "/shm-broadcast") == 0);
+    STF_EXPECT(smq_publisher_publish(&publisher, &value, sizeof(value)) == 0);
+    STF_EXPECT(smq_subscriber_receive(&subscriber, &rec, sizeof(rec), 100) == (int)sizeof(rec) && rec == value);
+    smq_subscriber_close(&subscriber);
+    // Once the path is taken over the old publisher must leave it alone.
+    shm_unlink("/shm-broadcast");
+    STF_EXPECT(smq_publisher_create_with(&successor, "/shm-broadcast", .slot_size = sizeof(value)) == 0);
+    smq_publisher_destroy(&publisher);
+    STF_EXPECT(access("/dev/shm/shm-broadcast", F_OK) == 0, .failure_msg = "destroy unlinked the successor's ring");
+    smq_publisher_destroy(&successor);
+    STF_EXPECT(access("/dev/shm/shm-broadcast", F_OK) != 0);
+}
+
+#define BROADCAST_SUBSCRIBER_COUNT 4
+#define BROADCAST_MESSAGE_COUNT 1000
+
+static void *broadcast_subscribe(void *arg)
+{
+    smq_subscriber *subscriber = arg;
+    uintptr_t received = 0;
+    uint32_t value = 0;
+    uint32_t expected = 0;
+    int res = 0;
+    while (expected < BROADCAST_MESSAGE_COUNT && (res = smq_subscriber_receive(subscriber, &value, sizeof(value), 1000)) != -ETIMEDOUT) {
+        if (res == -EOVERFLOW) {
+            expected = (uint32_t)subscriber->cursor;
+            continue;
+        }
+        if (res != (int)sizeof(value) || value != expected) {
+            break;
+        }
+        expected++;
+        received++;
+    }
+    return (void *)(received + subscriber->lost);
+}
+
+STF_TEST_CASE(smq_channel_shm, blocked_subscribers_wake_for_every_message)
+{
+    pthread_t threads[BROADCAST_SUBSCRIBER_COUNT];
+    smq_subscriber subscribers[BROADCAST_SUBSCRIBER_COUNT];
+    smq_publisher publisher = { 0 };
+    STF_EXPECT(smq_publisher_create_with(&publisher, "/shm-broadcast", .slot_size = sizeof(uint32_t), .slot_count = 16) == 0);
+    for (size_t i = 0; i < BROADCAST_SUBSCRIBER_COUNT; i++) {
+        STF_EXPECT(smq_subscriber_open(&subscribers[i], "/shm-broadcast") == 0);
+        STF_EXPECT(pthread_create(&threads[i], NULL, broadcast_subscribe, &subscribers[i]) == 0);
+    }
+    for (uint32_t i = 0; i < BROADCAST_MESSAGE_COUNT; i++) {
+        STF_EXPECT(smq_publisher_publish(&publisher, &i, sizeof(i)) == 0);
+        if (i % 8 == 0) sched_yield();
+    }
+    for (size_t i = 0; i < BROADCAST_SUBSCRIBER_COUNT; i++) {
+        void *accounted = NULL;
+        STF_EXPECT(pthread_join(threads[i], &accounted) == 0);
+        STF_EXPECT((uintptr_t)accounted == BROADCAST_MESSAGE_COUNT, .failure_msg = "subscriber neither read nor counted as lost some messages");
+        smq_subscriber_close(&subscribers[i]);
+    }
+    smq_publisher_destroy(&publisher);
+}
+
+STF_TEST_CASE(smq_channel_shm, slab_slots_are_reclaimed_once)
+{
+    static const size_t slot_count = 3;
+    smq_slab_descriptor descriptors[3];
+    smq_slab_descriptor spare = { 0 };
+    smq_slab slab = { 0 };
+    smq_slab mapping = { 0 };
+    STF_EXPECT(smq_slab_create_with(&slab, "/shm-slab", .slot_size = 4096, .slot_count = slot_count) == 0, .failure_msg = "failed to map slab");
+    STF_EXPECT(smq_slab_create_with(&mapping, "/shm-slab", .slot_size = 64) == 0);
+    STF_EXPECT(mapping.channel.maxmsgsize == 4096, .failure_msg = "second mapping should take the creator's geometry");
+    STF_EXPECT(smq_slab_alloc(&slab, 4097, &spare) == -EMSGSIZE);
+    for (size_t i = 0; i < slot_count; i++) {
+        STF_EXPECT(smq_slab_alloc(&slab, 100, &descriptors[i]) == 0);
+        memset(smq_slab_data(&slab, &descriptors[i]), (int)('a' + i), 100);
+    }
+    STF_EXPECT(smq_slab_alloc(&slab, 100, &spare) == -ENOSPC, .failure_msg = "slots past the count were handed out");
+    STF_EXPECT(((char *)smq_slab_data(&mapping, &descriptors[1]))[99] == 'b', .failure_msg = "both mappings should see the same slot");
+    STF_EXPECT(smq_slab_release(&mapping, &descriptors[1]) == 0);
+    STF_EXPECT(smq_slab_release(&slab, &descriptors[1]) == -ESTALE);
+    STF_EXPECT(smq_slab_data(&slab, &descriptors[1]) == NULL);
+    STF_EXPECT(smq_slab_alloc(&slab, 100, &spare) == 0);
+    STF_EXPECT(spare.offset == descriptors[1].offset && spare.generation != descriptors[1].generation);
+    smq_slab_close(&mapping);
+    smq_slab_destroy(&slab);
+    STF_EXPECT(access("/dev/shm/shm-slab", F_OK) != 0);
+}
+
+#define SLAB_BLOB_SIZE (4 * 1024 * 1024)
+
+static int span_handler_checksum(smq_request_view request, smq_response_span response)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < request.length; i++) {
+        sum += (unsigned char)request.data[i];
+    }
+    memcpy(response.data, &sum, sizeof(sum));
+    return (int)sizeof(sum);
+}
+
+STF_TEST_CASE(smq_channel_shm, large_request_travels_through_slab)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client client = { 0 };
+    smq_slab server_slab = { 0 };
+    smq_slab client_slab = { 0 };
+    smq_slab_descriptor descriptor;
+    smq_message request = { 0 };
+    smq_message response = { 0 };
+    uint32_t expected = 0;
+    uint32_t sum = 0;
+    char *blob = malloc(SLAB_BLOB_SIZE);
+    for (size_t i = 0; i < SLAB_BLOB_SIZE; i++) {
+        blob[i] = (char)(i * 7);
+        expected += (unsigned char)blob[i];
+    }
+    STF_EXPECT(smq_slab_create_with(&server_slab, "/shm-slab", .slot_size = SLAB_BLOB_SIZE, .slot_count = 2) == 0);
+    STF_EXPECT(smq_slab_create(&client_slab, "/shm-slab") == 0);
+    smq_server_create(&server, "/shm-server");
+    STF_EXPECT(smq_server_add_span_listener_with(&server, "-sum", span_handler_checksum, .max_payload = 64, .slab = &server_slab) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/shm-server-sum", .private_reply = true) == 0);
+    for (int round = 0; round < 4; round++) {
+        STF_EXPECT(smq_message_write_slab(&request, &client_slab, blob, SLAB_BLOB_SIZE) == 0);
+        STF_EXPECT(request.header.flags & SMQ_FLAG_OFFLOADED);
+        STF_EXPECT(smq_client_request(&client, &request, &response, .timeout_ms = 1500) == 0);
+        memcpy(&sum, response.payload, sizeof(sum));
+        STF_EXPECT(response.header.status == SMQ_STATUS_OK && sum == expected, .failure_msg = "handler did not see the offloaded payload");
+    }
+    STF_EXPECT(smq_message_write_slab(&request, &client_slab, "small", 6) == 0);
+    STF_EXPECT(!(request.header.flags & SMQ_FLAG_OFFLOADED), .failure_msg = "payloads under the threshold should stay inline");
+    STF_EXPECT(smq_client_request(&client, &request, &response, .timeout_ms = 1500) == 0);
+    memcpy(&sum, response.payload, sizeof(sum));
+    STF_EXPECT(sum == 's' + 'm' + 'a' + 'l' + 'l');
+    // Every slot must be back, four rounds through a two slot slab only work if the listener released them.
+    STF_EXPECT(smq_slab_alloc(&client_slab, 1, &descriptor) == 0);
+    STF_EXPECT(smq_slab_alloc(&client_slab, 1, &descriptor) == 0);
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+    smq_slab_close(&client_slab);
+    smq_slab_destroy(&server_slab);
+    free(blob);
+}
+
+int main(void)
+{
+    return STF_RUN_TESTS();
+}
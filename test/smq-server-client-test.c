@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
@@ -9,6 +10,7 @@
 #include <assert.h>
 #include <stf/stf.h>
 #include <sched.h>
+#include <ctype.h>
 #define SMQ_IMPL
 #include <smq/smq.h>
 
@@ -19,6 +21,13 @@ void handler_hello(smq_message *request, smq_message *response)
     memcpy(response->payload, msg, strlen(msg));
 }
 
+void handler_hello_sized(smq_message *request, smq_message *response)
+{
+    (void)request;
+    static const char *msg = "Hello!";
+    smq_message_write(response, msg, strlen(msg) + 1);
+}
+
 void handler_heya(smq_message *request, smq_message *response)
 {
     (void)request;
@@ -117,6 +126,906 @@ STF_TEST_CASE(smq_server_client, test_multiple_client_single_request)
     STF_EXPECT(pthread_join(server_handle, NULL) == 0);
 }
 
+STF_TEST_CASE(smq_server_client, test_response_carries_only_reported_length)
+{
+    pthread_t server_handle = 0;
+    smq_client client = { 0 };
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    smq_server server = { 0 };
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener(&server, "-hello", handler_hello_sized) == 0);
+    STF_EXPECT(smq_server_add_listener(&server, "-heya", handler_heya) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_create(&client, 1, "/server-hello") == 0);
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(smq_message_length(&server_response) == strlen("Hello!") + 1, .failure_msg = "response length is not the one the handler reported");
+    STF_EXPECT(smq_message_size(&server_response) < sizeof(server_response));
+    smq_client_destroy(&client);
+    memset(&server_response, 0x00, sizeof(server_response));
+    STF_EXPECT(smq_client_create(&client, 2, "/server-heya") == 0);
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(smq_message_length(&server_response) == SMQ_PAYLOAD_SIZE, .failure_msg = "handler without a length should ship the whole payload");
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+void handler_echo(smq_message *request, smq_message *response)
+{
+    smq_message_write(response, request->payload, smq_message_length(request));
+}
+
+#define PRIVATE_REPLY_CLIENT_COUNT 32
+#define PRIVATE_REPLY_REQUEST_COUNT 20
+
+void *private_reply_requests(void *args)
+{
+    const uint16_t id = (uint16_t)(uintptr_t)args;
+    smq_client client = { 0 };
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    uintptr_t mismatches = 0;
+    if (smq_client_create_with(&client, id, "/server-echo", .private_reply = true) != 0) {
+        return (void *)(uintptr_t)PRIVATE_REPLY_REQUEST_COUNT;
+    }
+    for (int i = 0; i < PRIVATE_REPLY_REQUEST_COUNT; i++) {
+        smq_message_set_length(&client_request, (size_t)snprintf(client_request.payload, sizeof(client_request.payload), "client %u request %d", (unsigned)id, i) + 1);
+        memset(&server_response, 0x00, sizeof(server_response));
+        if (smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) != 0
+            || strcmp(client_request.payload, server_response.payload) != 0) {
+            mismatches++;
+        }
+    }
+    smq_client_destroy(&client);
+    return (void *)mismatches;
+}
+
+STF_TEST_CASE(smq_server_client, test_private_reply_many_clients_no_requeue)
+{
+    pthread_t server_handle = 0;
+    pthread_t clients[PRIVATE_REPLY_CLIENT_COUNT];
+    smq_server server = { 0 };
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener(&server, "-echo", handler_echo) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    for (uintptr_t i = 0; i < PRIVATE_REPLY_CLIENT_COUNT; i++) {
+        STF_EXPECT(pthread_create(&clients[i], NULL, private_reply_requests, (void *)(i + 1)) == 0);
+    }
+    for (size_t j = 0; j < PRIVATE_REPLY_CLIENT_COUNT; j++) {
+        void *mismatches = NULL;
+        STF_EXPECT(pthread_join(clients[j], &mismatches) == 0);
+        STF_EXPECT((uintptr_t)mismatches == 0, .failure_msg = "client received a response that was not its own");
+    }
+    STF_EXPECT(smq_server_listener_requeued(server.listeners) == 0, .failure_msg = "listener re-sent messages it did not own");
+#ifdef SMQ_HAS_METRICS
+    smq_listener_stats stats;
+    STF_EXPECT(smq_server_stats_snapshot(&server, &stats, 1) == 1);
+    STF_EXPECT(stats.reply_opens == PRIVATE_REPLY_CLIENT_COUNT, .failure_msg = "listener reopened reply queues it already held");
+#endif
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+STF_TEST_CASE(smq_server_client, test_private_reply_id_is_taken_until_destroyed)
+{
+    pthread_t server_handle = 0;
+    smq_client client = { 0 };
+    smq_client thief = { 0 };
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    smq_server server = { 0 };
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener(&server, "-echo", handler_echo) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    smq_message_write(&client_request, "ping", 5);
+    STF_EXPECT(smq_client_create_with(&client, 7, "/server-echo", .private_reply = true) == 0);
+    STF_EXPECT(smq_client_create_with(&thief, 7, "/server-echo", .private_reply = true) == -EEXIST);
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(strcmp(server_response.payload, "ping") == 0, .failure_msg = "a live client lost its reply queue");
+    smq_client_destroy(&client);
+    // The listener still holds the old queue open, the new one must be told apart from it.
+    STF_EXPECT(smq_client_create_with(&client, 7, "/server-echo", .private_reply = true) == 0);
+    memset(&server_response, 0x00, sizeof(server_response));
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(strcmp(server_response.payload, "ping") == 0, .failure_msg = "reply went to the queue of the destroyed client");
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+STF_TEST_CASE(smq_server_client, test_stats_snapshot_counts_listener_traffic)
+{
+    pthread_t server_handle = 0;
+    smq_client client = { 0 };
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    smq_server server = { 0 };
+    smq_listener_stats stats[2];
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener(&server, "-echo", handler_echo) == 0);
+    STF_EXPECT(smq_server_add_listener(&server, "-hello", handler_hello) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-echo", .private_reply = true) == 0);
+    smq_message_write(&client_request, "ping", 4);
+    for (int i = 0; i < 5; i++) {
+        STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    }
+    smq_client_destroy(&client);
+    STF_EXPECT(smq_server_stats_snapshot(&server, stats, 1) == 2, .failure_msg = "snapshot should report every listener");
+    STF_EXPECT(smq_server_stats_snapshot(&server, stats, 2) == 2);
+    STF_EXPECT(strcmp(stats[0].path, "/server-echo") == 0);
+    STF_EXPECT(stats[0].queue_depth == 0);
+    STF_EXPECT(stats[1].requests == 0);
+#ifdef SMQ_HAS_METRICS
+    unsigned long handled = 0;
+    for (size_t i = 0; i < SMQ_METRICS_HISTOGRAM_BUCKETS; i++) {
+        handled += stats[0].handler_us[i];
+    }
+    STF_EXPECT(stats[0].requests == 5);
+    STF_EXPECT(stats[0].bytes_in == 20);
+    STF_EXPECT(stats[0].bytes_out == 20);
+    STF_EXPECT(handled == 5, .failure_msg = "every handler run should land in the histogram");
+    STF_EXPECT(smq_listener_stats_handler_percentile_us(&stats[0], 99.0) < 1000000);
+#endif// SMQ_HAS_METRICS
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+STF_TEST_CASE(smq_server_client, test_route_message_size_and_depth_are_configurable)
+{
+    pthread_t server_handle = 0;
+    smq_client client = { 0 };
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    smq_server server = { 0 };
+    smq_server_create_with(&server, "/server", .max_payload = 256, .queue_depth = 4);
+    STF_EXPECT(smq_server_add_listener(&server, "-echo", handler_echo) == 0);
+    STF_EXPECT(smq_server_add_listener_with(&server, "-hello", handler_hello_sized, .max_payload = 4, .queue_depth = 2) == 0);
+    STF_EXPECT(smq_server_add_listener_with(&server, "-deep", handler_echo, .queue_depth = 100000) == -EINVAL, .failure_msg = "queue deeper than the kernel allows should be refused");
+    STF_EXPECT(server.listeners->channel.maxmsgsize == (long)(SMQ_HEADER_SIZE + 256) && server.listeners->channel.maxmsgcount == 4);
+    STF_EXPECT(smq_server_listener_max_payload((smq_server_listener *)server.listeners->next) == 4);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-echo", .private_reply = true) == 0);
+    STF_EXPECT(client.reply.maxmsgsize == (long)(SMQ_HEADER_SIZE + 256), .failure_msg = "reply queue should follow the route message size");
+    smq_message_write(&client_request, "small", 6);
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(strcmp(server_response.payload, "small") == 0);
+    smq_message_set_length(&client_request, 512);
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) != 0, .failure_msg = "request bigger than the route should not be sent");
+    smq_client_destroy(&client);
+    STF_EXPECT(smq_client_create_with(&client, 2, "/server-hello", .private_reply = true) == 0);
+    memset(&server_response, 0x00, sizeof(server_response));
+    smq_message_set_length(&client_request, 0);
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(server_response.header.status == SMQ_STATUS_TOO_LARGE && smq_message_length(&server_response) == 0, .failure_msg = "oversized response should come back empty with a status");
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+void handler_slow(smq_message *request, smq_message *response)
+{
+    const struct timespec delay = { .tv_sec = 0, .tv_nsec = 50 * 1000000 };
+    nanosleep(&delay, NULL);
+    smq_message_write(response, request->payload, smq_message_length(request));
+}
+
+#define WORKER_POOL_CLIENT_COUNT 8
+
+static atomic_int slow_running;
+static atomic_int slow_most_running;
+
+// handler_slow that also records how many of its runs overlapped.
+void handler_slow_counted(smq_message *request, smq_message *response)
+{
+    const int running = atomic_fetch_add(&slow_running, 1) + 1;
+    int most = atomic_load(&slow_most_running);
+    while (running > most && !atomic_compare_exchange_weak(&slow_most_running, &most, running)) {
+    }
+    handler_slow(request, response);
+    atomic_fetch_sub(&slow_running, 1);
+}
+
+void *slow_request(void *args)
+{
+    const uint16_t id = (uint16_t)(uintptr_t)args;
+    smq_client client = { 0 };
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    uintptr_t failed = 1;
+    if (smq_client_create_with(&client, id, "/server-slow", .private_reply = true) != 0) {
+        return (void *)failed;
+    }
+    smq_message_set_length(&client_request, (size_t)snprintf(client_request.payload, sizeof(client_request.payload), "client %u", (unsigned)id) + 1);
+    if (smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0) {
+        failed = strcmp(client_request.payload, server_response.payload) != 0;
+    }
+    smq_client_destroy(&client);
+    return (void *)failed;
+}
+
+STF_TEST_CASE(smq_server_client, test_worker_pool_handles_requests_concurrently)
+{
+    pthread_t server_handle = 0;
+    pthread_t clients[WORKER_POOL_CLIENT_COUNT];
+    smq_server server = { 0 };
+    atomic_store(&slow_most_running, 0);
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener_with(&server, "-slow", handler_slow_counted, .workers = 4) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    for (uintptr_t i = 0; i < WORKER_POOL_CLIENT_COUNT; i++) {
+        STF_EXPECT(pthread_create(&clients[i], NULL, slow_request, (void *)(i + 1)) == 0);
+    }
+    for (size_t j = 0; j < WORKER_POOL_CLIENT_COUNT; j++) {
+        void *failed = NULL;
+        STF_EXPECT(pthread_join(clients[j], &failed) == 0);
+        STF_EXPECT((uintptr_t)failed == 0, .failure_msg = "worker returned an unexpected response");
+    }
+    STF_EXPECT(atomic_load(&slow_most_running) > 1, .failure_msg = "requests were not handled concurrently");
+    STF_EXPECT(atomic_load(&slow_most_running) <= 4, .failure_msg = "more handlers ran at once than there are workers");
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+static size_t thread_count(void)
+{
+    size_t count = 0;
+    char line[256];
+    FILE *status = fopen("/proc/self/status", "r");
+    while (status != NULL && fgets(line, sizeof(line), status) != NULL) {
+        if (sscanf(line, "Threads: %zu", &count) == 1) break;
+    }
+    if (status != NULL) fclose(status);
+    return count;
+}
+
+STF_TEST_CASE(smq_server_client, test_reactor_serves_all_routes_from_one_thread)
+{
+    static const char *routes[] = { "-r0", "-r1", "-r2", "-r3", "-r4", "-r5" };
+    static const size_t route_count = sizeof(routes) / sizeof(routes[0]);
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    char path[64];
+    smq_server_create_with(&server, "/server", .reactor_threads = 1);
+    for (size_t i = 0; i < route_count; i++) {
+        STF_EXPECT(smq_server_add_listener(&server, routes[i], handler_echo) == 0);
+    }
+    const size_t threads_before = thread_count();
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_server_ready(&server, 1500));
+    STF_EXPECT(thread_count() < threads_before + route_count, .failure_msg = "reactor server should not need a thread per route");
+    for (size_t i = 0; i < route_count; i++) {
+        smq_client client = { 0 };
+        smq_message client_request = { 0 };
+        smq_message server_response = { 0 };
+        snprintf(path, sizeof(path), "/server%s", routes[i]);
+        STF_EXPECT(smq_client_create_with(&client, (uint16_t)(i + 1), path, .private_reply = true) == 0);
+        smq_message_write(&client_request, routes[i], strlen(routes[i]) + 1);
+        STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+        STF_EXPECT(strcmp(server_response.payload, routes[i]) == 0, .failure_msg = "reactor answered from the wrong route");
+        smq_client_destroy(&client);
+    }
+    // epoll_wait has no timeout, stop only returns once the reactor was woken and left.
+    smq_server_stop(&server);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+void handler_reverse_delay(smq_message *request, smq_message *response)
+{
+    // Earlier requests sleep longer, so responses come back in the opposite order.
+    const struct timespec delay = { .tv_sec = 0, .tv_nsec = (8 - (request->payload[0] - '0')) * 10 * 1000000L };
+    nanosleep(&delay, NULL);
+    smq_message_write(response, request->payload, smq_message_length(request));
+}
+
+#define PIPELINE_DEPTH 8
+
+STF_TEST_CASE(smq_server_client, test_async_client_matches_out_of_order_responses)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client client = { 0 };
+    smq_message requests[PIPELINE_DEPTH] = { 0 };
+    smq_message responses[PIPELINE_DEPTH] = { 0 };
+    smq_request_id ids[PIPELINE_DEPTH] = { 0 };
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener_with(&server, "-async", handler_reverse_delay, .workers = PIPELINE_DEPTH) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-async", .max_inflight = PIPELINE_DEPTH) == 0);
+    for (int i = 0; i < PIPELINE_DEPTH; i++) {
+        smq_message_set_length(&requests[i], (size_t)snprintf(requests[i].payload, sizeof(requests[i].payload), "%d request", i) + 1);
+        STF_EXPECT(smq_client_submit(&client, &requests[i], &responses[i], &ids[i], .timeout_ms = 500) == 0);
+    }
+    for (int i = 0; i < PIPELINE_DEPTH; i++) {
+        STF_EXPECT(smq_client_wait(&client, ids[i], 1500) == 0);
+        STF_EXPECT(strcmp(requests[i].payload, responses[i].payload) == 0, .failure_msg = "response matched to the wrong request");
+        STF_EXPECT(responses[i].header.seq == ids[i]);
+    }
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+void count_completion(smq_message *response, void *userdata)
+{
+    (void)response;
+    (*(int *)userdata)++;
+}
+
+STF_TEST_CASE(smq_server_client, test_async_client_cancels_a_timed_out_request)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client client = { 0 };
+    smq_message requests[2] = { 0 };
+    smq_message responses[2] = { 0 };
+    smq_request_id ids[2] = { 0 };
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener_with(&server, "-slow", handler_slow, .max_payload = 64) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-slow", .max_inflight = 1) == 0);
+    smq_message_write(&requests[0], "first", 6);
+    smq_message_write(&requests[1], "second", 7);
+    STF_EXPECT(smq_client_submit(&client, &requests[0], &responses[0], &ids[0], .timeout_ms = 500) == 0);
+    STF_EXPECT(smq_client_wait(&client, ids[0], 0) == -ETIMEDOUT, .failure_msg = "a zero timeout should only look at what is queued");
+    STF_EXPECT(smq_client_submit(&client, &requests[1], &responses[1], &ids[1], .timeout_ms = 500) == -EAGAIN);
+    STF_EXPECT(smq_client_cancel(&client, ids[0]) == 0);
+    STF_EXPECT(smq_client_cancel(&client, ids[0]) == -ENOENT);
+    STF_EXPECT(client.pending == 0);
+    // The cancelled request is still answered, that response must not complete the next one.
+    STF_EXPECT(smq_client_submit(&client, &requests[1], &responses[1], &ids[1], .timeout_ms = 500) == 0);
+    STF_EXPECT(smq_client_wait(&client, ids[1], 1500) == 0);
+    STF_EXPECT(strcmp(responses[1].payload, "second") == 0, .failure_msg = "response of the cancelled request was delivered");
+    STF_EXPECT(responses[0].payload[0] == 0);
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+STF_TEST_CASE(smq_server_client, test_async_client_callbacks_from_poll)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client client = { 0 };
+    smq_message request = { 0 };
+    smq_message responses[4] = { 0 };
+    smq_request_id id = 0;
+    int completed = 0;
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener(&server, "-echo", handler_echo) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-echo", .max_inflight = 4) == 0);
+    smq_message_write(&request, "ping", 5);
+    for (int i = 0; i < 4; i++) {
+        STF_EXPECT(smq_client_submit(&client, &request, &responses[i], &id, .callback = count_completion, .userdata = &completed) == 0);
+    }
+    const long deadline_ms = smq_timestamp_ms() + 1500;
+    while (completed < 4 && smq_timestamp_ms() < deadline_ms) {
+        STF_EXPECT(smq_client_poll(&client) >= 0);
+        sched_yield();
+    }
+    STF_EXPECT(completed == 4, .failure_msg = "not every callback ran");
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+#define LANE_BULK_COUNT 8
+#define LANE_CONTROL_COUNT 3
+
+static char lane_order[LANE_BULK_COUNT + LANE_CONTROL_COUNT + 1];
+static size_t lane_handled = 0;
+
+void handler_record_lane(smq_message *request, smq_message *response)
+{
+    if (lane_handled < LANE_BULK_COUNT + LANE_CONTROL_COUNT) {
+        lane_order[lane_handled++] = request->payload[0];
+    }
+    smq_message_write(response, request->payload, smq_message_length(request));
+}
+
+STF_TEST_CASE(smq_server_client, test_priority_lanes_interleave_by_weight)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client bulk = { 0 };
+    smq_client control = { 0 };
+    smq_message requests[LANE_BULK_COUNT + LANE_CONTROL_COUNT] = { 0 };
+    smq_message responses[LANE_BULK_COUNT + LANE_CONTROL_COUNT] = { 0 };
+    smq_request_id ids[LANE_BULK_COUNT + LANE_CONTROL_COUNT] = { 0 };
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener_with(&server, "-lanes", handler_record_lane, .max_payload = 64, .lanes = 2, .lane_weights = { 2, 1 }) == 0);
+    STF_EXPECT(smq_client_create_with(&bulk, 1, "/server-lanes", .lane = 1, .max_inflight = LANE_BULK_COUNT) == 0);
+    STF_EXPECT(smq_client_create_with(&control, 2, "/server-lanes", .max_inflight = 4) == 0);
+    // Everything is queued before the server starts, bulk first, so a single FIFO would serve all of it ahead of control.
+    for (size_t i = 0; i < LANE_BULK_COUNT + LANE_CONTROL_COUNT; i++) {
+        smq_client *client = i < LANE_BULK_COUNT ? &bulk : &control;
+        smq_message_write(&requests[i], i < LANE_BULK_COUNT ? "b" : "c", 2);
+        STF_EXPECT(smq_client_submit(client, &requests[i], &responses[i], &ids[i], .timeout_ms = 500) == 0);
+    }
+    smq_server_start_non_blocking(&server_handle, &server);
+    for (size_t i = 0; i < LANE_BULK_COUNT + LANE_CONTROL_COUNT; i++) {
+        STF_EXPECT(smq_client_wait(i < LANE_BULK_COUNT ? &bulk : &control, ids[i], 1500) == 0);
+    }
+    // The exact interleaving depends on when the listener wakes up, the heavier lane only has to get the larger share.
+    size_t control_early = 0;
+    for (size_t i = 0; i < 2 * LANE_CONTROL_COUNT; i++) {
+        control_early += lane_order[i] == 'c';
+    }
+    STF_EXPECT(lane_handled == LANE_BULK_COUNT + LANE_CONTROL_COUNT);
+    STF_EXPECT(control_early == LANE_CONTROL_COUNT, .failure_msg = "lane with weight 2 should get at least half the turns while both lanes wait");
+    smq_client_destroy(&bulk);
+    smq_client_destroy(&control);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+STF_TEST_CASE(smq_server_client, test_expired_requests_skip_the_handler)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client client = { 0 };
+    smq_message requests[3] = { 0 };
+    smq_message responses[3] = { 0 };
+    smq_request_id ids[3] = { 0 };
+    smq_listener_stats stats = { 0 };
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener_with(&server, "-slow", handler_slow, .max_payload = 64) == 0);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-slow", .max_inflight = 4) == 0);
+    for (int i = 0; i < 3; i++) {
+        smq_message_write(&requests[i], "late", 5);
+        // The first request keeps the handler busy for 50 ms, the other two are only worth answering within 20 ms.
+        STF_EXPECT(smq_client_submit(&client, &requests[i], &responses[i], &ids[i], .timeout_ms = 500, .ttl_ms = i == 0 ? 0 : 20) == 0);
+    }
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_wait(&client, ids[0], 1500) == 0);
+    for (int i = 1; i < 3; i++) {
+        STF_EXPECT(smq_client_wait(&client, ids[i], 1500) == 0, .failure_msg = "an expired request should still end");
+        STF_EXPECT(responses[i].header.status == SMQ_STATUS_EXPIRED && smq_message_length(&responses[i]) == 0);
+    }
+    STF_EXPECT(client.pending == 0, .failure_msg = "expired requests should give their slots back");
+#ifdef SMQ_HAS_METRICS
+    const long give_up_ms = smq_timestamp_ms() + 1500;
+    do {
+        smq_server_stats_snapshot(&server, &stats, 1);
+    } while (stats.expired < 2 && smq_timestamp_ms() < give_up_ms && sched_yield() == 0);
+    STF_EXPECT(stats.requests == 1 && stats.expired == 2, .failure_msg = "expired requests should be dropped before the handler");
+#else
+    (void)stats;
+#endif// SMQ_HAS_METRICS
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+STF_TEST_CASE(smq_server_client, test_deep_queue_is_shed_with_overloaded_status)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client client = { 0 };
+    smq_message requests[4] = { 0 };
+    smq_message responses[4] = { 0 };
+    smq_request_id ids[4] = { 0 };
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener_with(&server, "-shed", handler_echo, .max_payload = 64, .batch_size = 1, .shed_queue_depth = 2) == 0);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-shed", .max_inflight = 4) == 0);
+    for (int i = 0; i < 4; i++) {
+        smq_message_write(&requests[i], "work", 5);
+        STF_EXPECT(smq_client_submit(&client, &requests[i], &responses[i], &ids[i], .timeout_ms = 500) == 0);
+    }
+    smq_server_start_non_blocking(&server_handle, &server);
+    for (int i = 0; i < 4; i++) {
+        STF_EXPECT(smq_client_wait(&client, ids[i], 1500) == 0);
+    }
+    // One request is taken per wakeup, the first two see 3 and 2 still waiting.
+    STF_EXPECT(responses[0].header.status == SMQ_STATUS_OVERLOADED && smq_message_length(&responses[0]) == 0);
+    STF_EXPECT(responses[1].header.status == SMQ_STATUS_OVERLOADED);
+    STF_EXPECT(responses[2].header.status == SMQ_STATUS_OK && strcmp(responses[2].payload, "work") == 0);
+    STF_EXPECT(responses[3].header.status == SMQ_STATUS_OK && strcmp(responses[3].payload, "work") == 0);
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+static int lookups_handled = 0;
+
+void handler_lookup(smq_message *request, smq_message *response)
+{
+    lookups_handled++;
+    smq_message_set_length(response, (size_t)snprintf(response->payload, 64, "value of %s", request->payload) + 1);
+}
+
+STF_TEST_CASE(smq_server_client, test_response_cache_bypasses_handler_until_ttl)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client client = { 0 };
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    smq_listener_stats stats = { 0 };
+    // The hits only need to land within the ttl, keep it far above a few round trips on a busy machine.
+    const struct timespec past_ttl = { .tv_sec = 0, .tv_nsec = 600 * 1000000 };
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener_with(&server, "-lookup", handler_lookup, .max_payload = 128, .cache_entries = 16, .cache_ttl_ms = 300) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-lookup", .private_reply = true) == 0);
+    for (int i = 0; i < 3; i++) {
+        smq_message_write(&client_request, "key-a", 6);
+        STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+        STF_EXPECT(strcmp(server_response.payload, "value of key-a") == 0, .failure_msg = "cached response differs from the handler's");
+    }
+    STF_EXPECT(lookups_handled == 1, .failure_msg = "repeated request should be answered from the cache");
+    smq_message_write(&client_request, "key-b", 6);
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(strcmp(server_response.payload, "value of key-b") == 0 && lookups_handled == 2);
+    nanosleep(&past_ttl, NULL);
+    smq_message_write(&client_request, "key-a", 6);
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(lookups_handled == 3, .failure_msg = "expired entry should run the handler again");
+    smq_server_stats_snapshot(&server, &stats, 1);
+#ifdef SMQ_HAS_METRICS
+    STF_EXPECT(stats.cache_hits == 2 && stats.cache_misses == 3);
+#endif// SMQ_HAS_METRICS
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+#define STATUS_NOT_FOUND (SMQ_STATUS_USER + 4)
+
+int span_handler_upper(smq_request_view request, smq_response_span response)
+{
+    if (request.length == 0) {
+        return -STATUS_NOT_FOUND;
+    }
+    if (request.length > response.capacity) {
+        return -SMQ_STATUS_TOO_LARGE;
+    }
+    if (request.length == 5 && memcmp(request.data, "over", 5) == 0) {
+        return SMQ_PAYLOAD_SIZE + 1;// claims more than any response holds
+    }
+    for (size_t i = 0; i < request.length; i++) {
+        response.data[i] = (char)toupper((unsigned char)request.data[i]);
+    }
+    return (int)request.length;
+}
+
+STF_TEST_CASE(smq_server_client, test_span_handler_reports_length_and_status)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client client = { 0 };
+    smq_client full_client = { 0 };
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_span_listener_with(&server, "-upper", span_handler_upper, .max_payload = 32, .workers = 2) == 0);
+    STF_EXPECT(smq_server_add_span_listener(&server, "-upper-full", span_handler_upper) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-upper", .private_reply = true) == 0);
+    STF_EXPECT(smq_client_create_with(&full_client, 1, "/server-upper-full", .private_reply = true) == 0);
+    smq_message_write(&client_request, "span", 5);
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(smq_message_length(&server_response) == 5 && strcmp(server_response.payload, "SPAN") == 0);
+    STF_EXPECT(server_response.header.status == SMQ_STATUS_OK);
+    smq_message_set_length(&client_request, 0);
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(server_response.header.status == STATUS_NOT_FOUND && smq_message_length(&server_response) == 0, .failure_msg = "negative return should become the response status");
+    // On a full sized response the overlong length would otherwise be clamped to the payload and sent as OK.
+    smq_message_write(&client_request, "over", 5);
+    STF_EXPECT(smq_client_request(&full_client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(server_response.header.status == SMQ_STATUS_TOO_LARGE && smq_message_length(&server_response) == 0, .failure_msg = "span length past the capacity should be refused");
+    smq_client_destroy(&full_client);
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+#define CLIENT_POOL_SIZE 4
+#define CLIENT_POOL_THREAD_COUNT 8
+#define CLIENT_POOL_REQUEST_COUNT 20
+
+void *client_pool_requests(void *args)
+{
+    smq_client_pool *pool = args;
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    uintptr_t mismatches = 0;
+    for (int i = 0; i < CLIENT_POOL_REQUEST_COUNT; i++) {
+        smq_client *client = NULL;
+        while ((client = smq_client_pool_checkout(pool)) == NULL) {
+            sched_yield();
+        }
+        smq_message_set_length(&client_request, (size_t)snprintf(client_request.payload, sizeof(client_request.payload), "thread %p request %d", (void *)&client_request, i) + 1);
+        memset(&server_response, 0x00, sizeof(server_response));
+        if (smq_client_request(client, &client_request, &server_response, .timeout_ms = 1500) != 0
+            || strcmp(client_request.payload, server_response.payload) != 0) {
+            mismatches++;
+        }
+        smq_client_pool_return(pool, client);
+    }
+    return (void *)mismatches;
+}
+
+STF_TEST_CASE(smq_server_client, test_client_pool_shares_clients_across_threads)
+{
+    pthread_t server_handle = 0;
+    pthread_t threads[CLIENT_POOL_THREAD_COUNT];
+    smq_server server = { 0 };
+    smq_client_pool pool = { 0 };
+    smq_client_pool other = { 0 };
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener(&server, "-echo", handler_echo) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_pool_create_with(&pool, "/server-echo", .clients = CLIENT_POOL_SIZE) == 0);
+    STF_EXPECT(smq_client_pool_create_with(&other, "/server-echo", .clients = 2) == 0);
+    for (size_t i = 0; i < CLIENT_POOL_SIZE; i++) {
+        for (size_t j = 0; j < CLIENT_POOL_SIZE; j++) {
+            STF_EXPECT(i == j || pool.clients[i].id != pool.clients[j].id);
+        }
+        STF_EXPECT(pool.clients[i].id != other.clients[0].id && pool.clients[i].id != other.clients[1].id, .failure_msg = "two pools on one route claimed the same id");
+    }
+    for (size_t i = 0; i < CLIENT_POOL_THREAD_COUNT; i++) {
+        STF_EXPECT(pthread_create(&threads[i], NULL, client_pool_requests, &pool) == 0);
+    }
+    for (size_t i = 0; i < CLIENT_POOL_THREAD_COUNT; i++) {
+        void *mismatches = NULL;
+        STF_EXPECT(pthread_join(threads[i], &mismatches) == 0);
+        STF_EXPECT((uintptr_t)mismatches == 0, .failure_msg = "pooled client received a response that was not its own");
+    }
+    STF_EXPECT(smq_server_listener_requeued(server.listeners) == 0);
+    smq_client_pool_destroy(&other);
+    smq_client_pool_destroy(&pool);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+STF_TEST_CASE(smq_server_client, test_busy_polling_client_and_listener)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client client = { 0 };
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    smq_server_create_with(&server, "/server", .reactor_threads = 1);
+    STF_EXPECT(smq_server_add_listener_with(&server, "-echo", handler_echo, .max_payload = 64, .busy_poll_us = 100) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-echo", .busy_poll_us = 100) == 0);
+    STF_EXPECT(client.busy_poll != NULL && client.reply.desc != (mqd_t)-1, .failure_msg = "busy polling clients need a private reply queue");
+    for (int i = 0; i < 50; i++) {
+        smq_message_set_length(&client_request, (size_t)snprintf(client_request.payload, 64, "spin %d", i) + 1);
+        STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+        STF_EXPECT(strcmp(client_request.payload, server_response.payload) == 0);
+    }
+    STF_EXPECT(server.listeners->thread != 0, .failure_msg = "busy polling listeners must not share a reactor thread");
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+#ifdef SMQ_HAS_AFFINITY
+#define PLACED_STACK_SIZE (512 * 1024)
+
+// Reports the stack size of the thread it runs on and whether that thread may only run on CPU 0.
+void handler_thread_placement(smq_message *request, smq_message *response)
+{
+    (void)request;
+    pthread_attr_t attr;
+    cpu_set_t set;
+    size_t stack_size = 0;
+    int pinned = 0;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        pthread_attr_getstacksize(&attr, &stack_size);
+        pthread_attr_destroy(&attr);
+    }
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+        pinned = CPU_COUNT(&set) == 1 && CPU_ISSET(0, &set);
+    }
+    smq_message_set_length(response, (size_t)snprintf(response->payload, smq_message_length(response), "%zu %d", stack_size, pinned) + 1);
+}
+
+STF_TEST_CASE(smq_server_client, test_threads_are_pinned_with_requested_stack)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client client = { 0 };
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    size_t stack_size = 0;
+    int pinned = 0;
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener_with(&server, "-first", handler_thread_placement, .max_payload = 64) == 0);
+    STF_EXPECT(smq_server_add_listener_with(&server, "-placed", handler_thread_placement, .max_payload = 64, .workers = 2,
+                   .thread = { .cpus = 1 }, .worker_thread = { .cpus = 1, .stack_size = PLACED_STACK_SIZE })
+        == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-placed", .private_reply = true) == 0);
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(sscanf(server_response.payload, "%zu %d", &stack_size, &pinned) == 2);
+    STF_EXPECT(stack_size == PLACED_STACK_SIZE, .failure_msg = "worker did not get the requested stack size");
+    STF_EXPECT(pinned == 1, .failure_msg = "worker is not pinned to CPU 0");
+    STF_EXPECT(((smq_server_listener *)server.listeners->next)->pool.arena != NULL, .failure_msg = "pinned listener should allocate its own buffers");
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+#endif// SMQ_HAS_AFFINITY
+
+static size_t largest_batch = 0;
+
+void handler_echo_batch(smq_message **requests, smq_message **responses, size_t count)
+{
+    largest_batch = count > largest_batch ? count : largest_batch;
+    for (size_t i = 0; i < count; i++) {
+        smq_message_write(responses[i], requests[i]->payload, smq_message_length(requests[i]));
+    }
+}
+
+STF_TEST_CASE(smq_server_client, test_batch_handler_gathers_pending_requests)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client client = { 0 };
+    smq_message requests[PIPELINE_DEPTH] = { 0 };
+    smq_message responses[PIPELINE_DEPTH] = { 0 };
+    smq_request_id ids[PIPELINE_DEPTH] = { 0 };
+    smq_listener_stats stats = { 0 };
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_batch_listener_with(&server, "-batch", handler_echo_batch, .workers = 2) == -EINVAL, .failure_msg = "batch handlers cannot use workers");
+    STF_EXPECT(smq_server_add_batch_listener_with(&server, "-batch", handler_echo_batch, .max_payload = 64, .batch_size = PIPELINE_DEPTH, .batch_delay_us = 200000) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-batch", .max_inflight = PIPELINE_DEPTH) == 0);
+    for (int i = 0; i < PIPELINE_DEPTH; i++) {
+        smq_message_set_length(&requests[i], (size_t)snprintf(requests[i].payload, 64, "%d batched", i) + 1);
+        STF_EXPECT(smq_client_submit(&client, &requests[i], &responses[i], &ids[i], .timeout_ms = 1500) == 0);
+    }
+    for (int i = 0; i < PIPELINE_DEPTH; i++) {
+        STF_EXPECT(smq_client_wait(&client, ids[i], 1500) == 0);
+        STF_EXPECT(strcmp(requests[i].payload, responses[i].payload) == 0, .failure_msg = "batch response matched to the wrong request");
+    }
+    STF_EXPECT(largest_batch > 1, .failure_msg = "pending requests were not gathered into one handler call");
+    STF_EXPECT(smq_server_stats_snapshot(&server, &stats, 1) == 1 && stats.requests == PIPELINE_DEPTH);
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+STF_TEST_CASE(smq_server_client, test_codec_route_carries_more_than_its_payload)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client client = { 0 };
+    smq_client plain = { 0 };
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    size_t length = 0;
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener_with(&server, "-json", handler_echo, .max_payload = 512, .codec = smq_codec_lz()) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-json", .private_reply = true, .codec = smq_codec_lz()) == 0);
+    for (int i = 0; length + 64 < 2048; i++) {
+        length += (size_t)snprintf(&client_request.payload[length], 2048 - length, "{\"id\":%d,\"status\":\"ok\"},", i);
+    }
+    smq_message_set_length(&client_request, length);// only fits the 512 byte route compressed, both ways
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(server_response.header.status == SMQ_STATUS_OK && smq_message_length(&server_response) == length);
+    STF_EXPECT(memcmp(client_request.payload, server_response.payload, length) == 0, .failure_msg = "payload changed on its way through the codec");
+    STF_EXPECT(!(server_response.header.flags & SMQ_FLAG_COMPRESSED));
+    STF_EXPECT(smq_client_create_with(&plain, 2, "/server-json", .private_reply = true) == 0);
+    smq_message_set_length(&client_request, 400);
+    STF_EXPECT(smq_client_request(&plain, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(smq_message_length(&server_response) == 400 && !(server_response.header.flags & SMQ_FLAG_COMPRESSED), .failure_msg = "clients without a codec must get plain responses");
+    smq_client_destroy(&plain);
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+void handler_route_upper(smq_message *request, smq_message *response)
+{
+    const size_t length = smq_message_length(request);
+    for (size_t i = 0; i < length; i++) {
+        response->payload[i] = (char)toupper((unsigned char)request->payload[i]);
+    }
+    smq_message_set_length(response, length);
+}
+
+int handler_route_length(smq_request_view request, smq_response_span response)
+{
+    return snprintf(response.data, response.capacity, "%zu", request.length) + 1;
+}
+
+STF_TEST_CASE(smq_server_client, test_router_dispatches_many_routes_from_one_queue)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client client = { 0 };
+    smq_client upper = { 0 };
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_router_with(&server, "-rpc", .max_payload = 64) == 0);
+    STF_EXPECT(smq_server_add_route(&server, "-rpc", 1, handler_echo) == 0);
+    STF_EXPECT(smq_server_add_route(&server, "-rpc", 2, handler_route_upper) == 0);
+    STF_EXPECT(smq_server_add_span_route(&server, "-rpc", 300, handler_route_length) == 0);
+    STF_EXPECT(smq_server_add_route(&server, "-rpc", 2, handler_echo) == -EEXIST);
+    STF_EXPECT(smq_server_add_route(&server, "-rpc", 0, handler_echo) == -EINVAL);
+    STF_EXPECT(smq_server_add_route(&server, "-rpc", SMQ_MAX_ROUTE_ID + 1, handler_echo) == -EINVAL, .failure_msg = "ids past SMQ_MAX_ROUTE_ID would blow up the dispatch table");
+    STF_EXPECT(smq_server_add_router_with(&server, "-cached", .max_payload = 64, .cache_entries = 16) == -EINVAL, .failure_msg = "a router cannot share one cache between routes");
+    STF_EXPECT(smq_server_add_route(&server, "-nothing", 3, handler_echo) == -ENOENT);
+    smq_server_start_non_blocking(&server_handle, &server);
+    while (!smq_server_is_running(&server)) {
+        sched_yield();
+    }
+    STF_EXPECT(smq_server_add_route(&server, "-rpc", 4, handler_echo) == -EBUSY, .failure_msg = "routes cannot be added once the table is built");
+    STF_EXPECT(server.listeners->next == NULL && server.listeners->route_table_size == 301);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-rpc", .private_reply = true) == 0);
+    smq_message_set_length(&client_request, (size_t)snprintf(client_request.payload, 64, "routed") + 1);
+    client_request.header.route = 1;
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(strcmp(server_response.payload, "routed") == 0 && server_response.header.route == 1);
+    client_request.header.route = 300;
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(strcmp(server_response.payload, "7") == 0, .failure_msg = "span route should report the request length");
+    client_request.header.route = 7;
+    STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(server_response.header.status == SMQ_STATUS_NO_ROUTE && smq_message_length(&server_response) == 0);
+    STF_EXPECT(smq_client_create_with(&upper, 2, "/server-rpc", .private_reply = true, .route = 2) == 0);
+    STF_EXPECT(smq_client_request(&upper, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    STF_EXPECT(strcmp(server_response.payload, "ROUTED") == 0, .failure_msg = "client route should override the request's");
+    smq_client_destroy(&upper);
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+
+#ifdef SMQ_HAS_TRACING
+STF_TEST_CASE(smq_server_client, test_sampled_requests_are_traced_end_to_end)
+{
+    pthread_t server_handle = 0;
+    smq_server server = { 0 };
+    smq_client client = { 0 };
+    smq_message client_request = { 0 };
+    smq_message server_response = { 0 };
+    const char *path = "/tmp/smq-trace-test.json";
+    char dump[8192] = { 0 };
+    FILE *file = NULL;
+    smq_server_create(&server, "/server");
+    STF_EXPECT(smq_server_add_listener_with(&server, "-echo", handler_echo, .max_payload = 64) == 0);
+    smq_server_start_non_blocking(&server_handle, &server);
+    STF_EXPECT(smq_client_create_with(&client, 1, "/server-echo", .private_reply = true) == 0);
+    smq_trace_start_with(.sample_every = 2, .ring_events = 64);
+    for (int i = 0; i < 4; i++) {
+        smq_message_set_length(&client_request, (size_t)snprintf(client_request.payload, 64, "trace %d", i) + 1);
+        STF_EXPECT(smq_client_request(&client, &client_request, &server_response, .timeout_ms = 1500) == 0);
+    }
+    smq_trace_stop();
+    STF_EXPECT(smq_trace_dump(path) == 12, .failure_msg = "two sampled requests should record six points each");
+    STF_EXPECT((file = fopen(path, "r")) != NULL);
+    STF_EXPECT(fread(dump, 1, sizeof(dump) - 1, file) > 0);
+    fclose(file);
+    unlink(path);
+    STF_EXPECT(strncmp(dump, "{\"traceEvents\":[", 16) == 0);
+    STF_EXPECT(strstr(dump, "\"name\":\"request\",\"cat\":\"smq\",\"ph\":\"b\"") != NULL && strstr(dump, "\"ph\":\"e\"") != NULL);
+    STF_EXPECT(strstr(dump, "\"name\":\"handler\",\"cat\":\"smq\",\"ph\":\"B\"") != NULL && strstr(dump, "\"name\":\"response_sent\"") != NULL);
+    // Chrome pairs async spans by id, every request needs its own even without .max_inflight.
+    const char *first = strstr(dump, "\"ph\":\"b\"");
+    const char *second = first != NULL ? strstr(first + 1, "\"ph\":\"b\"") : NULL;
+    STF_EXPECT(first != NULL && second != NULL);
+    if (first != NULL && second != NULL) {
+        first = strstr(first, "\"id\":\"");
+        second = strstr(second, "\"id\":\"");
+        STF_EXPECT(first != NULL && second != NULL && strncmp(first, second, (size_t)(strchr(first + 6, '"') - first) + 1) != 0, .failure_msg = "two requests share a span id");
+        STF_EXPECT(strstr(dump, "\"id\":\"1:0\"") == NULL);
+    }
+    smq_client_destroy(&client);
+    smq_server_destroy(&server);
+    STF_EXPECT(pthread_join(server_handle, NULL) == 0);
+}
+#endif// SMQ_HAS_TRACING
+
 int main(int argc, const char *argv[])
 {
     (void)argc;
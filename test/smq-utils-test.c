@@ -1,4 +1,6 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <stf/stf.h>
 #define SMQ_IMPL
 #include <smq/smq.h>
@@ -38,6 +40,126 @@ STF_TEST_CASE(smq_utils, abs_timeout_addition_1ms_match)
     STF_EXPECT(smq_timespec_to_timestamp_ms(&now_offset) - smq_timespec_to_timestamp_ms(&now_org) == ms_offset, .failure_msg = "difference between abs timeout and smq_time_now() is not as expected");
 }
 
+STF_TEST_CASE(smq_utils, message_pool_hands_out_every_message_once)
+{
+    smq_message_pool pool;
+    smq_message *messages[4] = { 0 };
+    STF_EXPECT(smq_message_pool_init(&pool, 4) == 0);
+    for (size_t i = 0; i < 4; i++) {
+        STF_EXPECT((messages[i] = smq_message_pool_acquire(&pool)) != NULL);
+        for (size_t j = 0; j < i; j++) {
+            STF_EXPECT(messages[i] != messages[j], .failure_msg = "pool handed out the same message twice");
+        }
+    }
+    STF_EXPECT(smq_message_pool_acquire(&pool) == NULL, .failure_msg = "exhausted pool should not grow");
+    smq_message_write(messages[0], "dirty", 5);
+    messages[0]->header.seq = 7;
+    smq_message_pool_release(&pool, messages[0]);
+    smq_message *reused = smq_message_pool_acquire(&pool);
+    STF_EXPECT(reused == messages[0]);
+    STF_EXPECT(reused->header.seq == 0 && smq_message_length(reused) == 0 && reused->payload[0] == 0, .failure_msg = "released message was not cleared");
+    smq_message_pool_destroy(&pool);
+}
+
+STF_TEST_CASE(smq_utils, message_cache_batches_pool_traffic)
+{
+    smq_message_pool pool;
+    smq_message_cache cache;
+    smq_message *message = NULL;
+    STF_EXPECT(smq_message_pool_init(&pool, SMQ_MESSAGE_CACHE_SIZE * 2) == 0);
+    smq_message_cache_init(&cache, &pool);
+    STF_EXPECT((message = smq_message_cache_acquire(&cache)) != NULL);
+    STF_EXPECT(cache.count == SMQ_MESSAGE_CACHE_SIZE / 2 - 1, .failure_msg = "cache should refill half of its slots at once");
+    smq_message_cache_release(&cache, message);
+    smq_message_cache_flush(&cache);
+    STF_EXPECT(cache.count == 0);
+    for (size_t i = 0; i < SMQ_MESSAGE_CACHE_SIZE * 2; i++) {
+        STF_EXPECT(smq_message_pool_acquire(&pool) != NULL, .failure_msg = "flushed messages did not go back to the pool");
+    }
+    smq_message_pool_destroy(&pool);
+}
+
+#define QUOTE_SCHEMA(FIELD, ARRAY, s) \
+    FIELD(s, uint64_t, instrument) \
+    FIELD(s, double, price) \
+    ARRAY(s, char, venue, 8)
+SMQ_SCHEMA(quote, 7, QUOTE_SCHEMA)
+
+STF_TEST_CASE(smq_utils, schema_fields_round_trip_in_place)
+{
+    smq_message message = { 0 };
+    uint64_t instrument = 0;
+    double price = 0;
+    char venue[8] = { 0 };
+    quote_init(&message);
+    STF_EXPECT(message.header.schema == quote_schema_id && smq_message_length(&message) == quote_size);
+    quote_set_instrument(&message, 42);
+    quote_set_price(&message, 101.25);
+    quote_set_venue(&message, "XLONDON", 7);
+    quote_set_venue(&message, "XNAS", strlen("XNAS"));
+    STF_EXPECT(quote_check(&message) == 0);
+    STF_EXPECT(quote_get_instrument(&message) == 42 && quote_get_price(&message) == 101.25);
+    STF_EXPECT(quote_read_instrument(&message, &instrument) == 0 && quote_read_price(&message, &price) == 0);
+    STF_EXPECT(instrument == 42 && price == 101.25);
+    STF_EXPECT(strcmp(quote_get_venue(&message), "XNAS") == 0);
+    STF_EXPECT((const char *)quote_get_venue(&message) == &message.payload[offsetof(quote_layout, venue)], .failure_msg = "arrays should be read in place");
+    STF_EXPECT(quote_read_venue(&message, venue) == 0 && strcmp(venue, "XNAS") == 0, .failure_msg = "a shorter array value should zero the rest");
+    quote_set_venue(&message, "XLONDONEXCHANGE", strlen("XLONDONEXCHANGE"));
+    STF_EXPECT(memcmp(quote_get_venue(&message), "XLONDONE", 8) == 0 && quote_get_price(&message) == 101.25, .failure_msg = "a longer array value should stop at the array");
+}
+
+STF_TEST_CASE(smq_utils, schema_reads_are_bounds_checked)
+{
+    smq_message message = { 0 };
+    double price = 0;
+    char venue[8] = { 0 };
+    quote_init(&message);
+    quote_set_price(&message, 3.5);
+    smq_message_set_length(&message, offsetof(quote_layout, venue));
+    STF_EXPECT(quote_check(&message) == -EBADMSG);
+    STF_EXPECT(quote_read_price(&message, &price) == 0 && price == 3.5, .failure_msg = "fields inside the payload should stay readable");
+    STF_EXPECT(quote_read_venue(&message, venue) == -EBADMSG, .failure_msg = "read past the payload length");
+    message.header.schema = quote_schema_id + 1;
+    STF_EXPECT(quote_read_price(&message, &price) == -EPROTO && quote_check(&message) == -EPROTO);
+}
+
+STF_TEST_CASE(smq_utils, lz_round_trips_and_rejects_what_does_not_fit)
+{
+    char text[2048];
+    char packed[2048];
+    char unpacked[2048];
+    size_t length = 0;
+    int packed_length = 0;
+    for (int i = 0; length + 64 < sizeof(text); i++) {
+        length += (size_t)snprintf(&text[length], sizeof(text) - length, "{\"id\":%d,\"name\":\"item\",\"tags\":[\"a\",\"b\"]},", i);
+    }
+    STF_EXPECT((packed_length = smq_lz_compress(text, length, packed, sizeof(packed))) > 0);
+    STF_EXPECT((size_t)packed_length < length / 2, .failure_msg = "repetitive JSON should at least halve");
+    STF_EXPECT(smq_lz_decompress(packed, (size_t)packed_length, unpacked, sizeof(unpacked)) == (int)length);
+    STF_EXPECT(memcmp(text, unpacked, length) == 0);
+    STF_EXPECT(smq_lz_decompress(packed, (size_t)packed_length, unpacked, length - 1) == -EBADMSG, .failure_msg = "decoder wrote past its capacity");
+    srand(7);
+    for (size_t i = 0; i < sizeof(text); i++) {
+        text[i] = (char)rand();
+    }
+    STF_EXPECT(smq_lz_compress(text, sizeof(text), packed, sizeof(text) - 1) == -ENOSPC, .failure_msg = "random bytes should not shrink");
+}
+
+STF_TEST_CASE(smq_utils, codec_saving_of_100_pct_or_more_never_encodes)
+{
+    static const unsigned int saving_pcts[] = { 100, 150 };
+    smq_message message = { 0 };
+    for (size_t i = 0; i < sizeof(saving_pcts) / sizeof(saving_pcts[0]); i++) {
+        smq_codec codec = smq_codec_lz();
+        codec.min_saving_pct = saving_pcts[i];
+        memset(message.payload, 'a', 1024);
+        smq_message_set_length(&message, 1024);
+        message.header.flags = 0;
+        __smq_codec_encode_in_place(&codec, &message);
+        STF_EXPECT(smq_message_length(&message) == 1024 && !(message.header.flags & SMQ_FLAG_COMPRESSED), .failure_msg = "an unreachable saving should leave the payload as it is");
+    }
+}
+
 int main(void)
 {
     return STF_RUN_TESTS();
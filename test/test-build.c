@@ -25,7 +25,19 @@ int main(int argc, char **argv)
     if (!nob_cmd_run(&cmd)) return 1;
     nob_cmd_append(&cmd, "cc", "-Wall", "-Wextra", "-Wpedantic", "-D_POSIX_C_SOURCE=200112L", "-std=c11", "-Wpedantic", "-o", "build/smq-channel-listen-send", "-lpthread", "-lrt", "-Iinclude", "-Ibuild/deps", "test/smq-channel-listen-send.c");
     if (!nob_cmd_run(&cmd)) return 1;
-    nob_cmd_append(&cmd, "parallel", "--keep-order", ":::", "./build/smq-utils-test", "./build/smq-channel-create-test", "./build/smq-channel-listen-send", "./build/smq-server-client-test");
+    nob_cmd_append(&cmd, "cc", "-Wall", "-Wextra", "-Wpedantic", "-D_POSIX_C_SOURCE=200112L", "-std=c11", "-Wpedantic", "-o", "build/smq-channel-shm-test", "-lpthread", "-lrt", "-Iinclude", "-Ibuild/deps", "test/smq-channel-shm-test.c");
     if (!nob_cmd_run(&cmd)) return 1;
+    nob_cmd_append(&cmd, "cc", "-Wall", "-Wextra", "-Wpedantic", "-D_POSIX_C_SOURCE=200112L", "-std=c11", "-O2", "-o", "build/smq-bench", "-lpthread", "-lrt", "-Iinclude", "test/smq-bench.c");
+    if (!nob_cmd_run(&cmd)) return 1;
+    nob_cmd_append(&cmd, "parallel", "--keep-order", ":::", "./build/smq-utils-test", "./build/smq-channel-create-test", "./build/smq-channel-listen-send", "./build/smq-server-client-test", "./build/smq-channel-shm-test");
+    if (!nob_cmd_run(&cmd)) return 1;
+    // Benchmarks take a while and want an idle machine, so they only run on request: ./test-build bench [--csv | --json]
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        nob_cmd_append(&cmd, "./build/smq-bench");
+        for (int i = 2; i < argc; i++) {
+            nob_cmd_append(&cmd, argv[i]);
+        }
+        if (!nob_cmd_run(&cmd)) return 1;
+    }
     return 0;
 }